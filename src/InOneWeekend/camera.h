@@ -15,10 +15,10 @@
 #include "ray.h"
 
 
-vec3 random_in_unit_disk() {
+vec3 random_in_unit_disk(rng& gen) {
     vec3 p;
     do {
-        p = 2.0*vec3(random_double(),random_double(),0) - vec3(1,1,0);
+        p = 2.0*vec3(random_double(gen),random_double(gen),0) - vec3(1,1,0);
     } while (dot(p,p) >= 1.0);
     return p;
 }
@@ -45,8 +45,8 @@ class camera {
             horizontal = 2*half_width*focus_dist*u;
             vertical = 2*half_height*focus_dist*v;
         }
-        ray get_ray(double s, double t) {
-            vec3 rd = lens_radius*random_in_unit_disk();
+        ray get_ray(double s, double t, rng& gen) const {
+            vec3 rd = lens_radius*random_in_unit_disk(gen);
             vec3 offset = u * rd.x() + v * rd.y();
             return ray(
                 origin + offset,
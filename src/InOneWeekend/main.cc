@@ -10,6 +10,11 @@
 //==============================================================================================
 
 #include "common/rtweekend.h"
+#include "common/framebuffer.h"
+#include "common/image_writer.h"
+#include "common/render_options.h"
+#include "common/thread_pool.h"
+#include "common/tile_renderer.h"
 #include "camera.h"
 #include "hittable_list.h"
 #include "material.h"
@@ -18,15 +23,18 @@
 #include <iostream>
 
 
-vec3 ray_color(const ray& r, hittable *world, int depth) {
+// Each bounce draws from its own generator, addressed by the pixel and sample the path belongs
+// to and by the remaining depth. Dimension 0 is left to the camera.
+vec3 ray_color(const ray& r, hittable *world, int depth, uint32_t pixel, uint32_t sample) {
     hit_record rec;
     if (world->hit(r, 0.001, infinity, rec)) {
         if (depth <= 0)
             return vec3(0,0,0);
+        rng gen(pixel, sample, depth);
         ray scattered;
         vec3 attenuation;
-        if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-            return attenuation * ray_color(scattered, world, depth-1);
+        if (rec.mat_ptr->scatter(r, rec, attenuation, scattered, gen))
+            return attenuation * ray_color(scattered, world, depth-1, pixel, sample);
         return vec3(0,0,0);
     }
 
@@ -78,13 +86,15 @@ hittable *random_scene() {
 }
 
 
-int main() {
+int main(int argc, char *argv[]) {
     int nx = 1200;
     int ny = 800;
     int num_samples = 10;
     int max_depth = 50;
 
-    std::cout << "P3\n" << nx << ' ' << ny << "\n255\n";
+    render_options options(num_samples);
+    if (!options.parse(argc, argv))
+        return 1;
 
     hittable *world = random_scene();
 
@@ -95,19 +105,21 @@ int main() {
 
     camera cam(lookfrom, lookat, vec3(0,1,0), 20, double(nx)/ny, aperture, dist_to_focus);
 
-    for (int j = ny-1; j >= 0; --j) {
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-        for (int i = 0; i < nx; ++i) {
-            vec3 color;
-            for (int s = 0; s < num_samples; ++s) {
-                auto u = double(i + random_double()) / double(nx);
-                auto v = double(j + random_double()) / double(ny);
-                ray r = cam.get_ray(u, v);
-                color += ray_color(r, world, max_depth);
-            }
-            color.write_color(std::cout, num_samples);
-        }
-    }
+    framebuffer image(nx, ny);
+    thread_pool pool(options.threads);
+
+    render_progressive(image, pool, options, [&](int i, int j, uint32_t s) {
+        auto pixel = j*nx + i;
+        rng gen(pixel, s, 0);
+        auto u = double(i + random_double(gen)) / double(nx);
+        auto v = double(j + random_double(gen)) / double(ny);
+        ray r = cam.get_ray(u, v, gen);
+        return ray_color(r, world, max_depth, pixel, s);
+    });
+
+    // Image files named on the command line (.ppm, .png, .hdr), or a PPM on standard output.
+    if (!write_images(image, options.output_files))
+        return 1;
 
     std::cerr << "\nDone.\n";
 }
@@ -44,24 +44,24 @@ vec3 reflect(const vec3& v, const vec3& n) {
 }
 
 
-vec3 random_unit_vector() {
-    auto a = 2*pi * random_double();
-    auto z = 2*random_double() - 1;
+vec3 random_unit_vector(rng& gen) {
+    auto a = 2*pi * random_double(gen);
+    auto z = 2*random_double(gen) - 1;
     auto r = sqrt(1 - z*z);
     return vec3(r*cos(a), r*sin(a), z);
 }
 
 
-vec3 random_in_unit_sphere() {
+vec3 random_in_unit_sphere(rng& gen) {
     vec3 p;
     do {
-        p = 2.0*vec3(random_double(),random_double(),random_double()) - vec3(1,1,1);
+        p = 2.0*vec3(random_double(gen),random_double(gen),random_double(gen)) - vec3(1,1,1);
     } while (p.squared_length() >= 1.0);
     return p;
 }
 
-vec3 random_in_hemisphere(const vec3& normal) {
-    vec3 in_unit_sphere = random_in_unit_sphere();
+vec3 random_in_hemisphere(const vec3& normal, rng& gen) {
+    vec3 in_unit_sphere = random_in_unit_sphere(gen);
     if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
         return in_unit_sphere;
     else
@@ -72,7 +72,7 @@ vec3 random_in_hemisphere(const vec3& normal) {
 class material  {
     public:
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, rng& gen
         ) const = 0;
 };
 
@@ -81,9 +81,9 @@ class lambertian : public material {
     public:
         lambertian(const vec3& a) : albedo(a) {}
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, rng& gen
         ) const  {
-             vec3 target = rec.p + rec.normal + random_unit_vector();
+             vec3 target = rec.p + rec.normal + random_unit_vector(gen);
              scattered = ray(rec.p, target-rec.p);
              attenuation = albedo;
              return true;
@@ -97,10 +97,10 @@ class metal : public material {
     public:
         metal(const vec3& a, double f) : albedo(a) { if (f < 1) fuzz = f; else fuzz = 1; }
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, rng& gen
         ) const  {
             vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere());
+            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere(gen));
             attenuation = albedo;
             return (dot(scattered.direction(), rec.normal) > 0);
         }
@@ -113,7 +113,7 @@ class dielectric : public material {
     public:
         dielectric(double ri) : ref_idx(ri) {}
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, rng& gen
         ) const  {
             vec3 outward_normal;
             vec3 reflected = reflect(r_in.direction(), rec.normal);
@@ -141,7 +141,7 @@ class dielectric : public material {
             else
                reflect_prob = 1.0;
 
-            if (random_double() < reflect_prob)
+            if (random_double(gen) < reflect_prob)
                scattered = ray(rec.p, reflected);
             else
                scattered = ray(rec.p, refracted);
@@ -28,17 +28,39 @@ class aabb {
         vec3 max() const {return _max; }
 
         bool hit(const ray& r, double tmin, double tmax) const {
+            return hit(ray_query(r), tmin, tmax);
+        }
+
+        // Slab test. The direction signs pick each slab's entry and exit planes, so there is no
+        // swap to branch on. A ray lying in a slab's plane makes 0 * infinity = NaN there, which
+        // compares false and so leaves the interval as it was.
+        bool hit(const ray_query& q, double tmin, double tmax) const {
             for (int a = 0; a < 3; a++) {
-                auto t0 = ffmin((_min[a] - r.origin()[a]) / r.direction()[a],
-                                (_max[a] - r.origin()[a]) / r.direction()[a]);
-                auto t1 = ffmax((_min[a] - r.origin()[a]) / r.direction()[a],
-                                (_max[a] - r.origin()[a]) / r.direction()[a]);
-                tmin = ffmax(t0, tmin);
-                tmax = ffmin(t1, tmax);
-                if (tmax <= tmin)
-                    return false;
+                auto t0 = ((q.sign[a] ? _max : _min)[a] - q.origin[a]) * q.inv_dir[a];
+                auto t1 = ((q.sign[a] ? _min : _max)[a] - q.origin[a]) * q.inv_dir[a];
+                tmin = t0 > tmin ? t0 : tmin;
+                tmax = t1 < tmax ? t1 : tmax;
             }
-            return true;
+            return tmin < tmax;
+        }
+
+        double area() const {
+            auto a = _max.x() - _min.x();
+            auto b = _max.y() - _min.y();
+            auto c = _max.z() - _min.z();
+            return 2*(a*b + b*c + c*a);
+        }
+
+        int longest_axis() const {
+            auto a = _max.x() - _min.x();
+            auto b = _max.y() - _min.y();
+            auto c = _max.z() - _min.z();
+            if (a > b && a > c)
+                return 0;
+            else if (b > c)
+                return 1;
+            else
+                return 2;
         }
 
         vec3 _min;
@@ -55,4 +77,18 @@ aabb surrounding_box(aabb box0, aabb box1) {
     return aabb(small,big);
 }
 
+// The box where two boxes overlap. Returns false if they don't.
+bool overlapping_box(aabb box0, aabb box1, aabb& output_box) {
+    vec3 small( ffmax(box0.min().x(), box1.min().x()),
+                ffmax(box0.min().y(), box1.min().y()),
+                ffmax(box0.min().z(), box1.min().z()));
+    vec3 big  ( ffmin(box0.max().x(), box1.max().x()),
+                ffmin(box0.max().y(), box1.max().y()),
+                ffmin(box0.max().z(), box1.max().z()));
+    if (small.x() > big.x() || small.y() > big.y() || small.z() > big.z())
+        return false;
+    output_box = aabb(small,big);
+    return true;
+}
+
 #endif
@@ -22,7 +22,8 @@ class xy_rect: public hittable {
         xy_rect(double _x0, double _x1, double _y0, double _y1, double _k, material *mat)
             : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
 
-        virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+        virtual bool hit(const ray& r, double t0, double t1, hit_record& rec, rng& gen) const;
+        virtual bool occluded(const ray& r, double t0, double t1, rng& gen) const;
 
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
             output_box = aabb(vec3(x0,y0, k-0.0001), vec3(x1, y1, k+0.0001));
@@ -40,7 +41,8 @@ class xz_rect: public hittable {
         xz_rect(double _x0, double _x1, double _z0, double _z1, double _k, material *mat)
             : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-        virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+        virtual bool hit(const ray& r, double t0, double t1, hit_record& rec, rng& gen) const;
+        virtual bool occluded(const ray& r, double t0, double t1, rng& gen) const;
 
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
             output_box = aabb(vec3(x0,k-0.0001,z0), vec3(x1, k+0.0001, z1));
@@ -58,7 +60,8 @@ class yz_rect: public hittable {
         yz_rect(double _y0, double _y1, double _z0, double _z1, double _k, material *mat)
             : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-        virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+        virtual bool hit(const ray& r, double t0, double t1, hit_record& rec, rng& gen) const;
+        virtual bool occluded(const ray& r, double t0, double t1, rng& gen) const;
 
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
             output_box = aabb(vec3(k-0.0001, y0, z0), vec3(k+0.0001, y1, z1));
@@ -69,7 +72,16 @@ class yz_rect: public hittable {
         double y0, y1, z0, z1, k;
 };
 
-bool xy_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
+bool xy_rect::occluded(const ray& r, double t0, double t1, rng& gen) const {
+    auto t = (k-r.origin().z()) / r.direction().z();
+    if (t < t0 || t > t1)
+        return false;
+    auto x = r.origin().x() + t*r.direction().x();
+    auto y = r.origin().y() + t*r.direction().y();
+    return !(x < x0 || x > x1 || y < y0 || y > y1);
+}
+
+bool xy_rect::hit(const ray& r, double t0, double t1, hit_record& rec, rng& gen) const {
     auto t = (k-r.origin().z()) / r.direction().z();
     if (t < t0 || t > t1)
         return false;
@@ -86,7 +98,16 @@ bool xy_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
     return true;
 }
 
-bool xz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
+bool xz_rect::occluded(const ray& r, double t0, double t1, rng& gen) const {
+    auto t = (k-r.origin().y()) / r.direction().y();
+    if (t < t0 || t > t1)
+        return false;
+    auto x = r.origin().x() + t*r.direction().x();
+    auto z = r.origin().z() + t*r.direction().z();
+    return !(x < x0 || x > x1 || z < z0 || z > z1);
+}
+
+bool xz_rect::hit(const ray& r, double t0, double t1, hit_record& rec, rng& gen) const {
     auto t = (k-r.origin().y()) / r.direction().y();
     if (t < t0 || t > t1)
         return false;
@@ -103,7 +124,16 @@ bool xz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
     return true;
 }
 
-bool yz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
+bool yz_rect::occluded(const ray& r, double t0, double t1, rng& gen) const {
+    auto t = (k-r.origin().x()) / r.direction().x();
+    if (t < t0 || t > t1)
+        return false;
+    auto y = r.origin().y() + t*r.direction().y();
+    auto z = r.origin().z() + t*r.direction().z();
+    return !(y < y0 || y > y1 || z < z0 || z > z1);
+}
+
+bool yz_rect::hit(const ray& r, double t0, double t1, hit_record& rec, rng& gen) const {
     auto t = (k-r.origin().x()) / r.direction().x();
     if (t < t0 || t > t1)
         return false;
@@ -12,42 +12,123 @@
 //==============================================================================================
 
 #include "common/rtweekend.h"
-#include "aarect.h"
-#include "hittable_list.h"
+#include "hittable.h"
 
+#include <utility>
 
+
+// The six faces of an axis-aligned box, tested all at once with one slab test: the ray hits the
+// face it enters through, or from inside, the one it leaves through. Each face is hit as the
+// rect in its place would be, with the normal pointing out of the box and u and v running along
+// the face's two axes in order, x before y before z.
 class box: public hittable  {
     public:
         box() {}
 
-        box(const vec3& p0, const vec3& p1, material *ptr);
+        box(const vec3& p0, const vec3& p1, material *ptr) : pmin(p0), pmax(p1), mp(ptr) {}
 
-        virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+        virtual bool find_hit(const ray& r, double t0, double t1, hit_record& rec, rng& gen) const {
+            if (!first_face(r, t0, t1, rec.t, rec.primitive))
+                return false;
+            rec.object = this;
+            return true;
+        }
+        virtual void finish_hit(const ray& r, hit_record& rec) const;
+        virtual bool occluded(const ray& r, double t0, double t1, rng& gen) const {
+            double t;
+            int face;
+            return first_face(r, t0, t1, t, face);
+        }
 
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
             output_box = aabb(pmin, pmax);
             return true;
         }
+        virtual bool clipped_bounding_box(
+            double t0, double t1, const aabb& clip, aabb& output_box
+        ) const;
 
         vec3 pmin, pmax;
-        hittable *list_ptr;
+        material *mp;
+
+    private:
+        // The first face the ray meets between t0 and t1, as its distance and its number: twice
+        // its axis, plus one on the pmax side.
+        bool first_face(const ray& r, double t0, double t1, double& t, int& face) const;
 };
 
-box::box(const vec3& p0, const vec3& p1, material *ptr) {
-    pmin = p0;
-    pmax = p1;
-    hittable **list = new hittable*[6];
-    list[0] = new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr);
-    list[1] = new flip_normals(new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
-    list[2] = new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr);
-    list[3] = new flip_normals(new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
-    list[4] = new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr);
-    list[5] = new flip_normals(new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
-    list_ptr = new hittable_list(list,6);
+bool box::first_face(const ray& r, double t0, double t1, double& t, int& face) const {
+    double enter = -infinity, leave = infinity;
+    int enter_face = -1, leave_face = -1;
+    for (int a = 0; a < 3; a++) {
+        // A ray parallel to the slab gets infinite distances, or NaN on its planes, and neither
+        // moves enter or leave.
+        auto near = (pmin[a] - r.origin()[a]) / r.direction()[a];
+        auto far = (pmax[a] - r.origin()[a]) / r.direction()[a];
+        int near_face = 2*a, far_face = 2*a + 1;
+        if (near > far) {
+            std::swap(near, far);
+            std::swap(near_face, far_face);
+        }
+        if (near > enter) {
+            enter = near;
+            enter_face = near_face;
+        }
+        if (far < leave) {
+            leave = far;
+            leave_face = far_face;
+        }
+    }
+    if (!(enter <= leave))
+        return false;
+    if (enter_face >= 0 && enter >= t0 && enter <= t1) {
+        t = enter;
+        face = enter_face;
+        return true;
+    }
+    if (leave_face >= 0 && leave >= t0 && leave <= t1) {
+        t = leave;
+        face = leave_face;
+        return true;
+    }
+    return false;
+}
+
+// The union of the faces' parts inside the clip box, each face as thick as the rects' boxes. A
+// clip box inside the box holds none of it.
+bool box::clipped_bounding_box(
+    double t0, double t1, const aabb& clip, aabb& output_box
+) const {
+    bool any = false;
+    for (int a = 0; a < 3; a++) {
+        for (int side = 0; side < 2; side++) {
+            vec3 small = pmin, big = pmax;
+            auto k = side ? pmax[a] : pmin[a];
+            small[a] = k - 0.0001;
+            big[a] = k + 0.0001;
+            aabb piece;
+            if (overlapping_box(aabb(small, big), clip, piece)) {
+                output_box = any ? surrounding_box(output_box, piece) : piece;
+                any = true;
+            }
+        }
+    }
+    return any;
 }
 
-bool box::hit(const ray& r, double t0, double t1, hit_record& rec) const {
-    return list_ptr->hit(r, t0, t1, rec);
+// The face hit is the record's primitive.
+void box::finish_hit(const ray& r, hit_record& rec) const {
+    int face = rec.primitive;
+    int axis = face / 2;
+    int u_axis = axis == 0 ? 1 : 0;
+    int v_axis = axis == 2 ? 1 : 2;
+    rec.p = r.point_at_parameter(rec.t);
+    rec.u = (rec.p[u_axis] - pmin[u_axis]) / (pmax[u_axis] - pmin[u_axis]);
+    rec.v = (rec.p[v_axis] - pmin[v_axis]) / (pmax[v_axis] - pmin[v_axis]);
+    vec3 normal(0, 0, 0);
+    normal[axis] = face % 2 ? 1 : -1;
+    rec.normal = normal;
+    rec.mat_ptr = mp;
 }
 
 #endif
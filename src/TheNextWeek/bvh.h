@@ -12,20 +12,46 @@
 //==============================================================================================
 
 #include "common/rtweekend.h"
+#include "common/traversal_stats.h"
 #include "hittable.h"
+#include "instance.h"
+
+#include <algorithm>
 
 
 class bvh_node : public hittable  {
     public:
-        bvh_node() {}
+        bvh_node() : left_is_node(false), right_is_node(false) {}
         bvh_node(hittable **l, int n, double time0, double time1);
 
-        virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+        virtual bool find_hit(
+            const ray& r, double tmin, double tmax, hit_record& rec, rng& gen
+        ) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax, rng& gen) const;
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
 
         hittable *left;
         hittable *right;
         aabb box;
+        int axis;   // left lies below right along this axis
+        bool left_is_node, right_is_node;   // whether the children are bvh_nodes
+
+    private:
+        bool hit_node(
+            const ray& r, const ray_query& q, double t_min, double t_max, hit_record& rec,
+            rng& gen
+        ) const;
+        bool occluded_node(
+            const ray& r, const ray_query& q, double t_min, double t_max, rng& gen
+        ) const;
+        static bool hit_child(
+            const hittable *child, bool is_node, const ray& r, const ray_query& q,
+            double t_min, double t_max, hit_record& rec, rng& gen
+        );
+        static bool occluded_child(
+            const hittable *child, bool is_node, const ray& r, const ray_query& q,
+            double t_min, double t_max, rng& gen
+        );
 };
 
 bool bvh_node::bounding_box(double t0, double t1, aabb& output_box) const {
@@ -33,31 +59,73 @@ bool bvh_node::bounding_box(double t0, double t1, aabb& output_box) const {
     return true;
 }
 
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    if (box.hit(r, t_min, t_max)) {
-        hit_record left_rec, right_rec;
-        bool hit_left = left->hit(r, t_min, t_max, left_rec);
-        bool hit_right = right->hit(r, t_min, t_max, right_rec);
-
-        if (hit_left && hit_right) {
-            if (left_rec.t < right_rec.t)
-                rec = left_rec;
-            else
-                rec = right_rec;
-            return true;
-        }
-        else if (hit_left) {
-            rec = left_rec;
-            return true;
-        }
-        else if (hit_right) {
-            rec = right_rec;
-            return true;
-        }
-        else
-            return false;
+bool bvh_node::find_hit(
+    const ray& r, double t_min, double t_max, hit_record& rec, rng& gen
+) const {
+    return hit_node(r, ray_query(r), t_min, t_max, rec, gen);
+}
+
+bool bvh_node::occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+    return occluded_node(r, ray_query(r), t_min, t_max, gen);
+}
+
+// Below the root, child nodes are entered directly with the root's ray_query; only primitives
+// go through the virtual calls.
+bool bvh_node::hit_child(
+    const hittable *child, bool is_node, const ray& r, const ray_query& q,
+    double t_min, double t_max, hit_record& rec, rng& gen
+) {
+    if (is_node)
+        return static_cast<const bvh_node*>(child)->hit_node(r, q, t_min, t_max, rec, gen);
+    count_primitive_test();
+    return child->find_hit(r, t_min, t_max, rec, gen);
+}
+
+bool bvh_node::occluded_child(
+    const hittable *child, bool is_node, const ray& r, const ray_query& q,
+    double t_min, double t_max, rng& gen
+) {
+    if (is_node)
+        return static_cast<const bvh_node*>(child)->occluded_node(r, q, t_min, t_max, gen);
+    count_primitive_test();
+    return child->occluded(r, t_min, t_max, gen);
+}
+
+bool bvh_node::hit_node(
+    const ray& r, const ray_query& q, double t_min, double t_max, hit_record& rec, rng& gen
+) const {
+    count_node_visit();
+    if (!box.hit(q, t_min, t_max))
+        return false;
+
+    // Visit the child on the near side of the split first. Once it has hit something, the far
+    // child only has to find a closer hit, and overwrites rec only if it does.
+    const hittable *first = left, *second = right;
+    bool first_node = left_is_node, second_node = right_is_node;
+    if (q.sign[axis]) {
+        std::swap(first, second);
+        std::swap(first_node, second_node);
     }
-    else return false;
+
+    bool hit_first = hit_child(first, first_node, r, q, t_min, t_max, rec, gen);
+    if (second == first)
+        return hit_first;
+    bool hit_second = hit_child(
+        second, second_node, r, q, t_min, hit_first ? rec.t : t_max, rec, gen);
+    return hit_first || hit_second;
+}
+
+bool bvh_node::occluded_node(
+    const ray& r, const ray_query& q, double t_min, double t_max, rng& gen
+) const {
+    count_node_visit();
+    if (!box.hit(q, t_min, t_max))
+        return false;
+    if (occluded_child(left, left_is_node, r, q, t_min, t_max, gen))
+        return true;
+    if (right == left)
+        return false;
+    return occluded_child(right, right_is_node, r, q, t_min, t_max, gen);
 }
 
 int box_x_compare (const void * a, const void * b) {
@@ -105,7 +173,7 @@ int box_z_compare (const void * a, const void * b)
 }
 
 bvh_node::bvh_node(hittable **l, int n, double time0, double time1) {
-    int axis = int(3*random_double());
+    axis = int(3*random_double());
 
     if (axis == 0)
         qsort(l, n, sizeof(hittable *), box_x_compare);
@@ -114,12 +182,13 @@ bvh_node::bvh_node(hittable **l, int n, double time0, double time1) {
     else
         qsort(l, n, sizeof(hittable *), box_z_compare);
 
+    left_is_node = right_is_node = n > 2;
     if (n == 1) {
-        left = right = l[0];
+        left = right = fold_transforms(l[0]);
     }
     else if (n == 2) {
-        left = l[0];
-        right = l[1];
+        left = fold_transforms(l[0]);
+        right = fold_transforms(l[1]);
     }
     else {
         left = new bvh_node(l, n/2, time0, time1);
@@ -0,0 +1,343 @@
+#ifndef BVH_BUILD_H
+#define BVH_BUILD_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "common/thread_pool.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+
+// How the BVH builders choose their splits.
+//
+// split_sah bins the primitive centroids along each axis and takes the bin boundary with the
+// lowest surface area heuristic cost,
+//
+//     traversal_cost + intersection_cost * (area(L)*count(L) + area(R)*count(R)) / area(node),
+//
+// making a leaf instead when that is no cheaper than testing every primitive in the node
+// (intersection_cost * count) and the node has at most max_leaf_size primitives.
+// split_median halves the primitives at the median centroid along the widest axis, and stops
+// at max_leaf_size.
+//
+// split_lbvh sorts the primitives along a Morton curve and builds a radix tree over the codes
+// (see lbvh.h). It builds several times faster than split_sah, and treelet_passes rounds of
+// treelet restructuring improve the tree further. Only flat_bvh builds this way; bvh_node treats
+// it as split_sah.
+//
+// split_sbvh also considers spatial splits, which cut primitives that straddle the split plane
+// into a piece on either side (see sbvh.h). It is for scenes mixing primitives of very different
+// sizes, where object splits leave large boxes overlapping everything near them. The tree may
+// then refer to a primitive from more than one leaf; spatial_split_budget caps how many more
+// references than primitives there may be, as a fraction of the primitives. Only flat_bvh and
+// the wide BVHs build this way, on one thread and without the cache. Elsewhere, and when
+// update() rebuilds a tree, it is split_sah.
+//
+// Builders given more than one thread (threads = 0 means one per hardware thread) bin the top
+// levels in parallel and then build the subtrees below them as separate tasks. Both steps make
+// exactly the decisions the serial build makes, so the tree is the same for any thread count.
+//
+// flat_bvh and the wide BVHs keep the trees they build in cache_directory, when it is set, and
+// map them from there instead of building them again (see bvh_cache.h). It starts out as
+// default_cache_directory(), which the programs set from their --bvh-cache option.
+//
+// rebuild_growth is for trees that are refit as their primitives move (flat_bvh::update()): a
+// tree, or part of one, is rebuilt once its SAH cost has grown by this factor since it was built.
+
+struct bvh_build_options {
+    enum split_method { split_median, split_sah, split_lbvh, split_sbvh };
+
+    bvh_build_options()
+      : split(split_sah), bins(16), max_leaf_size(8), traversal_cost(1), intersection_cost(2),
+        treelet_passes(0), threads(0), cache_directory(default_cache_directory()),
+        rebuild_growth(1.5), spatial_split_budget(0.5) {}
+
+    static const char *&default_cache_directory() {
+        static const char *directory = 0;
+        return directory;
+    }
+
+    split_method split;
+    int bins;
+    int max_leaf_size;
+    double traversal_cost;
+    double intersection_cost;
+    int treelet_passes;
+    int threads;
+    const char *cache_directory;    // null for none
+    double rebuild_growth;
+    double spatial_split_budget;
+};
+
+// Ranges shorter than this are not worth spreading over a thread pool.
+const int bvh_parallel_grain = 16384;
+
+inline int bvh_piece_count(thread_pool *pool, int n) {
+    return pool ? std::max(1, std::min(n / bvh_parallel_grain, 4 * pool->size())) : 1;
+}
+
+// Splits [begin, end) into bvh_piece_count() pieces of at least bvh_parallel_grain and calls
+// task(piece_begin, piece_end, piece) for each, on the pool if there is one. Returns the number
+// of pieces.
+template <typename range_function>
+int bvh_for_pieces(thread_pool *pool, int begin, int end, const range_function& task) {
+    int n = end - begin;
+    int pieces = bvh_piece_count(pool, n);
+    auto run = [&](int piece, int) {
+        task(begin + static_cast<int>(static_cast<long long>(n) * piece / pieces),
+             begin + static_cast<int>(static_cast<long long>(n) * (piece+1) / pieces),
+             piece);
+    };
+    if (pieces == 1)
+        run(0, 0);
+    else
+        pool->parallel_for(pieces, run);
+    return pieces;
+}
+
+// Refits a tree laid out depth first, with every subtree in one contiguous run of nodes starting
+// at its root, by calling refit_node(i) for each node after it has been called for the nodes
+// below. children(i, out) lists in out, which has room for eight, those children of node i that
+// are nodes of their own, in order, and returns how many there are: all of them, leaves included,
+// in a flat_bvh, and only the interior ones in a wide_bvh, whose leaves are slots in their parent.
+// With a pool, the subtrees below the top levels are refit as separate tasks, and the top levels
+// after them.
+template <typename children_function, typename refit_function>
+void bvh_refit_depth_first(
+    int num_nodes, thread_pool *pool, const children_function& children,
+    const refit_function& refit_node
+) {
+    if (!pool || num_nodes < 2*bvh_parallel_grain) {
+        for (int i = num_nodes - 1; i >= 0; i--)
+            refit_node(i);
+        return;
+    }
+
+    // A subtree ends where the subtree of its last child does.
+    auto subtree_end = [&](int i) {
+        int child[8];
+        for (;;) {
+            int count = children(i, child);
+            if (count == 0)
+                return i + 1;
+            i = child[count-1];
+        }
+    };
+
+    // Parents come before their children in `top`.
+    std::vector<int> top, subtrees;
+    std::vector<int> pending(1, 0);
+    int child[8];
+    int grain = std::max(bvh_parallel_grain, num_nodes / (8 * pool->size()));
+    while (!pending.empty()) {
+        int i = pending.back();
+        pending.pop_back();
+        if (subtree_end(i) - i <= grain) {
+            subtrees.push_back(i);
+            continue;
+        }
+        top.push_back(i);
+        int count = children(i, child);
+        pending.insert(pending.end(), child, child + count);
+    }
+
+    pool->parallel_for(static_cast<int>(subtrees.size()), [&](int t, int) {
+        int root = subtrees[t];
+        for (int i = subtree_end(root) - 1; i >= root; i--)
+            refit_node(i);
+    });
+    for (auto i = top.rbegin(); i != top.rend(); ++i)
+        refit_node(*i);
+}
+
+
+// The bounds and centroid of every primitive, queried once so that building never calls
+// bounding_box() again.
+
+struct bvh_primitives {
+    // For builders over things other than hittables, which fill in the boxes and centroids.
+    explicit bvh_primitives(int n) : boxes(n), centroids(n) {}
+
+    bvh_primitives(
+        hittable **l, int n, double time0, double time1, thread_pool *pool = 0
+    ) : boxes(n), centroids(n) {
+        std::atomic<bool> missing(false);     // set from the pool's threads
+        bvh_for_pieces(pool, 0, n, [&](int begin, int end, int) {
+            for (int i = begin; i < end; i++) {
+                if (!l[i]->bounding_box(time0, time1, boxes[i]))
+                    missing.store(true, std::memory_order_relaxed);
+                centroids[i] = 0.5 * (boxes[i].min() + boxes[i].max());
+            }
+        });
+        if (missing)
+            std::cerr << "no bounding box in bvh constructor\n";
+    }
+
+    std::vector<aabb> boxes;
+    std::vector<vec3> centroids;
+};
+
+// The bounds of primitives index[begin, end), and the bounds of their centroids.
+inline void bvh_range_bounds(
+    const bvh_primitives& prims, const int *index, int begin, int end,
+    aabb& bounds, aabb& centroid_bounds, thread_pool *pool = 0
+) {
+    std::vector<aabb> piece_bounds(pool ? 4 * pool->size() : 1);
+    std::vector<aabb> piece_centroids(piece_bounds.size());
+    int pieces = bvh_for_pieces(pool, begin, end, [&](int first, int last, int piece) {
+        aabb b = prims.boxes[index[first]];
+        aabb c(prims.centroids[index[first]], prims.centroids[index[first]]);
+        for (int i = first + 1; i < last; i++) {
+            const vec3& centroid = prims.centroids[index[i]];
+            b = surrounding_box(b, prims.boxes[index[i]]);
+            c = surrounding_box(c, aabb(centroid, centroid));
+        }
+        piece_bounds[piece] = b;
+        piece_centroids[piece] = c;
+    });
+
+    // Unions are exact, so merging the pieces gives the serial result.
+    bounds = piece_bounds[0];
+    centroid_bounds = piece_centroids[0];
+    for (int piece = 1; piece < pieces; piece++) {
+        bounds = surrounding_box(bounds, piece_bounds[piece]);
+        centroid_bounds = surrounding_box(centroid_bounds, piece_centroids[piece]);
+    }
+}
+
+// Per-axis SAH bins: the bounds and number of the primitives whose centroids fall in each.
+struct bvh_bins {
+    bvh_bins(int n) : bins(n), bounds(3*n), counts(3*n, 0) {}
+
+    int bin(const vec3& centroid, int axis, const vec3& cmin, const vec3& scale) const {
+        return std::min(int((centroid[axis] - cmin[axis]) * scale[axis]), bins-1);
+    }
+
+    void add(const aabb& box, int b) {
+        bounds[b] = counts[b]++ ? surrounding_box(bounds[b], box) : box;
+    }
+
+    void merge(const bvh_bins& other) {
+        for (int b = 0; b < 3*bins; b++)
+            if (other.counts[b]) {
+                bounds[b] = counts[b] ? surrounding_box(bounds[b], other.bounds[b])
+                                      : other.bounds[b];
+                counts[b] += other.counts[b];
+            }
+    }
+
+    int bins;
+    std::vector<aabb> bounds;   // axis a, bin b at [a*bins + b]
+    std::vector<int> counts;
+};
+
+// Partitions index[begin, end) for a split and returns the first index of the second half,
+// setting `axis` to the split axis. Returns -1 if the range should be a leaf, which is only
+// considered when allow_leaf is set. Ranges whose centroids all coincide are split in half as
+// they are. Long ranges are binned on the pool, if there is one.
+inline int bvh_split(
+    const bvh_primitives& prims, int *index, int begin, int end,
+    const aabb& bounds, const aabb& centroid_bounds, const bvh_build_options& options,
+    bool allow_leaf, int& axis, thread_pool *pool = 0
+) {
+    int n = end - begin;
+    bool may_stop = allow_leaf && n <= options.max_leaf_size;
+    axis = centroid_bounds.longest_axis();
+    auto cmin = centroid_bounds.min();
+    auto extent = centroid_bounds.max() - cmin;
+
+    if (options.split == bvh_build_options::split_median || n <= 2 || extent[axis] <= 0) {
+        if (may_stop)
+            return -1;
+        int mid = begin + n/2;
+        if (extent[axis] > 0) {
+            const int a = axis;
+            std::nth_element(index + begin, index + mid, index + end, [&](int i, int j) {
+                return prims.centroids[i][a] < prims.centroids[j][a];
+            });
+        }
+        return mid;
+    }
+
+    const int bins = std::max(options.bins, 2);
+    vec3 scale;
+    for (int a = 0; a < 3; a++)
+        scale[a] = extent[a] > 0 ? bins / extent[a] : 0;
+
+    std::vector<bvh_bins> piece_bins(pool ? 4 * pool->size() : 1, bvh_bins(bins));
+    int pieces = bvh_for_pieces(pool, begin, end, [&](int first, int last, int piece) {
+        auto& counted = piece_bins[piece];
+        for (int i = first; i < last; i++) {
+            const vec3& c = prims.centroids[index[i]];
+            const aabb& box = prims.boxes[index[i]];
+            for (int a = 0; a < 3; a++)
+                counted.add(box, a*bins + counted.bin(c, a, cmin, scale));
+        }
+    });
+    auto& counted = piece_bins[0];
+    for (int piece = 1; piece < pieces; piece++)
+        counted.merge(piece_bins[piece]);
+
+    auto area = bounds.area();
+    auto inv_area = area > 0 ? 1 / area : 0;
+    auto best_cost = infinity;
+    int best_axis = -1, best_bin = 0;
+    std::vector<double> right_area(bins);
+
+    for (int a = 0; a < 3; a++) {
+        if (extent[a] <= 0)
+            continue;
+        const aabb *bin_bounds = &counted.bounds[a*bins];
+        const int *bin_counts = &counted.counts[a*bins];
+
+        // Sweep from the right for the area right of each boundary, then from the left to
+        // price every boundary.
+        aabb sweep;
+        int count = 0;
+        for (int b = bins-1; b > 0; b--) {
+            if (bin_counts[b])
+                sweep = count ? surrounding_box(sweep, bin_bounds[b]) : bin_bounds[b];
+            count += bin_counts[b];
+            right_area[b] = count ? sweep.area() * count : 0;
+        }
+
+        count = 0;
+        for (int b = 0; b < bins-1; b++) {
+            if (bin_counts[b])
+                sweep = count ? surrounding_box(sweep, bin_bounds[b]) : bin_bounds[b];
+            count += bin_counts[b];
+            if (count == 0 || count == n)
+                continue;
+            auto cost = options.traversal_cost
+                      + options.intersection_cost * (sweep.area()*count + right_area[b+1])
+                      * inv_area;
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = a;
+                best_bin = b;
+            }
+        }
+    }
+
+    if (may_stop && best_cost >= options.intersection_cost * n)
+        return -1;
+
+    axis = best_axis;
+    auto split = std::partition(index + begin, index + end, [&](int i) {
+        return counted.bin(prims.centroids[i], axis, cmin, scale) <= best_bin;
+    });
+    return static_cast<int>(split - index);
+}
+
+#endif
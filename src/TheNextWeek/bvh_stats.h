@@ -0,0 +1,382 @@
+#ifndef BVH_STATS_H
+#define BVH_STATS_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "common/traversal_stats.h"
+#include "bvh.h"
+#include "constant_medium.h"
+#include "flat_bvh.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "motion_bvh.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
+#include "wide_bvh.h"
+
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// The shape and quality of one BVH, in terms that compare across bvh_node, flat_bvh, the wide
+// BVHs, motion_bvh and the trees inside triangle_meshes and sphere_sets:
+//
+//     nodes            node records stored: a flat_bvh's leaves are among them, while a wide
+//                      BVH's leaves are slots in its nodes and a bvh_node's are its primitives
+//     leaves           and leaf_sizes, how many leaves hold each number of primitives
+//     primitives       references to primitives in the leaves
+//     max_depth        and average_depth, over the leaves, counting the interior nodes above
+//     sah_cost         the expected cost of a ray through the root's box, with the traversal and
+//                      intersection costs of the default bvh_build_options
+//     overlap          the area that sibling boxes share, pair by pair, over the total area of
+//                      the interior nodes: 0 when no two children overlap
+//     memory_bytes     the nodes and the arrays of primitive pointers or ids
+class bvh_stats {
+    public:
+        explicit bvh_stats(const std::string& type)
+          : type(type), nodes(0), leaves(0), primitives(0), max_depth(0), average_depth(0),
+            sah_cost(0), overlap(0), memory_bytes(0), depth_sum(0), cost(0), interior_area(0),
+            shared_area(0) {}
+
+        void add_leaf(int depth, int count, const aabb& bounds);
+        void add_interior(const aabb& bounds, const aabb *children, int n);
+        void finish(const aabb& root);
+        void write_json(std::ostream& out) const;
+
+        std::string type;
+        long nodes;
+        long leaves;
+        long primitives;
+        std::vector<long> leaf_sizes;
+        int max_depth;
+        double average_depth;
+        double sah_cost;
+        double overlap;
+        size_t memory_bytes;
+
+    private:
+        double depth_sum;
+        double cost;            // summed over nodes, not yet divided by the root's area
+        double interior_area;
+        double shared_area;
+};
+
+void bvh_stats::add_leaf(int depth, int count, const aabb& bounds) {
+    leaves++;
+    primitives += count;
+    if (int(leaf_sizes.size()) <= count)
+        leaf_sizes.resize(count + 1);
+    leaf_sizes[count]++;
+    max_depth = depth > max_depth ? depth : max_depth;
+    depth_sum += depth;
+    cost += bvh_build_options().intersection_cost * count * bounds.area();
+}
+
+void bvh_stats::add_interior(const aabb& bounds, const aabb *children, int n) {
+    cost += bvh_build_options().traversal_cost * bounds.area();
+    interior_area += bounds.area();
+    for (int i = 0; i < n; i++) {
+        for (int j = i+1; j < n; j++) {
+            aabb shared;
+            if (overlapping_box(children[i], children[j], shared))
+                shared_area += shared.area();
+        }
+    }
+}
+
+void bvh_stats::finish(const aabb& root) {
+    average_depth = leaves ? depth_sum / leaves : 0;
+    sah_cost = root.area() > 0 ? cost / root.area() : 0;
+    overlap = interior_area > 0 ? shared_area / interior_area : 0;
+}
+
+void bvh_stats::write_json(std::ostream& out) const {
+    out << "{\"type\": \"" << type << "\", \"nodes\": " << nodes << ", \"leaves\": " << leaves
+        << ", \"primitives\": " << primitives << ", \"leaf_sizes\": [";
+    for (size_t k = 0; k < leaf_sizes.size(); k++)
+        out << (k ? ", " : "") << leaf_sizes[k];
+    out << "], \"max_depth\": " << max_depth << ", \"average_depth\": " << average_depth
+        << ", \"sah_cost\": " << sah_cost << ", \"overlap\": " << overlap
+        << ", \"memory_bytes\": " << memory_bytes << "}";
+}
+
+
+inline aabb bvh_stats_box(const float *low, const float *high) {
+    return aabb(vec3(low[0], low[1], low[2]), vec3(high[0], high[1], high[2]));
+}
+
+// Adds the nodes of a tree in flat_bvh's layout to stats. Children follow their parents in the
+// array, so every node's depth is known before it.
+void measure_flat_nodes(bvh_stats& stats, const flat_bvh_node *nodes, int num_nodes) {
+    std::vector<int> depth(num_nodes);
+    for (int i = 0; i < num_nodes; i++) {
+        const flat_bvh_node& node = nodes[i];
+        auto bounds = bvh_stats_box(node.bounds_min, node.bounds_max);
+        if (node.is_leaf()) {
+            stats.add_leaf(depth[i], node.count, bounds);
+            continue;
+        }
+        const flat_bvh_node& first = nodes[i+1];
+        const flat_bvh_node& second = nodes[node.offset];
+        aabb children[2] = {
+            bvh_stats_box(first.bounds_min, first.bounds_max),
+            bvh_stats_box(second.bounds_min, second.bounds_max)
+        };
+        stats.add_interior(bounds, children, 2);
+        depth[i+1] = depth[node.offset] = depth[i] + 1;
+    }
+    stats.finish(bvh_stats_box(nodes[0].bounds_min, nodes[0].bounds_max));
+}
+
+bvh_stats measure_bvh(const flat_bvh& tree) {
+    bvh_stats stats("flat_bvh");
+    stats.nodes = tree.num_nodes;
+    stats.memory_bytes = tree.num_nodes * sizeof(flat_bvh_node)
+                       + (tree.prims ? tree.num_prims * sizeof(hittable*) : 0)
+                       + tree.order.size() * sizeof(int);
+    if (tree.num_prims > 0)
+        measure_flat_nodes(stats, tree.nodes, tree.num_nodes);
+    return stats;
+}
+
+// A mesh's tree, whether it built it or its buffers came with one; the triangles themselves are
+// not counted.
+bvh_stats measure_bvh(const triangle_mesh& mesh) {
+    bvh_stats stats("triangle_mesh");
+    stats.nodes = mesh.num_nodes;
+    stats.memory_bytes = mesh.num_nodes * sizeof(flat_bvh_node)
+                       + (mesh.order ? mesh.buffers->num_triangles * sizeof(int) : 0);
+    if (mesh.buffers->num_triangles > 0)
+        measure_flat_nodes(stats, mesh.nodes, mesh.num_nodes);
+    return stats;
+}
+
+template <int width>
+bvh_stats measure_bvh(const wide_bvh<width>& tree) {
+    bvh_stats stats(width == 4 ? "bvh4" : "bvh8");
+    stats.nodes = tree.num_nodes;
+    stats.memory_bytes = tree.num_nodes * sizeof(wide_bvh_node<width>)
+                       + (tree.prims ? tree.num_prims * sizeof(hittable*) : 0)
+                       + tree.order.size() * sizeof(int);
+    if (tree.num_prims == 0)
+        return stats;
+
+    // A node's box is the one its parent keeps for it; the root's is the tree's.
+    std::vector<std::pair<int, aabb> > stack(1, std::make_pair(0, tree.box));
+    std::vector<int> depth(tree.num_nodes);
+    while (!stack.empty()) {
+        int i = stack.back().first;
+        aabb bounds = stack.back().second;
+        stack.pop_back();
+
+        const wide_bvh_node<width>& node = tree.nodes[i];
+        aabb children[width];
+        int n = 0;
+        for (int k = 0; k < width; k++) {
+            if (node.count[k] == 0 && node.child[k] == 0)
+                continue;
+            float low[3], high[3];
+            for (int a = 0; a < 3; a++) {
+                low[a] = node.bounds[a][k];
+                high[a] = node.bounds[3+a][k];
+            }
+            children[n] = bvh_stats_box(low, high);
+            if (node.count[k] > 0)
+                stats.add_leaf(depth[i] + 1, node.count[k], children[n]);
+            else {
+                depth[node.child[k]] = depth[i] + 1;
+                stack.push_back(std::make_pair(int(node.child[k]), children[n]));
+            }
+            n++;
+        }
+        stats.add_interior(bounds, children, n);
+    }
+    stats.finish(tree.box);
+    return stats;
+}
+
+// The set's tree, without the spheres themselves.
+bvh_stats measure_bvh(const sphere_set& set) {
+    bvh_stats stats = measure_bvh(*set.tree);
+    stats.type = "sphere_set";
+    return stats;
+}
+
+// One for each of the tree's time segments, with every node's boxes at the two ends of its
+// segment taken together.
+std::vector<bvh_stats> measure_bvh(const motion_bvh& tree) {
+    std::vector<bvh_stats> segments;
+    for (const auto& seg : tree.segments) {
+        bvh_stats stats("motion_bvh");
+        stats.nodes = seg.num_nodes;
+        stats.memory_bytes = seg.num_nodes * sizeof(motion_bvh_node)
+                           + seg.num_prims * sizeof(hittable*);
+        auto node_box = [&](int i) {
+            const motion_bvh_node& node = seg.nodes[i];
+            return surrounding_box(bvh_stats_box(node.bounds_min[0], node.bounds_max[0]),
+                                   bvh_stats_box(node.bounds_min[1], node.bounds_max[1]));
+        };
+        std::vector<int> depth(seg.num_nodes);
+        for (int i = 0; seg.num_prims > 0 && i < seg.num_nodes; i++) {
+            const motion_bvh_node& node = seg.nodes[i];
+            if (node.is_leaf()) {
+                stats.add_leaf(depth[i], node.count, node_box(i));
+                continue;
+            }
+            aabb children[2] = { node_box(i+1), node_box(node.offset) };
+            stats.add_interior(node_box(i), children, 2);
+            depth[i+1] = depth[node.offset] = depth[i] + 1;
+        }
+        if (seg.num_prims > 0)
+            stats.finish(node_box(0));
+        segments.push_back(stats);
+    }
+    return segments;
+}
+
+bvh_stats measure_bvh(const bvh_node& root) {
+    bvh_stats stats("bvh_node");
+    std::vector<std::pair<const bvh_node*, int> > stack(1, std::make_pair(&root, 0));
+    while (!stack.empty()) {
+        const bvh_node *node = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+        stats.nodes++;
+
+        const hittable *child[2] = { node->left, node->right };
+        bool is_node[2] = { node->left_is_node, node->right_is_node };
+        int n = node->right == node->left ? 1 : 2;
+        aabb children[2];
+        for (int k = 0; k < n; k++) {
+            // The tree doesn't keep its shutter times; the programs' is [0, 1].
+            child[k]->bounding_box(0, 1, children[k]);
+            if (is_node[k])
+                stack.push_back(std::make_pair(static_cast<const bvh_node*>(child[k]), depth+1));
+            else
+                stats.add_leaf(depth + 1, 1, children[k]);
+        }
+        stats.add_interior(node->box, children, n);
+    }
+    stats.memory_bytes = stats.nodes * sizeof(bvh_node);
+    stats.finish(root.box);
+    return stats;
+}
+
+
+// Every BVH in a scene, found through lists, transforms, participating media and the primitives
+// of other BVHs. A tree referenced from several places, as instanced geometry is, is measured
+// once.
+class bvh_report {
+    public:
+        explicit bvh_report(const hittable *world) { visit(world); }
+
+        // The trees and, if the program counts traversal (see traversal_stats.h), the work each
+        // kind of ray did, as one JSON object.
+        void write_json(std::ostream& out) const;
+
+        std::vector<bvh_stats> trees;
+
+    private:
+        void visit(const hittable *p);
+
+        std::set<const hittable*> seen;
+};
+
+void bvh_report::visit(const hittable *p) {
+    if (!p || !seen.insert(p).second)
+        return;
+
+    if (auto mesh = dynamic_cast<const triangle_mesh*>(p)) {
+        trees.push_back(measure_bvh(*mesh));
+    }
+    else if (auto set = dynamic_cast<const sphere_set*>(p)) {
+        trees.push_back(measure_bvh(*set));
+    }
+    else if (auto tree = dynamic_cast<const flat_bvh*>(p)) {
+        trees.push_back(measure_bvh(*tree));
+        for (int i = 0; i < tree->num_prims; i++)
+            visit(tree->prims[i]);
+    }
+    else if (auto tree = dynamic_cast<const bvh4*>(p)) {
+        trees.push_back(measure_bvh(*tree));
+        for (int i = 0; i < tree->num_prims; i++)
+            visit(tree->prims[i]);
+    }
+    else if (auto tree = dynamic_cast<const bvh8*>(p)) {
+        trees.push_back(measure_bvh(*tree));
+        for (int i = 0; i < tree->num_prims; i++)
+            visit(tree->prims[i]);
+    }
+    else if (auto tree = dynamic_cast<const motion_bvh*>(p)) {
+        auto segments = measure_bvh(*tree);
+        trees.insert(trees.end(), segments.begin(), segments.end());
+        for (const auto& seg : tree->segments)
+            for (int i = 0; i < seg.num_prims; i++)
+                visit(seg.prims[i]);
+    }
+    else if (auto node = dynamic_cast<const bvh_node*>(p)) {
+        trees.push_back(measure_bvh(*node));
+        std::vector<const bvh_node*> stack(1, node);
+        while (!stack.empty()) {
+            node = stack.back();
+            stack.pop_back();
+            if (node->left_is_node)
+                stack.push_back(static_cast<const bvh_node*>(node->left));
+            else
+                visit(node->left);
+            if (node->right_is_node)
+                stack.push_back(static_cast<const bvh_node*>(node->right));
+            else
+                visit(node->right);
+        }
+    }
+    else if (auto list = dynamic_cast<const hittable_list*>(p)) {
+        for (int i = 0; i < list->list_size; i++)
+            visit(list->list[i]);
+    }
+    else if (auto w = dynamic_cast<const transform_instance*>(p))
+        visit(w->ptr);
+    else if (auto w = dynamic_cast<const translate*>(p))
+        visit(w->ptr);
+    else if (auto w = dynamic_cast<const rotate_y*>(p))
+        visit(w->ptr);
+    else if (auto w = dynamic_cast<const flip_normals*>(p))
+        visit(w->ptr);
+    else if (auto medium = dynamic_cast<const constant_medium*>(p))
+        visit(medium->boundary);
+}
+
+void bvh_report::write_json(std::ostream& out) const {
+    out << "{\n    \"bvhs\": [";
+    for (size_t i = 0; i < trees.size(); i++) {
+        out << (i ? ",\n        " : "\n        ");
+        trees[i].write_json(out);
+    }
+    out << (trees.empty() ? "],\n" : "\n    ],\n") << "    \"traversal\": ";
+    write_traversal_stats_json(out, "    ");
+    out << "\n}\n";
+}
+
+// Writes the report on the scene to a file, for the programs' --bvh-stats option.
+bool write_bvh_report(const hittable *world, const char *filename) {
+    std::ofstream out(filename);
+    bvh_report(world).write_json(out);
+    if (!out) {
+        std::cerr << "Could not write " << filename << '\n';
+        return false;
+    }
+    return true;
+}
+
+#endif
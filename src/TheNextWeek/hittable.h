@@ -15,6 +15,7 @@
 #include "aabb.h"
 
 
+class hittable;
 class material;
 
 void get_sphere_uv(const vec3& p, double& u, double& v) {
@@ -25,6 +26,8 @@ void get_sphere_uv(const vec3& p, double& u, double& v) {
 }
 
 
+// What hit() reports. find_hit() may fill in only t, and leave `object` to fill in the rest with
+// what it stored in primitive, u and v (for a triangle, its id and barycentric coordinates).
 struct hit_record {
     double t;
     double u;
@@ -32,43 +35,113 @@ struct hit_record {
     vec3 p;
     vec3 normal;
     material *mat_ptr;
+    const hittable *object;     // to finish the record, or null if it is finished
+    int primitive;
 };
 
+// A hittable overrides hit(), or find_hit() and finish_hit(), in which case hit() finds the hit
+// and finishes it.
 class hittable {
     public:
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+        virtual ~hittable() {}
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec, rng& gen
+        ) const {
+            if (!find_hit(r, t_min, t_max, rec, gen))
+                return false;
+            if (rec.object)
+                rec.object->finish_hit(r, rec);
+            return true;
+        }
+
+        // Finds the closest hit as hit() does, but may leave the record unfinished, so that the
+        // point, normal and texture coordinates are worked out only for the hit that stays
+        // closest: aggregates find hits in their parts and finish only the closest one.
+        virtual bool find_hit(
+            const ray& r, double t_min, double t_max, hit_record& rec, rng& gen
+        ) const {
+            if (!hit(r, t_min, t_max, rec, gen))
+                return false;
+            rec.object = 0;
+            return true;
+        }
+
+        // Fills in the rest of a record that find_hit(), on the same ray, left to this.
+        virtual void finish_hit(const ray& r, hit_record& rec) const {}
+
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const = 0;
+
+        // Bounds the part of the hittable inside `clip`, for builders that split primitives
+        // between BVH nodes, and returns false if there is none. Clipping the bounding box is
+        // exact for rects and never too small for anything else.
+        virtual bool clipped_bounding_box(
+            double t0, double t1, const aabb& clip, aabb& output_box
+        ) const {
+            aabb box;
+            return bounding_box(t0, t1, box) && overlapping_box(box, clip, output_box);
+        }
+
+        // Whether the ray hits anything between t_min and t_max. Stops at the first intersection
+        // it finds and works out nothing about it, for rays that only need to know. Falls back on
+        // find_hit() for hittables without a cheaper test.
+        virtual bool occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+            hit_record rec;
+            return find_hit(r, t_min, t_max, rec, gen);
+        }
 };
 
 class flip_normals : public hittable {
     public:
         flip_normals(hittable *p) : ptr(p) {}
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-            if (ptr->hit(r, t_min, t_max, rec)) {
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec, rng& gen
+        ) const {
+            if (ptr->hit(r, t_min, t_max, rec, gen)) {
                 rec.normal = -rec.normal;
                 return true;
             }
             else
                 return false;
         }
+        virtual bool occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+            return ptr->occluded(r, t_min, t_max, gen);
+        }
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
             return ptr->bounding_box(t0, t1, output_box);
         }
+        virtual bool clipped_bounding_box(
+            double t0, double t1, const aabb& clip, aabb& output_box
+        ) const {
+            return ptr->clipped_bounding_box(t0, t1, clip, output_box);
+        }
         hittable *ptr;
 };
 
 class translate : public hittable {
     public:
-        translate(hittable *p, const vec3& displacement) : ptr(p), offset(displacement) {}
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
-        virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+        translate(hittable *p, const vec3& displacement);
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const;
+        virtual bool occluded(const ray& r, double t_min, double t_max, rng& gen) const;
+        virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
+            output_box = bbox;
+            return hasbox;
+        }
         hittable *ptr;
         vec3 offset;
+        bool hasbox;
+        aabb bbox;
 };
 
-bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+translate::translate(hittable *p, const vec3& displacement) : ptr(p), offset(displacement) {
+    hasbox = ptr->bounding_box(0, 1, bbox);
+    if (hasbox)
+        bbox = aabb(bbox.min() + offset, bbox.max() + offset);
+}
+
+bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
     ray moved_r(r.origin() - offset, r.direction(), r.time());
-    if (ptr->hit(moved_r, t_min, t_max, rec)) {
+    if (ptr->hit(moved_r, t_min, t_max, rec, gen)) {
         rec.p += offset;
         return true;
     }
@@ -76,25 +149,20 @@ bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) c
         return false;
 }
 
-bool translate::bounding_box(double t0, double t1, aabb& output_box) const {
-    if (ptr->bounding_box(t0, t1, output_box)) {
-        output_box = aabb(
-            output_box.min() + offset,
-            output_box.max() + offset);
-        return true;
-    }
-    else
-        return false;
+bool translate::occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+    return ptr->occluded(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max, gen);
 }
 
 class rotate_y : public hittable {
     public:
         rotate_y(hittable *p, double angle);
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const;
+        virtual bool occluded(const ray& r, double t_min, double t_max, rng& gen) const;
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
             output_box = bbox;
             return hasbox;
         }
+        ray rotated(const ray& r) const;
         hittable *ptr;
         double sin_theta;
         double cos_theta;
@@ -130,15 +198,19 @@ rotate_y::rotate_y(hittable *p, double angle) : ptr(p) {
     bbox = aabb(min, max);
 }
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+// The ray in the frame of the unrotated object.
+ray rotate_y::rotated(const ray& r) const {
     vec3 origin = r.origin();
     vec3 direction = r.direction();
     origin[0] = cos_theta*r.origin()[0] - sin_theta*r.origin()[2];
     origin[2] =  sin_theta*r.origin()[0] + cos_theta*r.origin()[2];
     direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
     direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
-    ray rotated_r(origin, direction, r.time());
-    if (ptr->hit(rotated_r, t_min, t_max, rec)) {
+    return ray(origin, direction, r.time());
+}
+
+bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
+    if (ptr->hit(rotated(r), t_min, t_max, rec, gen)) {
         vec3 p = rec.p;
         vec3 normal = rec.normal;
         p[0] = cos_theta*rec.p[0] + sin_theta*rec.p[2];
@@ -153,4 +225,8 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
         return false;
 }
 
+bool rotate_y::occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+    return ptr->occluded(rotated(r), t_min, t_max, gen);
+}
+
 #endif
@@ -12,20 +12,37 @@
 //==============================================================================================
 
 #include "common/rtweekend.h"
+#include "common/traversal_stats.h"
 #include "hittable.h"
+#include "instance.h"
 
 
 class hittable_list: public hittable  {
     public:
-        hittable_list() {}
-        hittable_list(hittable **l, int n) {list = l; list_size = n; }
-        virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+        hittable_list() : list(0), list_size(0) {}
+        hittable_list(hittable **l, int n);
+        ~hittable_list() { delete[] list; }
+        virtual bool find_hit(
+            const ray& r, double tmin, double tmax, hit_record& rec, rng& gen
+        ) const;
+        virtual bool occluded(const ray& r, double t_min, double t_max, rng& gen) const;
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
 
         hittable **list;
         int list_size;
+
+    private:
+        hittable_list(const hittable_list&);
+        hittable_list& operator=(const hittable_list&);
 };
 
+// Keeps its own copy of the array, with any chains of transform wrappers folded (see
+// fold_transforms); the caller's array is left as it was.
+hittable_list::hittable_list(hittable **l, int n) : list(new hittable*[n]), list_size(n) {
+    for (int i = 0; i < n; i++)
+        list[i] = fold_transforms(l[i]);
+}
+
 bool hittable_list::bounding_box(double t0, double t1, aabb& output_box) const {
     if (list_size < 1) return false;
 
@@ -47,13 +64,16 @@ bool hittable_list::bounding_box(double t0, double t1, aabb& output_box) const {
     return true;
 }
 
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool hittable_list::find_hit(
+    const ray& r, double t_min, double t_max, hit_record& rec, rng& gen
+) const {
     hit_record temp_rec;
     bool hit_anything = false;
     double closest_so_far = t_max;
 
     for (int i = 0; i < list_size; i++) {
-        if (list[i]->hit(r, t_min, closest_so_far, temp_rec)) {
+        count_primitive_test();
+        if (list[i]->find_hit(r, t_min, closest_so_far, temp_rec, gen)) {
             hit_anything = true;
             closest_so_far = temp_rec.t;
             rec = temp_rec;
@@ -62,4 +82,13 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
     return hit_anything;
 }
 
+bool hittable_list::occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+    for (int i = 0; i < list_size; i++) {
+        count_primitive_test();
+        if (list[i]->occluded(r, t_min, t_max, gen))
+            return true;
+    }
+    return false;
+}
+
 #endif
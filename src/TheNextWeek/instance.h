@@ -0,0 +1,224 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "hittable.h"
+
+
+// An affine map of space: a 3x3 linear part in the first three columns and a translation in the
+// fourth. The product a*b applies b first.
+struct affine_transform {
+    affine_transform() {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                m[i][j] = i == j ? 1 : 0;
+    }
+
+    static affine_transform translation(const vec3& offset) {
+        affine_transform t;
+        for (int i = 0; i < 3; i++)
+            t.m[i][3] = offset[i];
+        return t;
+    }
+
+    // The same sense of rotation as rotate_y.
+    static affine_transform rotation_y(double angle) {
+        auto radians = degrees_to_radians(angle);
+        return rotation_y(sin(radians), cos(radians));
+    }
+
+    static affine_transform rotation_y(double sin_theta, double cos_theta) {
+        affine_transform t;
+        t.m[0][0] = t.m[2][2] = cos_theta;
+        t.m[0][2] = sin_theta;
+        t.m[2][0] = -sin_theta;
+        return t;
+    }
+
+    affine_transform operator*(const affine_transform& b) const {
+        affine_transform t;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                t.m[i][j] = j < 3 ? 0 : m[i][3];
+                for (int k = 0; k < 3; k++)
+                    t.m[i][j] += m[i][k] * b.m[k][j];
+            }
+        }
+        return t;
+    }
+
+    vec3 point(const vec3& p) const {
+        return vec3(
+            m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+            m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+            m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3]);
+    }
+
+    vec3 vector(const vec3& v) const {
+        return vec3(
+            m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+            m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+            m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]);
+    }
+
+    // The vector times the transpose of the linear part. Applied by the inverse of a transform,
+    // this carries normals through the transform.
+    vec3 transposed_vector(const vec3& v) const {
+        return vec3(
+            m[0][0]*v[0] + m[1][0]*v[1] + m[2][0]*v[2],
+            m[0][1]*v[0] + m[1][1]*v[1] + m[2][1]*v[2],
+            m[0][2]*v[0] + m[1][2]*v[1] + m[2][2]*v[2]);
+    }
+
+    affine_transform inverse() const;
+
+    // The smallest box around the image of a box.
+    aabb bounds(const aabb& box) const;
+
+    double m[3][4];
+};
+
+affine_transform affine_transform::inverse() const {
+    affine_transform t;
+    // The inverse of the linear part is its adjugate over its determinant.
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            int r0 = (j+1) % 3, r1 = (j+2) % 3;
+            int c0 = (i+1) % 3, c1 = (i+2) % 3;
+            t.m[i][j] = m[r0][c0]*m[r1][c1] - m[r0][c1]*m[r1][c0];
+        }
+    }
+    auto det = m[0][0]*t.m[0][0] + m[0][1]*t.m[1][0] + m[0][2]*t.m[2][0];
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            t.m[i][j] /= det;
+    for (int i = 0; i < 3; i++)
+        t.m[i][3] = -(t.m[i][0]*m[0][3] + t.m[i][1]*m[1][3] + t.m[i][2]*m[2][3]);
+    return t;
+}
+
+aabb affine_transform::bounds(const aabb& box) const {
+    vec3 min, max;
+    for (int i = 0; i < 3; i++) {
+        min[i] = max[i] = m[i][3];
+        for (int j = 0; j < 3; j++) {
+            if (m[i][j] == 0)   // an infinite box stays finite along the axes it doesn't reach
+                continue;
+            auto a = m[i][j] * box.min()[j];
+            auto b = m[i][j] * box.max()[j];
+            min[i] += ffmin(a, b);
+            max[i] += ffmax(a, b);
+        }
+    }
+    return aabb(min, max);
+}
+
+
+// A hittable placed in the scene by an affine transform. The hittable is only referenced, so
+// one bottom-level BVH can be shared by any number of instances, each costing a pair of matrices
+// and a box; a BVH over the instances then makes a two-level hierarchy. Rays are carried into
+// the object's frame with the inverse matrix, leaving t unchanged, and hits are carried back.
+// `flip` turns the normals around, as flip_normals does.
+class transform_instance : public hittable {
+    public:
+        transform_instance(hittable *p, const affine_transform& transform, bool flipped = false);
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const;
+        virtual bool occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+            return ptr->occluded(object_ray(r), t_min, t_max, gen);
+        }
+        virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
+            output_box = bbox;
+            return hasbox;
+        }
+
+        ray object_ray(const ray& r) const {
+            return ray(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
+        }
+
+        hittable *ptr;
+        affine_transform to_world;
+        affine_transform to_object;
+        bool flip;
+        bool rigid;     // no scaling or shear, so normals keep their length
+        bool hasbox;
+        aabb bbox;
+};
+
+transform_instance::transform_instance(
+    hittable *p, const affine_transform& transform, bool flipped
+) : ptr(p), to_world(transform), to_object(transform.inverse()), flip(flipped)
+{
+    rigid = true;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            auto column_dot = 0.0;
+            for (int k = 0; k < 3; k++)
+                column_dot += to_world.m[k][i] * to_world.m[k][j];
+            rigid = rigid && fabs(column_dot - (i == j ? 1 : 0)) < 1e-12;
+        }
+    }
+    hasbox = ptr->bounding_box(0, 1, bbox);
+    if (hasbox)
+        bbox = to_world.bounds(bbox);
+}
+
+bool transform_instance::hit(
+    const ray& r, double t_min, double t_max, hit_record& rec, rng& gen
+) const {
+    if (!ptr->hit(object_ray(r), t_min, t_max, rec, gen))
+        return false;
+    rec.p = to_world.point(rec.p);
+    auto normal = to_object.transposed_vector(flip ? -rec.normal : rec.normal);
+    rec.normal = rigid ? normal : unit_vector(normal);
+    return true;
+}
+
+// Collapses a chain of translate, rotate_y, flip_normals and transform_instance wrappers into
+// one transform_instance, so that a ray pays for one transform and one virtual call
+// instead of one per wrapper. Anything else comes back as it was, as does a single wrapper,
+// which is no dearer than the instance would be. Lists and BVHs fold what they are given.
+hittable *fold_transforms(hittable *p) {
+    affine_transform transform;
+    bool flip = false;
+    bool moved = false;
+    int wrappers = 0;
+    hittable *object = p;
+    for (;; wrappers++) {
+        if (auto w = dynamic_cast<translate*>(object)) {
+            transform = transform * affine_transform::translation(w->offset);
+            moved = true;
+            object = w->ptr;
+        }
+        else if (auto w = dynamic_cast<rotate_y*>(object)) {
+            transform = transform * affine_transform::rotation_y(w->sin_theta, w->cos_theta);
+            moved = true;
+            object = w->ptr;
+        }
+        else if (auto w = dynamic_cast<transform_instance*>(object)) {
+            transform = transform * w->to_world;
+            flip = flip != w->flip;
+            moved = true;
+            object = w->ptr;
+        }
+        else if (auto w = dynamic_cast<flip_normals*>(object)) {
+            flip = !flip;
+            object = w->ptr;
+        }
+        else
+            break;
+    }
+    if (!moved || wrappers < 2)
+        return p;
+    return new transform_instance(object, transform, flip);
+}
+
+#endif
@@ -0,0 +1,355 @@
+#ifndef LBVH_H
+#define LBVH_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "common/thread_pool.h"
+#include "bvh_build.h"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+
+// Linear BVH construction (Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees,
+// and k-d Trees", 2012), with optional treelet restructuring (Karras and Aila, "Fast Parallel
+// Construction of High-Quality Bounding Volume Hierarchies", 2013).
+//
+// The primitives are sorted along a 63-bit Morton curve through their centroids. Over n sorted
+// primitives the tree has n-1 internal nodes, numbered 0 to n-2 with the root at 0, and n leaves,
+// numbered n-1 to 2n-2 in sorted order (so with one primitive, node 0 is a leaf). Every internal
+// node finds its children from the sorted codes alone, so all of them are emitted at once. Bounds
+// and costs are then gathered bottom-up: each walk up from a leaf stops at the first node it
+// reaches, and carries on from the second, by which time both children are done.
+
+inline uint64_t morton_spread(uint64_t x) {
+    // Moves bit k of a 21-bit number to bit 3k.
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffULL;
+    x = (x | x << 16) & 0x1f0000ff0000ffULL;
+    x = (x | x << 8)  & 0x100f00f00f00f00fULL;
+    x = (x | x << 4)  & 0x10c30c30c30c30c3ULL;
+    x = (x | x << 2)  & 0x1249249249249249ULL;
+    return x;
+}
+
+inline int leading_zeros(uint64_t x) {
+#if defined(__GNUC__)
+    return x ? __builtin_clzll(x) : 64;
+#else
+    int n = 0;
+    for (uint64_t bit = 1ULL << 63; bit && !(x & bit); bit >>= 1)
+        n++;
+    return n;
+#endif
+}
+
+class lbvh {
+    public:
+        lbvh(const bvh_primitives& prims, const bvh_build_options& options, thread_pool *pool);
+
+        bool is_leaf(int node) const { return node >= n-1; }
+        int primitive(int node) const { return order[node - (n-1)]; }
+
+        std::vector<int> left;      // children of the internal nodes
+        std::vector<int> right;
+        std::vector<int> parent;    // of every node, -1 for the root
+        std::vector<aabb> bounds;
+        std::vector<int> count;     // primitives below every node
+        std::vector<double> cost;   // SAH cost of every subtree, not divided by the root area
+
+    private:
+        void sort_codes(thread_pool *pool);
+        void emit(int i);
+        int delta(int i, int j) const;
+        void refit(thread_pool *pool, bool optimize);
+        void update(int node);
+        void optimize_treelet(int root);
+
+        static const int treelet_size = 7;
+
+        struct treelet {
+            int leaves[treelet_size];
+            int internal[treelet_size - 1];
+            int used;
+            int split[1 << treelet_size];
+        };
+
+        int restructure(treelet& t, int set, int node);
+
+        const bvh_primitives& prims;
+        const bvh_build_options& options;
+        int n;
+        std::vector<uint64_t> codes;
+        std::vector<int> order;
+};
+
+
+lbvh::lbvh(const bvh_primitives& prims, const bvh_build_options& options, thread_pool *pool)
+  : prims(prims), options(options), n(static_cast<int>(prims.boxes.size()))
+{
+    left.resize(n > 1 ? n-1 : 0);
+    right.resize(left.size());
+    parent.assign(n > 0 ? 2*n-1 : 0, -1);
+    bounds.resize(parent.size());
+    count.resize(parent.size());
+    cost.resize(parent.size());
+    if (n == 0)
+        return;
+
+    order.resize(n);
+    for (int i = 0; i < n; i++)
+        order[i] = i;
+
+    // 21 bits per axis across the bounds of the centroids.
+    aabb scene_bounds, centroid_bounds;
+    bvh_range_bounds(prims, order.data(), 0, n, scene_bounds, centroid_bounds, pool);
+    auto cmin = centroid_bounds.min();
+    auto extent = centroid_bounds.max() - cmin;
+    vec3 scale;
+    for (int a = 0; a < 3; a++)
+        scale[a] = extent[a] > 0 ? 2097151 / extent[a] : 0;
+
+    codes.resize(n);
+    bvh_for_pieces(pool, 0, n, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            uint64_t q[3];
+            for (int a = 0; a < 3; a++)
+                q[a] = std::min(
+                    static_cast<uint64_t>((prims.centroids[i][a] - cmin[a]) * scale[a]),
+                    static_cast<uint64_t>(2097151));
+            codes[i] = morton_spread(q[0]) << 2 | morton_spread(q[1]) << 1 | morton_spread(q[2]);
+        }
+    });
+
+    sort_codes(pool);
+
+    bvh_for_pieces(pool, 0, n-1, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++)
+            emit(i);
+    });
+
+    refit(pool, false);
+    for (int pass = 0; pass < options.treelet_passes; pass++)
+        refit(pool, true);
+}
+
+// Stable least-significant-digit radix sort of (code, primitive) pairs, a byte at a time. Each
+// piece counts its own digits, and scatters to the slots its counts reserve, so the result does
+// not depend on how the work was split. Bytes that every code shares are skipped.
+void lbvh::sort_codes(thread_pool *pool) {
+    uint64_t all_or = 0, all_and = ~0ULL;
+    for (auto code : codes) {
+        all_or |= code;
+        all_and &= code;
+    }
+
+    std::vector<uint64_t> sorted_codes(n);
+    std::vector<int> sorted_order(n);
+    int pieces = bvh_piece_count(pool, n);
+    std::vector<int> offsets(256 * pieces);
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        if ((((all_or ^ all_and) >> shift) & 0xff) == 0)
+            continue;
+
+        std::fill(offsets.begin(), offsets.end(), 0);
+        bvh_for_pieces(pool, 0, n, [&](int begin, int end, int piece) {
+            auto counts = &offsets[256 * piece];
+            for (int i = begin; i < end; i++)
+                counts[(codes[i] >> shift) & 0xff]++;
+        });
+
+        int sum = 0;
+        for (int digit = 0; digit < 256; digit++)
+            for (int piece = 0; piece < pieces; piece++) {
+                auto c = offsets[256*piece + digit];
+                offsets[256*piece + digit] = sum;
+                sum += c;
+            }
+
+        bvh_for_pieces(pool, 0, n, [&](int begin, int end, int piece) {
+            auto next = &offsets[256 * piece];
+            for (int i = begin; i < end; i++) {
+                auto slot = next[(codes[i] >> shift) & 0xff]++;
+                sorted_codes[slot] = codes[i];
+                sorted_order[slot] = order[i];
+            }
+        });
+
+        codes.swap(sorted_codes);
+        order.swap(sorted_order);
+    }
+}
+
+// The length of the common prefix of the keys of sorted primitives i and j, or -1 when j is out
+// of range. Equal codes fall back on the positions, so every key is distinct.
+int lbvh::delta(int i, int j) const {
+    if (j < 0 || j >= n)
+        return -1;
+    if (codes[i] == codes[j])
+        return 64 + leading_zeros(static_cast<uint64_t>(i ^ j));
+    return leading_zeros(codes[i] ^ codes[j]);
+}
+
+// Finds the range of sorted primitives under internal node i, and where that range splits.
+void lbvh::emit(int i) {
+    int d = delta(i, i+1) > delta(i, i-1) ? 1 : -1;
+
+    // Gallop out to a bound on the far end of the range, then binary search for it.
+    int delta_min = delta(i, i-d);
+    long long max_length = 2;
+    while (delta(i, static_cast<int>(i + max_length*d)) > delta_min)
+        max_length *= 2;
+    long long length = 0;
+    for (long long step = max_length/2; step >= 1; step /= 2)
+        if (delta(i, static_cast<int>(i + (length + step)*d)) > delta_min)
+            length += step;
+    int j = static_cast<int>(i + length*d);
+
+    // The split is the last position that shares more than the range's common prefix with i.
+    int delta_node = delta(i, j);
+    long long split = 0;
+    for (long long divisor = 2, step; ; divisor *= 2) {
+        step = (length + divisor - 1) / divisor;
+        if (delta(i, static_cast<int>(i + (split + step)*d)) > delta_node)
+            split += step;
+        if (step <= 1)
+            break;
+    }
+    int gamma = static_cast<int>(i + split*d + std::min(d, 0));
+
+    left[i] = std::min(i, j) == gamma ? n-1 + gamma : gamma;
+    right[i] = std::max(i, j) == gamma+1 ? n-1 + gamma+1 : gamma+1;
+    parent[left[i]] = i;
+    parent[right[i]] = i;
+}
+
+void lbvh::update(int node) {
+    int l = left[node], r = right[node];
+    bounds[node] = surrounding_box(bounds[l], bounds[r]);
+    count[node] = count[l] + count[r];
+    cost[node] = options.traversal_cost * bounds[node].area() + cost[l] + cost[r];
+}
+
+void lbvh::refit(thread_pool *pool, bool optimize) {
+    std::vector<std::atomic<int>> arrivals(n-1);
+    for (auto& a : arrivals)
+        a.store(0, std::memory_order_relaxed);
+
+    bvh_for_pieces(pool, 0, n, [&](int begin, int end, int) {
+        for (int k = begin; k < end; k++) {
+            int leaf = n-1 + k;
+            bounds[leaf] = prims.boxes[order[k]];
+            count[leaf] = 1;
+            cost[leaf] = options.intersection_cost * bounds[leaf].area();
+
+            for (int node = parent[leaf]; node >= 0; node = parent[node]) {
+                if (arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 0)
+                    break;
+                update(node);
+                if (optimize && count[node] >= treelet_size)
+                    optimize_treelet(node);
+            }
+        }
+    });
+}
+
+// Grows a treelet of up to seven leaves below `root`, always opening the leaf with the largest
+// area, then finds the cheapest tree over those leaves by dynamic programming over their subsets
+// and rebuilds the treelet that way if it is cheaper. The treelet's internal nodes are reused.
+void lbvh::optimize_treelet(int root) {
+    treelet t;
+    int num_leaves = 2;
+    t.leaves[0] = left[root];
+    t.leaves[1] = right[root];
+    t.internal[0] = root;
+    int num_internal = 1;
+
+    while (num_leaves < treelet_size) {
+        int best = -1;
+        double best_area = -1;
+        for (int k = 0; k < num_leaves; k++) {
+            auto area = bounds[t.leaves[k]].area();
+            if (!is_leaf(t.leaves[k]) && area > best_area) {
+                best = k;
+                best_area = area;
+            }
+        }
+        if (best < 0)
+            break;
+        int opened = t.leaves[best];
+        t.internal[num_internal++] = opened;
+        t.leaves[best] = left[opened];
+        t.leaves[num_leaves++] = right[opened];
+    }
+    if (num_leaves < 3)
+        return;
+
+    const int full = (1 << num_leaves) - 1;
+    aabb set_bounds[1 << treelet_size];
+    double best_cost[1 << treelet_size];
+
+    for (int set = 1; set <= full; set++) {
+        int low = set & -set;
+        int k = 0;
+        while ((1 << k) != low)
+            k++;
+        if (set == low) {
+            set_bounds[set] = bounds[t.leaves[k]];
+            best_cost[set] = cost[t.leaves[k]];
+            continue;
+        }
+        set_bounds[set] = surrounding_box(set_bounds[set ^ low], bounds[t.leaves[k]]);
+
+        // Each split once: the half holding the lowest leaf goes first.
+        best_cost[set] = infinity;
+        for (int part = (set - 1) & set; part > 0; part = (part - 1) & set) {
+            if (!(part & low))
+                continue;
+            auto c = best_cost[part] + best_cost[set ^ part];
+            if (c < best_cost[set]) {
+                best_cost[set] = c;
+                t.split[set] = part;
+            }
+        }
+        best_cost[set] += options.traversal_cost * set_bounds[set].area();
+    }
+
+    // Rounding alone should never trigger a rebuild.
+    if (!(best_cost[full] < cost[root] * (1 - 1e-9)))
+        return;
+
+    t.used = 1;
+    restructure(t, full, root);
+}
+
+// Makes `node` the root of the best tree over the treelet leaves in `set`.
+int lbvh::restructure(treelet& t, int set, int node) {
+    int halves[2] = { t.split[set], set ^ t.split[set] };
+    int children[2];
+    for (int h = 0; h < 2; h++) {
+        if ((halves[h] & (halves[h] - 1)) == 0) {
+            int k = 0;
+            while ((1 << k) != halves[h])
+                k++;
+            children[h] = t.leaves[k];
+        }
+        else
+            children[h] = restructure(t, halves[h], t.internal[t.used++]);
+        parent[children[h]] = node;
+    }
+    left[node] = children[0];
+    right[node] = children[1];
+    update(node);
+    return node;
+}
+
+#endif
@@ -10,34 +10,53 @@
 //==============================================================================================
 
 #include "common/rtweekend.h"
+#include "common/framebuffer.h"
+#include "common/image_writer.h"
+#include "common/render_options.h"
 #include "common/rtw_stb_image.h"
+#include "common/thread_pool.h"
+#include "common/tile_renderer.h"
+#include "common/traversal_stats.h"
 #include "aarect.h"
 #include "box.h"
-#include "bvh.h"
+#include "bvh_stats.h"
 #include "camera.h"
 #include "constant_medium.h"
 #include "hittable_list.h"
+#include "instance.h"
 #include "material.h"
 #include "moving_sphere.h"
 #include "sphere.h"
+#include "sphere_set.h"
 #include "surface_texture.h"
 #include "texture.h"
+#include "wide_bvh.h"
 
 #include <iostream>
 
 
-vec3 ray_color(const ray& r, hittable *world, int depth) {
+// Each bounce draws from its own generator, addressed by the pixel and sample the path belongs
+// to and by the remaining depth. Dimension 0 is left to the camera.
+vec3 ray_color(
+    const ray& r, hittable *world, int depth, uint32_t pixel, uint32_t sample,
+    ray_kind kind = camera_ray
+) {
     hit_record rec;
-    if (depth <= 0 || !world->hit(r, 0.001, infinity, rec))
+    rng gen(pixel, sample, depth);
+    if (depth <= 0)
+        return vec3(0,0,0);
+    count_ray(kind);
+    if (!world->hit(r, 0.001, infinity, rec, gen))
         return vec3(0,0,0);
 
     ray scattered;
     vec3 attenuation;
     vec3 emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered, gen))
         return emitted;
 
-    return emitted + attenuation * ray_color(scattered, world, depth-1);
+    return emitted
+         + attenuation * ray_color(scattered, world, depth-1, pixel, sample, scattered_ray);
 }
 
 hittable *earth() {
@@ -80,7 +99,7 @@ hittable *final() {
         }
     }
     int l = 0;
-    list[l++] = new bvh_node(boxlist, b, 0, 1);
+    list[l++] = new bvh8(boxlist, b, 0, 1);
     material *light = new diffuse_light(new constant_texture(vec3(7, 7, 7)));
     list[l++] = new xz_rect(123, 423, 147, 412, 554, light);
     vec3 center(400, 400, 200);
@@ -107,7 +126,38 @@ hittable *final() {
             vec3(165*random_double(), 165*random_double(), 165*random_double()), 10, white);
     }
     list[l++] = new translate(
-        new rotate_y(new bvh_node(boxlist2, ns, 0.0, 1.0), 15), vec3(-100,270,395));
+        new rotate_y(new bvh8(boxlist2, ns, 0.0, 1.0), 15), vec3(-100,270,395));
+    return new hittable_list(list,l);
+}
+
+// A thousand copies of the sphere cluster from final(), sharing one BVH of its spheres and
+// gathered under a BVH of their own.
+hittable *instances() {
+    hittable **list = new hittable*[3];
+    hittable **spheres = new hittable*[1000];
+    hittable **copies = new hittable*[1000];
+    material *white = new lambertian(new constant_texture(vec3(0.73, 0.73, 0.73)));
+    material *ground = new lambertian(new constant_texture(vec3(0.48, 0.83, 0.53)));
+    material *light = new diffuse_light(new constant_texture(vec3(7, 7, 7)));
+    for (int j = 0; j < 1000; j++) {
+        spheres[j] = new sphere(
+            vec3(165*random_double(), 165*random_double(), 165*random_double()), 10, white);
+    }
+    hittable *cluster = new bvh8(spheres, 1000, 0.0, 1.0);
+    int n = 0;
+    for (int i = 0; i < 25; i++) {
+        for (int k = 0; k < 40; k++) {
+            vec3 offset(-2200 + 200*i, 50*random_double(), 250*k);
+            copies[n++] = new transform_instance(
+                cluster,
+                affine_transform::translation(offset)
+                    * affine_transform::rotation_y(360*random_double()));
+        }
+    }
+    int l = 0;
+    list[l++] = new bvh8(copies, n, 0.0, 1.0);
+    list[l++] = new xz_rect(-3000, 3000, -1000, 11000, -10, ground);
+    list[l++] = new xz_rect(-3000, 3000, -1000, 11000, 2000, light);
     return new hittable_list(list,l);
 }
 
@@ -142,7 +192,7 @@ hittable *cornell_final() {
             vec3(165*random_double(), 330*random_double(), 165*random_double()), 10, white);
     }
     list[i++] = new translate(
-        new rotate_y(new bvh_node(boxlist, ns, 0.0, 1.0), 15), vec3(265,0,295));
+        new rotate_y(new bvh8(boxlist, ns, 0.0, 1.0), 15), vec3(265,0,295));
     */
     hittable *boundary2 = new translate(
         new rotate_y(new box(vec3(0, 0, 0), vec3(165, 165, 165), new dielectric(1.5)), -18),
@@ -245,21 +295,21 @@ hittable *simple_light() {
 }
 
 hittable *random_scene() {
-    int n = 50000;
-    hittable **list = new hittable*[n+1];
+    // Every object is a sphere, so they all go in one sphere_set: no object or virtual call per
+    // sphere, and the spheres in each leaf are tested together.
+    auto spheres = new sphere_set;
     texture *checker = new checker_texture(
         new constant_texture(vec3(0.2, 0.3, 0.1)),
         new constant_texture(vec3(0.9, 0.9, 0.9))
     );
-    list[0] = new sphere(vec3(0,-1000,0), 1000, new lambertian(checker));
-    int i = 1;
+    spheres->add(vec3(0,-1000,0), 1000, new lambertian(checker));
     for (int a = -10; a < 10; a++) {
         for (int b = -10; b < 10; b++) {
             auto choose_mat = random_double();
             vec3 center(a+0.9*random_double(),0.2,b+0.9*random_double());
             if ((center-vec3(4,0.2,0)).length() > 0.9) {
                 if (choose_mat < 0.8) {  // diffuse
-                    list[i++] = new moving_sphere(
+                    spheres->add(
                         center, center + vec3(0, 0.5*random_double(), 0), 0.0, 1.0, 0.2,
                         new lambertian(
                             new constant_texture(
@@ -272,7 +322,7 @@ hittable *random_scene() {
                     );
                 }
                 else if (choose_mat < 0.95) { // metal
-                    list[i++] = new sphere(
+                    spheres->add(
                         center, 0.2,
                         new metal(
                             vec3(
@@ -285,28 +335,37 @@ hittable *random_scene() {
                     );
                 }
                 else {  // glass
-                    list[i++] = new sphere(center, 0.2, new dielectric(1.5));
+                    spheres->add(center, 0.2, new dielectric(1.5));
                 }
             }
         }
     }
 
-    list[i++] = new sphere(vec3(0, 1, 0), 1.0, new dielectric(1.5));
-    list[i++] = new sphere(
+    spheres->add(vec3(0, 1, 0), 1.0, new dielectric(1.5));
+    spheres->add(
         vec3(-4, 1, 0), 1.0, new lambertian(new constant_texture(vec3(0.4, 0.2, 0.1))));
-    list[i++] = new sphere(vec3(4, 1, 0), 1.0, new metal(vec3(0.7, 0.6, 0.5), 0.0));
+    spheres->add(vec3(4, 1, 0), 1.0, new metal(vec3(0.7, 0.6, 0.5), 0.0));
 
-    //return new hittable_list(list,i);
-    return new bvh_node(list, i, 0.0, 1.0);
+    // The spheres move, so an animation would rebuild this every frame: trade a little trace
+    // speed for a much faster build.
+    bvh_build_options options;
+    options.split = bvh_build_options::split_lbvh;
+    options.treelet_passes = 2;
+
+    spheres->build(0.0, 1.0, options);
+    return spheres;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     int nx = 600;
     int ny = 600;
     int num_samples = 100;
     int max_depth = 50;
 
-    std::cout << "P3\n" << nx << ' ' << ny << "\n255\n";
+    render_options options(num_samples);
+    if (!options.parse(argc, argv))
+        return 1;
+    bvh_build_options::default_cache_directory() = options.bvh_cache_directory;
 
     auto R = cos(pi/4);
     //hittable *world = random_scene();
@@ -319,6 +378,7 @@ int main() {
     //hittable *world = cornell_smoke();
     //hittable *world = cornell_final();
     //hittable *world = final();
+    //hittable *world = instances();
 
     vec3 lookfrom(278, 278, -800);
     //vec3 lookfrom(478, 278, -600);
@@ -332,20 +392,24 @@ int main() {
     camera cam(
         lookfrom, lookat, vec3(0,1,0), vfov, double(nx)/ny, aperture, dist_to_focus, 0.0, 1.0);
 
-    for (int j = ny-1; j >= 0; --j) {
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-        for (int i = 0; i < nx; ++i) {
-            vec3 color;
-            for (int s = 0; s < num_samples; ++s) {
-                auto u = (i + random_double()) / nx;
-                auto v = (j + random_double()) / ny;
-                ray r = cam.get_ray(u, v);
-                vec3 p = r.point_at_parameter(2.0);
-                color += ray_color(r, world, max_depth);
-            }
-            color.write_color(std::cout, num_samples);
-        }
-    }
+    framebuffer image(nx, ny);
+    thread_pool pool(options.threads);
+
+    render_progressive(image, pool, options, [&](int i, int j, uint32_t s) {
+        auto pixel = j*nx + i;
+        rng gen(pixel, s, 0);
+        auto u = (i + random_double(gen)) / nx;
+        auto v = (j + random_double(gen)) / ny;
+        ray r = cam.get_ray(u, v, gen);
+        return ray_color(r, world, max_depth, pixel, s);
+    });
+
+    // Image files named on the command line (.ppm, .png, .hdr), or a PPM on standard output.
+    if (!write_images(image, options.output_files))
+        return 1;
+    if (options.bvh_stats_file && !write_bvh_report(world, options.bvh_stats_file))
+        return 1;
 
+    print_traversal_stats(std::cerr);
     std::cerr << "\nDone.\n";
 }
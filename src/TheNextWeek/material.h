@@ -39,18 +39,18 @@ vec3 reflect(const vec3& v, const vec3& n) {
      return v - 2*dot(v,n)*n;
 }
 
-vec3 random_unit_vector() {
-    auto a = 2*pi * random_double();
-    auto z = 2*random_double() - 1;
+vec3 random_unit_vector(rng& gen) {
+    auto a = 2*pi * random_double(gen);
+    auto z = 2*random_double(gen) - 1;
     auto r = sqrt(1 - z*z);
     return vec3(r*cos(a), r*sin(a), z);
 }
 
 
-vec3 random_in_unit_sphere() {
+vec3 random_in_unit_sphere(rng& gen) {
     vec3 p;
     do {
-        p = 2.0*vec3(random_double(),random_double(),random_double()) - vec3(1,1,1);
+        p = 2.0*vec3(random_double(gen),random_double(gen),random_double(gen)) - vec3(1,1,1);
     } while (dot(p,p) >= 1.0);
     return p;
 }
@@ -59,7 +59,7 @@ vec3 random_in_unit_sphere() {
 class material  {
     public:
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, rng& gen
         ) const = 0;
 
         virtual vec3 emitted(double u, double v, const vec3& p) const {
@@ -72,7 +72,7 @@ class diffuse_light : public material  {
         diffuse_light(texture *a) : emit(a) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, rng& gen
         ) const {
             return false;
         }
@@ -89,9 +89,9 @@ class isotropic : public material {
         isotropic(texture *a) : albedo(a) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, rng& gen
         ) const  {
-            scattered = ray(rec.p, random_in_unit_sphere(), r_in.time());
+            scattered = ray(rec.p, random_in_unit_sphere(gen), r_in.time());
             attenuation = albedo->value(rec.u, rec.v, rec.p);
             return true;
         }
@@ -104,9 +104,9 @@ class lambertian : public material {
         lambertian(texture *a) : albedo(a) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, rng& gen
         ) const {
-            vec3 target = rec.p + rec.normal + random_unit_vector();
+            vec3 target = rec.p + rec.normal + random_unit_vector(gen);
             scattered = ray(rec.p, target-rec.p, r_in.time());
             attenuation = albedo->value(rec.u, rec.v, rec.p);
             return true;
@@ -125,10 +125,10 @@ class metal : public material {
         }
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, rng& gen
         ) const  {
             vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere(), r_in.time());
+            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere(gen), r_in.time());
             attenuation = albedo;
             return (dot(scattered.direction(), rec.normal) > 0);
         }
@@ -142,7 +142,7 @@ class dielectric : public material {
         dielectric(double ri) : ref_idx(ri) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered, rng& gen
         ) const {
             vec3 outward_normal;
             vec3 reflected = reflect(r_in.direction(), rec.normal);
@@ -172,7 +172,7 @@ class dielectric : public material {
                reflect_prob = 1.0;
             }
 
-            if (random_double() < reflect_prob) {
+            if (random_double(gen) < reflect_prob) {
                scattered = ray(rec.p, reflected, r_in.time());
             }
             else {
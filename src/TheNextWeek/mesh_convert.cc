@@ -0,0 +1,106 @@
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "mesh_file.h"
+#include "mesh_loader.h"
+#include "triangle_mesh.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+
+// Converts an OBJ or PLY mesh into a mesh file with its BVH (see mesh_file.h), timing each step,
+// and then times how long the mesh file takes to be ready to render: mapped, checked, and hit by
+// a first ray. Given a mesh file, it times only that.
+//
+//     mesh_convert [--threads N] [--lbvh] INPUT [OUTPUT.rtwmesh]
+
+typedef std::chrono::steady_clock timer;
+
+double seconds_since(timer::time_point start) {
+    return std::chrono::duration<double>(timer::now() - start).count();
+}
+
+void report(const char *step, double seconds) {
+    std::cout << std::setw(8) << step << std::setw(10) << std::fixed << std::setprecision(3)
+              << seconds << " s\n";
+}
+
+int main(int argc, char **argv) {
+    bvh_build_options options;
+    options.cache_directory = 0;
+    const char *input = 0, *output = 0;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            options.threads = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--lbvh") == 0)
+            options.split = bvh_build_options::split_lbvh;
+        else if (!input)
+            input = argv[i];
+        else if (!output)
+            output = argv[i];
+        else
+            input = 0, i = argc;
+    }
+    if (!input || (!output && !mesh_path_ends_with(input, ".rtwmesh"))) {
+        std::cerr << "Usage: mesh_convert [--threads N] [--lbvh] INPUT [OUTPUT.rtwmesh]\n";
+        return 1;
+    }
+
+    if (output) {
+        thread_pool *pool = options.threads != 1 ? new thread_pool(options.threads) : 0;
+        auto start = timer::now();
+        mesh_buffers *mesh = 0;
+        if (mesh_path_ends_with(input, ".obj"))
+            mesh = load_obj(input, pool);
+        else if (mesh_path_ends_with(input, ".ply"))
+            mesh = load_ply(input, pool);
+        else
+            std::cerr << input << ": meshes are read from .obj and .ply files\n";
+        if (!mesh)
+            return 1;
+        report("parse", seconds_since(start));
+        std::cout << "         " << mesh->num_vertices << " vertices, " << mesh->num_triangles
+                  << " triangles" << (mesh->normals ? ", normals" : "")
+                  << (mesh->uvs ? ", texture coordinates" : "") << '\n';
+
+        start = timer::now();
+        flat_bvh tree(triangle_primitives(*mesh, pool), options);
+        report("build", seconds_since(start));
+
+        start = timer::now();
+        if (!write_mesh_file(output, *mesh, &tree))
+            return 1;
+        report("write", seconds_since(start));
+        delete mesh;
+        delete pool;
+    }
+
+    auto start = timer::now();
+    mapped_mesh *mapped = map_mesh_file(output ? output : input);
+    if (!mapped)
+        return 1;
+    triangle_mesh mesh(mapped, 0, options);
+    aabb box;
+    mesh.bounding_box(0, 0, box);
+    vec3 center = 0.5 * (box.min() + box.max());
+    hit_record rec;
+    rng gen;
+    bool hit = mesh.hit(ray(center + vec3(0, 0, box.max().z() - box.min().z() + 1), vec3(0,0,-1)),
+                        0.001, infinity, rec, gen);
+    report("ready", seconds_since(start));
+    std::cout << "         first ray " << (hit ? "hit" : "missed") << '\n';
+    delete mapped;
+    return 0;
+}
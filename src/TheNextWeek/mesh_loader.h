@@ -0,0 +1,949 @@
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "common/thread_pool.h"
+#include "bvh_build.h"
+#include "bvh_cache.h"
+#include "flat_bvh.h"
+#include "mesh_file.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+// Reading meshes from Wavefront OBJ and PLY files into mesh_buffers.
+//
+// A text file is cut into pieces at line ends, several for each thread of the pool, and the
+// pieces are parsed at the same time into arrays of their own, which are then put together in
+// order. OBJ faces may use a separate position, texture coordinate and normal index per corner;
+// such corners are welded into one vertex per distinct combination, which is the one step that
+// runs on one thread. Polygons are cut into fans of triangles. Binary PLY vertices are decoded
+// in parallel; its faces, whose records differ in length, are read in order.
+//
+// load_mesh() reads any of these, and also mesh files (see mesh_file.h). Given a cache
+// directory, it parses a text mesh only the first time: it builds the mesh's BVH, saves both as
+// a mesh file keyed by the source's path, size and modification time and the build options, and
+// from then on maps that file instead, ready to render without parsing or building.
+
+// Text pieces smaller than this are not worth a task of their own.
+const size_t mesh_parse_grain = 1 << 20;
+
+// Reads the whole file into text, followed by a NUL, so that the parsers can always look one
+// character ahead.
+bool mesh_read_file(const std::string& path, std::vector<char>& text) {
+    FILE *file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+        std::cerr << "Could not open " << path << '\n';
+        return false;
+    }
+    std::fseek(file, 0, SEEK_END);
+    long size = std::ftell(file);
+    std::fseek(file, 0, SEEK_SET);
+    bool read = size >= 0;
+    if (read) {
+        text.resize(size_t(size) + 1);
+        read = std::fread(text.data(), 1, size_t(size), file) == size_t(size);
+        text[size] = 0;
+    }
+    std::fclose(file);
+    if (!read)
+        std::cerr << "Could not read " << path << '\n';
+    return read;
+}
+
+// Cuts [begin, end) into pieces that end at line ends, as many as the pool can use, and returns
+// the boundaries: piece k is [bounds[k], bounds[k+1]).
+std::vector<const char*> mesh_line_pieces(thread_pool *pool, const char *begin, const char *end) {
+    size_t n = end - begin;
+    size_t pieces = pool ? std::min<size_t>(4 * pool->size(), n / mesh_parse_grain) : 1;
+    pieces = std::max<size_t>(pieces, 1);
+    std::vector<const char*> bounds(1, begin);
+    for (size_t k = 1; k < pieces; k++) {
+        const char *p = std::max(begin + n * k / pieces, bounds.back());
+        auto line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        bounds.push_back(line_end ? line_end + 1 : end);
+    }
+    bounds.push_back(end);
+    return bounds;
+}
+
+// Calls task(k) for k in [0, count), on the pool if there is one.
+template <typename task_function>
+void mesh_run(thread_pool *pool, int count, const task_function& task) {
+    if (pool && count > 1)
+        pool->parallel_for(count, [&](int k, int) { task(k); });
+    else
+        for (int k = 0; k < count; k++)
+            task(k);
+}
+
+inline bool mesh_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline const char *mesh_skip_blanks(const char *s) {
+    while (mesh_blank(*s))
+        s++;
+    return s;
+}
+
+// Parses the number at s, setting end past it, or to s if there is none. The plain decimal forms
+// mesh files use are converted here, several times faster than strtod; anything else is left to
+// strtod.
+inline double mesh_parse_number(const char *s, const char **end) {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+        1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *p = s;
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+')
+        p++;
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for (; *p >= '0' && *p <= '9'; p++, any = true) {
+        if (digits < 18) {
+            mantissa = 10*mantissa + (*p - '0');
+            digits += mantissa != 0;
+        }
+        else {
+            exponent++;
+        }
+    }
+    if (*p == '.') {
+        for (p++; *p >= '0' && *p <= '9'; p++, any = true) {
+            if (digits < 18) {
+                mantissa = 10*mantissa + (*p - '0');
+                digits += mantissa != 0;
+                exponent--;
+            }
+        }
+    }
+    if (any && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool negative_exponent = *q == '-';
+        if (*q == '-' || *q == '+')
+            q++;
+        if (*q >= '0' && *q <= '9') {
+            int e = 0;
+            for (; *q >= '0' && *q <= '9'; q++)
+                e = e < 10000 ? 10*e + (*q - '0') : e;
+            exponent += negative_exponent ? -e : e;
+            p = q;
+        }
+    }
+    if (!any || exponent < -22 || exponent > 22) {
+        char *e;
+        double x = std::strtod(s, &e);
+        *end = e;
+        return x;
+    }
+    *end = p;
+    double x = exponent < 0 ? double(mantissa) / powers[-exponent]
+                            : double(mantissa) * powers[exponent];
+    return negative ? -x : x;
+}
+
+inline long mesh_parse_integer(const char *s, const char **end) {
+    const char *p = s;
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+')
+        p++;
+    long x = 0;
+    const char *digits = p;
+    for (; *p >= '0' && *p <= '9'; p++)
+        x = x < LONG_MAX / 10 ? 10*x + (*p - '0') : x;
+    *end = p == digits ? s : p;
+    return negative ? -x : x;
+}
+
+// Puts the pieces' arrays together in order, into out.
+template <typename T>
+void mesh_concatenate(const std::vector<std::vector<T> >& pieces, std::vector<T>& out) {
+    size_t size = 0;
+    for (const auto& piece : pieces)
+        size += piece.size();
+    out.reserve(size);
+    for (const auto& piece : pieces)
+        out.insert(out.end(), piece.begin(), piece.end());
+}
+
+
+// OBJ
+
+// One piece of an OBJ file, parsed. Each triangle corner has a position, a texture coordinate
+// and a normal index: a 0-based index into the whole file's array, or obj_absent, or for one
+// counted back from the end, its index in this piece's array less obj_relative. That may reach
+// back into earlier pieces, and is put right once their counts are known.
+struct obj_piece {
+    obj_piece() : bad_line(0) {}
+
+    std::vector<float> positions, uvs, normals;
+    std::vector<int> corners;
+    const char *bad_line;   // the first line that could not be read, if any
+};
+
+const int obj_absent = INT_MIN;
+const int obj_relative = 1 << 30;
+
+// Reads an OBJ index: positive from the start of the file, negative back from the current end.
+inline bool obj_index(const char *&s, int count, int& index) {
+    const char *end;
+    long i = mesh_parse_integer(s, &end);
+    if (end == s || i == 0 || i > INT_MAX || count + i <= -long(obj_relative))
+        return false;
+    index = i > 0 ? int(i - 1) : int(count + i) - obj_relative;
+    s = end;
+    return true;
+}
+
+void obj_parse_piece(const char *begin, const char *end, obj_piece& out) {
+    std::vector<int> polygon;
+    for (const char *line = begin; line < end; ) {
+        auto line_end = static_cast<const char*>(std::memchr(line, '\n', end - line));
+        if (!line_end)
+            line_end = end;
+        const char *s = mesh_skip_blanks(line);
+        bool good = true;
+
+        if (s[0] == 'v' && (mesh_blank(s[1]) || s[1] == 'n' || s[1] == 't')) {
+            int components = s[1] == 't' ? 2 : 3;
+            auto& values = s[1] == 't' ? out.uvs : s[1] == 'n' ? out.normals : out.positions;
+            s += mesh_blank(s[1]) ? 1 : 2;
+            for (int k = 0; k < components && good; k++) {
+                const char *number_end;
+                double x = mesh_parse_number(mesh_skip_blanks(s), &number_end);
+                good = number_end != mesh_skip_blanks(s) && mesh_blank(s[0]);
+                values.push_back(float(x));
+                s = number_end;
+            }
+        }
+        else if (s[0] == 'f' && mesh_blank(s[1])) {
+            int counts[3] = {
+                int(out.positions.size() / 3), int(out.uvs.size() / 2),
+                int(out.normals.size() / 3)
+            };
+            polygon.clear();
+            for (s = mesh_skip_blanks(s + 1); good && s < line_end && *s != '\n';
+                 s = mesh_skip_blanks(s)) {
+                int corner[3] = {obj_absent, obj_absent, obj_absent};
+                good = obj_index(s, counts[0], corner[0]);
+                for (int k = 1; k < 3 && good && *s == '/'; k++) {
+                    s++;
+                    if (k == 2 || *s != '/')
+                        good = obj_index(s, counts[k], corner[k]);
+                }
+                good = good && (mesh_blank(*s) || *s == '\n' || *s == 0);
+                polygon.insert(polygon.end(), corner, corner + 3);
+            }
+            good = good && polygon.size() >= 9;
+            for (size_t i = 6; good && i < polygon.size(); i += 3) {
+                out.corners.insert(out.corners.end(), polygon.begin(), polygon.begin() + 3);
+                out.corners.insert(out.corners.end(), polygon.begin() + i - 3,
+                                   polygon.begin() + i + 3);
+            }
+        }
+        // Groups, objects, materials and smoothing groups make no difference to the triangles.
+
+        if (!good && !out.bad_line)
+            out.bad_line = line;
+        line = line_end + 1;
+    }
+}
+
+// Reads an OBJ file's vertices and faces. Returns null, with a message, if it cannot.
+mesh_buffers *load_obj(const std::string& path, thread_pool *pool = 0) {
+    std::vector<char> text;
+    if (!mesh_read_file(path, text))
+        return 0;
+    const char *begin = text.data(), *end = begin + text.size() - 1;
+    auto bounds = mesh_line_pieces(pool, begin, end);
+    int num_pieces = int(bounds.size()) - 1;
+    std::vector<obj_piece> pieces(num_pieces);
+    mesh_run(pool, num_pieces, [&](int k) {
+        obj_parse_piece(bounds[k], bounds[k+1], pieces[k]);
+    });
+
+    // Where each piece's arrays start in the whole file's.
+    std::vector<int> base(3 * (num_pieces + 1), 0);
+    for (int k = 0; k < num_pieces; k++) {
+        if (pieces[k].bad_line) {
+            int line = 1 + int(std::count(begin, pieces[k].bad_line, '\n'));
+            std::cerr << path << ":" << line << ": could not read this line\n";
+            return 0;
+        }
+        base[3*k + 3] = base[3*k] + int(pieces[k].positions.size() / 3);
+        base[3*k + 4] = base[3*k + 1] + int(pieces[k].uvs.size() / 2);
+        base[3*k + 5] = base[3*k + 2] + int(pieces[k].normals.size() / 3);
+    }
+    const int *counts = &base[3 * num_pieces];
+
+    // Resolves the relative indices, and sees whether every corner has a texture coordinate and
+    // a normal, and whether they share the position's index.
+    std::vector<char> flags(num_pieces);
+    enum { out_of_range = 1, some_without_uv = 2, some_without_normal = 4, separate = 8 };
+    mesh_run(pool, num_pieces, [&](int k) {
+        int f = 0;
+        auto& corners = pieces[k].corners;
+        for (size_t i = 0; i < corners.size(); i += 3) {
+            for (int c = 0; c < 3; c++) {
+                int& index = corners[i + c];
+                if (index == obj_absent) {
+                    f |= c == 1 ? some_without_uv : c == 2 ? some_without_normal : 0;
+                    continue;
+                }
+                if (index < 0)
+                    index += obj_relative + base[3*k + c];
+                if (index < 0 || index >= counts[c])
+                    f |= out_of_range;
+                if (index != corners[i])
+                    f |= separate;
+            }
+        }
+        flags[k] = char(f);
+    });
+    int all = 0;
+    for (auto f : flags)
+        all |= f;
+    if (all & out_of_range) {
+        std::cerr << path << ": a face refers to a vertex the file doesn't have\n";
+        return 0;
+    }
+    bool uvs = !(all & some_without_uv) && counts[1] > 0;
+    bool normals = !(all & some_without_normal) && counts[2] > 0;
+
+    auto mesh = new mesh_buffers;
+    size_t num_corners = 0;
+    for (const auto& piece : pieces)
+        num_corners += piece.corners.size() / 3;
+    mesh->index_data.resize(num_corners);
+
+    if (!(all & separate)) {
+        // Every corner uses one index for all three, so the file's arrays can be used as they
+        // are, padded to one entry per position.
+        std::vector<std::vector<float> > arrays(num_pieces);
+        for (int k = 0; k < num_pieces; k++)
+            arrays[k].swap(pieces[k].positions);
+        mesh_concatenate(arrays, mesh->position_data);
+        if (uvs) {
+            for (int k = 0; k < num_pieces; k++)
+                arrays[k].swap(pieces[k].uvs);
+            mesh_concatenate(arrays, mesh->uv_data);
+            mesh->uv_data.resize(2 * size_t(counts[0]));
+        }
+        if (normals) {
+            for (int k = 0; k < num_pieces; k++)
+                arrays[k].swap(pieces[k].normals);
+            mesh_concatenate(arrays, mesh->normal_data);
+            mesh->normal_data.resize(3 * size_t(counts[0]));
+        }
+        size_t next = 0;
+        for (const auto& piece : pieces) {
+            for (size_t i = 0; i < piece.corners.size(); i += 3)
+                mesh->index_data[next++] = uint32_t(piece.corners[i]);
+        }
+    }
+    else {
+        // A vertex for each distinct combination of indices, found through a chain of the
+        // combinations made so far from each position.
+        std::vector<float> positions, file_uvs, file_normals;
+        std::vector<std::vector<float> > arrays(num_pieces);
+        for (int k = 0; k < num_pieces; k++)
+            arrays[k].swap(pieces[k].positions);
+        mesh_concatenate(arrays, positions);
+        for (int k = 0; k < num_pieces; k++)
+            arrays[k].swap(pieces[k].uvs);
+        mesh_concatenate(arrays, file_uvs);
+        for (int k = 0; k < num_pieces; k++)
+            arrays[k].swap(pieces[k].normals);
+        mesh_concatenate(arrays, file_normals);
+
+        std::vector<int> first(counts[0], -1), next_made, made_uv, made_normal;
+        size_t corner = 0;
+        for (const auto& piece : pieces) {
+            for (size_t i = 0; i < piece.corners.size(); i += 3) {
+                int p = piece.corners[i];
+                int t = uvs ? piece.corners[i+1] : 0;
+                int n = normals ? piece.corners[i+2] : 0;
+                int v = first[p];
+                while (v >= 0 && (made_uv[v] != t || made_normal[v] != n))
+                    v = next_made[v];
+                if (v < 0) {
+                    v = int(next_made.size());
+                    next_made.push_back(first[p]);
+                    first[p] = v;
+                    made_uv.push_back(t);
+                    made_normal.push_back(n);
+                    mesh->position_data.insert(mesh->position_data.end(),
+                                               &positions[3*p], &positions[3*p] + 3);
+                    if (uvs)
+                        mesh->uv_data.insert(mesh->uv_data.end(),
+                                             &file_uvs[2*t], &file_uvs[2*t] + 2);
+                    if (normals)
+                        mesh->normal_data.insert(mesh->normal_data.end(),
+                                                 &file_normals[3*n], &file_normals[3*n] + 3);
+                }
+                mesh->index_data[corner++] = uint32_t(v);
+            }
+        }
+    }
+    mesh->use_vectors();
+    return mesh;
+}
+
+
+// PLY
+
+enum ply_type { ply_int8, ply_uint8, ply_int16, ply_uint16, ply_int32, ply_uint32, ply_float32,
+                ply_float64, ply_unknown };
+
+struct ply_property {
+    std::string name;
+    ply_type type;
+    ply_type count_type;    // of the length of a list, or ply_unknown if it is not one
+};
+
+struct ply_element {
+    std::string name;
+    long count;
+    std::vector<ply_property> properties;
+};
+
+inline ply_type ply_type_named(const std::string& name) {
+    static const char *names[][2] = {
+        {"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"}, {"ushort", "uint16"},
+        {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}
+    };
+    for (int t = 0; t < ply_unknown; t++) {
+        if (name == names[t][0] || name == names[t][1])
+            return ply_type(t);
+    }
+    return ply_unknown;
+}
+
+inline int ply_type_size(ply_type type) {
+    static const int sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+    return sizes[type];
+}
+
+// Decodes a binary value, swapping its bytes if the file's order is not this machine's.
+inline double ply_read(const char *p, ply_type type, bool swap) {
+    unsigned char bytes[8];
+    int size = ply_type_size(type);
+    for (int i = 0; i < size; i++)
+        bytes[i] = p[swap ? size - 1 - i : i];
+    switch (type) {
+        case ply_int8:    { int8_t x;   std::memcpy(&x, bytes, 1); return x; }
+        case ply_uint8:   { uint8_t x;  std::memcpy(&x, bytes, 1); return x; }
+        case ply_int16:   { int16_t x;  std::memcpy(&x, bytes, 2); return x; }
+        case ply_uint16:  { uint16_t x; std::memcpy(&x, bytes, 2); return x; }
+        case ply_int32:   { int32_t x;  std::memcpy(&x, bytes, 4); return x; }
+        case ply_uint32:  { uint32_t x; std::memcpy(&x, bytes, 4); return x; }
+        case ply_float32: { float x;    std::memcpy(&x, bytes, 4); return x; }
+        default:          { double x;   std::memcpy(&x, bytes, 8); return x; }
+    }
+}
+
+// Whether a value read from a file converts to uint32_t: not NaN, negative or past 32 bits, any
+// of which would be undefined behaviour to convert.
+inline bool ply_fits_uint32(double x) {
+    return x >= 0 && x < 4294967296.0;
+}
+
+// Reads the header, setting data to the first byte after it. Returns false if it is not one
+// this reader understands.
+bool ply_parse_header(
+    const char *text, const char *&data, int& format, std::vector<ply_element>& elements
+) {
+    enum { ascii, little_endian, big_endian };
+    if (std::strncmp(text, "ply", 3) != 0)
+        return false;
+    format = -1;
+    for (const char *line = text; *line; ) {
+        const char *line_end = std::strchr(line, '\n');
+        if (!line_end)
+            return false;
+        std::string s(line, line_end);
+        if (!s.empty() && s.back() == '\r')
+            s.pop_back();
+        line = line_end + 1;
+
+        std::vector<std::string> words;
+        for (size_t i = 0; i < s.size(); ) {
+            size_t j = s.find_first_of(" \t", i);
+            if (j == std::string::npos)
+                j = s.size();
+            if (j > i)
+                words.push_back(s.substr(i, j - i));
+            i = j + 1;
+        }
+        if (words.empty())
+            continue;
+        if (words[0] == "end_header") {
+            data = line;
+            return format >= 0;
+        }
+        if (words[0] == "format" && words.size() >= 2) {
+            format = words[1] == "ascii" ? ascii
+                   : words[1] == "binary_little_endian" ? little_endian
+                   : words[1] == "binary_big_endian" ? big_endian : -1;
+        }
+        else if (words[0] == "element" && words.size() == 3) {
+            ply_element element;
+            element.name = words[1];
+            element.count = std::strtol(words[2].c_str(), 0, 10);
+            elements.push_back(element);
+        }
+        else if (words[0] == "property" && !elements.empty()) {
+            ply_property property;
+            if (words.size() == 5 && words[1] == "list") {
+                property.count_type = ply_type_named(words[2]);
+                property.type = ply_type_named(words[3]);
+                if (property.count_type == ply_unknown)
+                    return false;
+            }
+            else if (words.size() == 3) {
+                property.count_type = ply_unknown;
+                property.type = ply_type_named(words[1]);
+            }
+            else {
+                return false;
+            }
+            if (property.type == ply_unknown)
+                return false;
+            property.name = words.back();
+            elements.back().properties.push_back(property);
+        }
+    }
+    return false;
+}
+
+// The properties of a vertex the mesh takes: position, normal and texture coordinates, in the
+// order mesh_buffers keeps them, or -1 for those the file doesn't have.
+struct ply_vertex_layout {
+    explicit ply_vertex_layout(const ply_element& vertex) {
+        static const char *names[8][3] = {
+            {"x"}, {"y"}, {"z"}, {"nx"}, {"ny"}, {"nz"},
+            {"u", "s", "texture_u"}, {"v", "t", "texture_v"}
+        };
+        for (int k = 0; k < 8; k++) {
+            find[k] = -1;
+            for (int i = 0; i < int(vertex.properties.size()); i++) {
+                for (int n = 0; n < 3 && names[k][n]; n++) {
+                    if (vertex.properties[i].name == names[k][n])
+                        find[k] = i;
+                }
+            }
+        }
+    }
+
+    bool has_positions() const { return find[0] >= 0 && find[1] >= 0 && find[2] >= 0; }
+    bool has_normals() const { return find[3] >= 0 && find[4] >= 0 && find[5] >= 0; }
+    bool has_uvs() const { return find[6] >= 0 && find[7] >= 0; }
+
+    int find[8];
+};
+
+// The vertices and triangles read from one piece of an element.
+struct ply_piece {
+    std::vector<float> positions, normals, uvs;
+    std::vector<uint32_t> indices;
+
+    // Scratch space for a record.
+    std::vector<double> values;
+    std::vector<uint32_t> corners;
+};
+
+// Appends the vertex with these property values to the arrays the layout says it has.
+inline void ply_store_vertex(
+    ply_piece& out, const ply_vertex_layout& layout, const double *values
+) {
+    for (int a = 0; a < 3; a++)
+        out.positions.push_back(float(values[layout.find[a]]));
+    if (layout.has_normals()) {
+        for (int a = 0; a < 3; a++)
+            out.normals.push_back(float(values[layout.find[3 + a]]));
+    }
+    if (layout.has_uvs()) {
+        out.uvs.push_back(float(values[layout.find[6]]));
+        out.uvs.push_back(float(values[layout.find[7]]));
+    }
+}
+
+// Appends the triangles of a polygon to indices; false if it has fewer than three corners.
+inline bool ply_store_face(std::vector<uint32_t>& indices, const std::vector<uint32_t>& corners) {
+    for (size_t i = 2; i < corners.size(); i++) {
+        indices.push_back(corners[0]);
+        indices.push_back(corners[i-1]);
+        indices.push_back(corners[i]);
+    }
+    return corners.size() >= 3;
+}
+
+// Reads a record of an ASCII element at s, setting s past it: the values of its scalar
+// properties into values, and the items of the list property at list into corners.
+inline bool ply_ascii_record(
+    const ply_element& element, const char *&s, std::vector<double>& values, int list,
+    std::vector<uint32_t>& corners
+) {
+    values.clear();
+    corners.clear();
+    for (int p = 0; p < int(element.properties.size()); p++) {
+        const char *end;
+        double x = mesh_parse_number(mesh_skip_blanks(s), &end);
+        if (end == mesh_skip_blanks(s))
+            return false;
+        s = end;
+        if (element.properties[p].count_type == ply_unknown) {
+            values.push_back(x);
+            continue;
+        }
+        if (!ply_fits_uint32(x))
+            return false;
+        for (uint32_t i = 0, n = uint32_t(x); i < n; i++) {
+            x = mesh_parse_number(mesh_skip_blanks(s), &end);
+            if (end == mesh_skip_blanks(s) || !ply_fits_uint32(x))
+                return false;
+            s = end;
+            if (p == list)
+                corners.push_back(uint32_t(x));
+        }
+    }
+    return true;
+}
+
+// Reads a record of a binary element at s in the same way, if it ends before end.
+inline bool ply_binary_record(
+    const ply_element& element, const char *&s, const char *end, bool swap,
+    std::vector<double>& values, int list, std::vector<uint32_t>& corners
+) {
+    values.clear();
+    corners.clear();
+    for (int p = 0; p < int(element.properties.size()); p++) {
+        const ply_property& property = element.properties[p];
+        int size = ply_type_size(property.type);
+        if (property.count_type == ply_unknown) {
+            if (end - s < size)
+                return false;
+            values.push_back(ply_read(s, property.type, swap));
+            s += size;
+            continue;
+        }
+        if (end - s < ply_type_size(property.count_type))
+            return false;
+        double n = ply_read(s, property.count_type, swap);
+        s += ply_type_size(property.count_type);
+        if (!(n >= 0 && n <= double(end - s) / size))
+            return false;
+        for (long i = 0; p == list && i < long(n); i++) {
+            double x = ply_read(s + i*size, property.type, swap);
+            if (!ply_fits_uint32(x))
+                return false;
+            corners.push_back(uint32_t(x));
+        }
+        s += long(n) * size;
+    }
+    return true;
+}
+
+// Reads the count records of an ASCII element at s, one per line, setting s past them. The
+// lines are parsed in pieces, with parse(line, out) reading each into the piece's ply_piece.
+template <typename record_function>
+bool ply_ascii_element(
+    thread_pool *pool, const char *&s, const char *end, long count,
+    std::vector<ply_piece>& pieces, const record_function& parse
+) {
+    const char *begin = s;
+    for (long i = 0; i < count; i++) {
+        if (s >= end)
+            return false;
+        auto line_end = static_cast<const char*>(std::memchr(s, '\n', end - s));
+        s = line_end ? line_end + 1 : end;
+    }
+    auto bounds = mesh_line_pieces(pool, begin, s);
+    int num_pieces = int(bounds.size()) - 1;
+    pieces.assign(num_pieces, ply_piece());
+    std::vector<char> good(num_pieces, 1);
+    mesh_run(pool, num_pieces, [&](int k) {
+        for (const char *line = bounds[k]; line < bounds[k+1] && good[k]; ) {
+            auto line_end = static_cast<const char*>(
+                std::memchr(line, '\n', bounds[k+1] - line));
+            good[k] = parse(line, pieces[k]);
+            line = line_end ? line_end + 1 : bounds[k+1];
+        }
+    });
+    return std::find(good.begin(), good.end(), 0) == good.end();
+}
+
+// Reads a PLY file's vertex and face elements, in ASCII or either binary byte order. Returns
+// null, with a message, if it cannot.
+mesh_buffers *load_ply(const std::string& path, thread_pool *pool = 0) {
+    std::vector<char> text;
+    if (!mesh_read_file(path, text))
+        return 0;
+    const char *s = 0, *end = text.data() + text.size() - 1;
+    int format;
+    std::vector<ply_element> elements;
+    if (!ply_parse_header(text.data(), s, format, elements)) {
+        std::cerr << path << ": not a PLY file this reader understands\n";
+        return 0;
+    }
+    bool binary = format != 0;
+    const uint16_t one = 1;
+    bool little_endian_machine = *reinterpret_cast<const unsigned char*>(&one) == 1;
+    bool swap = binary && (format == 1) != little_endian_machine;
+
+    std::vector<ply_piece> vertices, faces;
+    bool have_vertices = false, have_faces = false, good = true;
+    std::vector<double> values;
+    std::vector<uint32_t> corners;
+    for (size_t e = 0; e < elements.size() && good && !(have_vertices && have_faces); e++) {
+        const ply_element& element = elements[e];
+        int num_properties = int(element.properties.size());
+        if (element.count < 0 || element.count > INT_MAX) {
+            good = false;
+            break;
+        }
+
+        // The record size, if every property is a scalar.
+        long stride = 0;
+        for (const auto& property : element.properties) {
+            stride = property.count_type != ply_unknown || stride < 0
+                   ? -1 : stride + ply_type_size(property.type);
+        }
+        int list = -1;
+        for (int p = 0; p < num_properties; p++) {
+            const std::string& name = element.properties[p].name;
+            if (element.properties[p].count_type != ply_unknown
+                && (name == "vertex_indices" || name == "vertex_index"))
+                list = p;
+        }
+
+        if (element.name == "vertex" && !have_vertices) {
+            ply_vertex_layout layout(element);
+            if (!layout.has_positions()) {
+                good = false;
+                break;
+            }
+            have_vertices = true;
+            if (!binary) {
+                good = ply_ascii_element(pool, s, end, element.count, vertices,
+                    [&](const char *line, ply_piece& out) {
+                        bool read = ply_ascii_record(element, line, out.values, -1, out.corners)
+                                 && int(out.values.size()) == num_properties;
+                        if (read)
+                            ply_store_vertex(out, layout, out.values.data());
+                        return read;
+                    });
+            }
+            else if (stride >= 0) {
+                // Fixed-size records, decoded in parallel straight into place.
+                size_t n = size_t(element.count);
+                if (size_t(end - s) < n * stride) {
+                    good = false;
+                    break;
+                }
+                std::vector<int> offsets(1, 0);
+                for (const auto& property : element.properties)
+                    offsets.push_back(offsets.back() + ply_type_size(property.type));
+                const char *data = s;
+                vertices.assign(1, ply_piece());
+                ply_piece& out = vertices[0];
+                out.positions.resize(3*n);
+                out.normals.resize(layout.has_normals() ? 3*n : 0);
+                out.uvs.resize(layout.has_uvs() ? 2*n : 0);
+                const int columns[8] = {0, 1, 2, 0, 1, 2, 0, 1};
+                bvh_for_pieces(pool, 0, int(n), [&](int first, int last, int) {
+                    for (int i = first; i < last; i++) {
+                        const char *record = data + size_t(i) * stride;
+                        for (int k = 0; k < 8; k++) {
+                            int p = layout.find[k];
+                            if (p < 0 || (k >= 3 && k < 6 && !layout.has_normals())
+                                || (k >= 6 && !layout.has_uvs()))
+                                continue;
+                            auto& array = k < 3 ? out.positions : k < 6 ? out.normals : out.uvs;
+                            int width = k < 6 ? 3 : 2;
+                            array[size_t(i) * width + columns[k]] = float(ply_read(
+                                record + offsets[p], element.properties[p].type, swap));
+                        }
+                    }
+                });
+                s += n * stride;
+            }
+            else {
+                good = false;
+            }
+        }
+        else if (element.name == "face" && !have_faces && list >= 0) {
+            have_faces = true;
+            if (!binary) {
+                good = ply_ascii_element(pool, s, end, element.count, faces,
+                    [&](const char *line, ply_piece& out) {
+                        return ply_ascii_record(element, line, out.values, list, out.corners)
+                            && ply_store_face(out.indices, out.corners);
+                    });
+            }
+            else {
+                // Records that differ in length can only be found one after another.
+                faces.assign(1, ply_piece());
+                for (long i = 0; i < element.count && good; i++) {
+                    good = ply_binary_record(element, s, end, swap, values, list, corners)
+                        && ply_store_face(faces[0].indices, corners);
+                }
+            }
+        }
+        else if (!binary) {
+            std::vector<ply_piece> skipped;
+            good = ply_ascii_element(0, s, end, element.count, skipped,
+                [](const char *, ply_piece&) { return true; });
+        }
+        else if (stride >= 0) {
+            good = size_t(end - s) >= size_t(element.count) * stride;
+            s += good ? element.count * stride : 0;
+        }
+        else {
+            for (long i = 0; i < element.count && good; i++)
+                good = ply_binary_record(element, s, end, swap, values, -1, corners);
+        }
+    }
+    if (!good || !have_vertices) {
+        std::cerr << path << ": could not read the " << (have_faces ? "faces" : "vertices")
+                  << '\n';
+        return 0;
+    }
+
+    auto mesh = new mesh_buffers;
+    std::vector<std::vector<float> > arrays(vertices.size());
+    for (size_t k = 0; k < vertices.size(); k++)
+        arrays[k].swap(vertices[k].positions);
+    mesh_concatenate(arrays, mesh->position_data);
+    for (size_t k = 0; k < vertices.size(); k++)
+        arrays[k].swap(vertices[k].normals);
+    mesh_concatenate(arrays, mesh->normal_data);
+    for (size_t k = 0; k < vertices.size(); k++)
+        arrays[k].swap(vertices[k].uvs);
+    mesh_concatenate(arrays, mesh->uv_data);
+    std::vector<std::vector<uint32_t> > indices(faces.size());
+    for (size_t k = 0; k < faces.size(); k++)
+        indices[k].swap(faces[k].indices);
+    mesh_concatenate(indices, mesh->index_data);
+
+    uint32_t num_vertices = uint32_t(mesh->position_data.size() / 3);
+    for (auto index : mesh->index_data) {
+        if (index >= num_vertices) {
+            std::cerr << path << ": a face refers to a vertex the file doesn't have\n";
+            delete mesh;
+            return 0;
+        }
+    }
+    mesh->use_vectors();
+    return mesh;
+}
+
+
+// Either format, or a mesh file
+
+inline bool mesh_path_ends_with(const std::string& path, const char *suffix) {
+    size_t n = std::strlen(suffix);
+    if (path.size() < n)
+        return false;
+    for (size_t i = 0; i < n; i++) {
+        if (std::tolower(static_cast<unsigned char>(path[path.size() - n + i])) != suffix[i])
+            return false;
+    }
+    return true;
+}
+
+// Identifies this version of the source file, and the tree the options would build over it:
+// false if the file cannot be looked at, or there is no mmap to cache with.
+bool mesh_source_key(const std::string& path, const bvh_build_options& options, uint64_t& key) {
+#if defined(RTW_BVH_CACHE_MMAP)
+    struct stat status;
+    if (stat(path.c_str(), &status) != 0)
+        return false;
+    bvh_cache_hasher hash;
+    hash.add(uint64_t(mesh_file_version));
+    for (char c : path)
+        hash.add(uint64_t(static_cast<unsigned char>(c)));
+    hash.add(uint64_t(status.st_size));
+    hash.add(uint64_t(status.st_mtime));
+    hash.add(uint64_t(options.split));
+    hash.add(uint64_t(options.bins));
+    hash.add(uint64_t(options.max_leaf_size));
+    hash.add(options.traversal_cost);
+    hash.add(options.intersection_cost);
+    hash.add(uint64_t(options.treelet_passes));
+    key = hash.value();
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline std::string mesh_cache_path(const std::string& directory, uint64_t key) {
+    char name[64];
+    std::snprintf(name, sizeof name, "/mesh-%016llx.rtwmesh", (unsigned long long)key);
+    return directory + name;
+}
+
+// Reads the mesh at path: an OBJ or PLY file, by its extension, parsed on options.threads
+// threads, or a mesh file, mapped. With options.cache_directory set, a parsed mesh is saved
+// there with the BVH the options build over it, and mapped from there as long as the source
+// file keeps its size and modification time. Returns null, with a message, if it cannot.
+mesh_buffers *load_mesh(const std::string& path, const bvh_build_options& options) {
+    if (mesh_path_ends_with(path, ".rtwmesh")) {
+        auto mesh = map_mesh_file(path);
+        if (!mesh)
+            std::cerr << "Could not load " << path << '\n';
+        return mesh;
+    }
+    bool obj = mesh_path_ends_with(path, ".obj");
+    if (!obj && !mesh_path_ends_with(path, ".ply")) {
+        std::cerr << path << ": meshes are read from .obj, .ply and .rtwmesh files\n";
+        return 0;
+    }
+
+    uint64_t key = 0;
+    std::string cached;
+    if (options.cache_directory && mesh_source_key(path, options, key)) {
+        cached = mesh_cache_path(options.cache_directory, key);
+        if (auto mesh = map_mesh_file(cached, key))
+            return mesh;
+    }
+
+    thread_pool *pool = options.threads != 1 ? new thread_pool(options.threads) : 0;
+    mesh_buffers *mesh = obj ? load_obj(path, pool) : load_ply(path, pool);
+    if (mesh && !cached.empty()) {
+        // The tree goes in the mesh file, not the BVH cache.
+        auto build = options;
+        build.cache_directory = 0;
+        flat_bvh tree(triangle_primitives(*mesh, pool), build);
+        if (write_mesh_file(cached, *mesh, &tree, key)) {
+            if (auto mapped = map_mesh_file(cached, key)) {
+                delete mesh;
+                mesh = mapped;
+            }
+        }
+    }
+    delete pool;
+    return mesh;
+}
+
+#endif
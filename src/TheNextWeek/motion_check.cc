@@ -0,0 +1,100 @@
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "flat_bvh.h"
+#include "motion_bvh.h"
+#include "moving_sphere.h"
+
+#include <iostream>
+#include <vector>
+
+
+// Checks that a motion_bvh over moving spheres finds the same closest hits and the same
+// occlusion as a flat_bvh over the whole shutter, for one time segment and several, and for
+// trees taken from the SAH and the spatial split builders. Exits with 1 on any difference.
+//
+//     motion_check [SPHERES [RAYS]]
+
+// Casts the rays at both trees and counts the ones they disagree on.
+int differences(
+    const flat_bvh& reference, const motion_bvh& tree, const std::vector<ray>& rays, rng& gen
+) {
+    int different = 0;
+    for (const auto& r : rays) {
+        hit_record expected, found;
+        bool expected_hit = reference.find_hit(r, 0.001, infinity, expected, gen);
+        bool found_hit = tree.find_hit(r, 0.001, infinity, found, gen);
+        if (expected_hit != found_hit
+            || (expected_hit && (expected.t != found.t || expected.object != found.object)))
+            different++;
+        else if (reference.occluded(r, 0.001, 500, gen) != tree.occluded(r, 0.001, 500, gen))
+            different++;
+    }
+    return different;
+}
+
+bool check(
+    const char *name, std::vector<hittable*>& list, const flat_bvh& reference,
+    bvh_build_options::split_method split, int time_segments, const std::vector<ray>& rays,
+    rng& gen
+) {
+    bvh_build_options options;
+    options.cache_directory = 0;
+    options.split = split;
+    motion_bvh tree(list.data(), static_cast<int>(list.size()), 0, 1, options, time_segments);
+
+    int references = 0;
+    for (const auto& seg : tree.segments)
+        references += seg.num_prims;
+    int different = differences(reference, tree, rays, gen);
+
+    std::cout << name << ", " << time_segments << " segment" << (time_segments > 1 ? "s" : "")
+              << ": " << references << " references, " << different << " of " << rays.size()
+              << " rays differ from flat_bvh" << (different ? "  FAILED" : "") << '\n';
+    return different == 0;
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? std::atoi(argv[1]) : 2000;
+    int num_rays = argc > 2 ? std::atoi(argv[2]) : 20000;
+    rng gen;
+
+    // Mostly small spheres that travel far, and a few large ones for the spatial splits to cut.
+    std::vector<hittable*> list;
+    for (int i = 0; i < n; i++) {
+        vec3 center(100 * random_double(gen), 100 * random_double(gen), 100 * random_double(gen));
+        vec3 travel(10 * random_double(gen), 0, 10 * random_double(gen) - 5);
+        double radius = i % 50 == 0 ? 10 + 10 * random_double(gen) : 0.2 + random_double(gen);
+        list.push_back(new moving_sphere(center, center + travel, 0, 1, radius, 0));
+    }
+
+    std::vector<ray> rays;
+    for (int i = 0; i < num_rays; i++) {
+        vec3 origin(120 * random_double(gen) - 10, 120 * random_double(gen) - 10, -20);
+        vec3 target(100 * random_double(gen), 100 * random_double(gen), 100 * random_double(gen));
+        rays.push_back(ray(origin, target - origin, random_double(gen)));
+    }
+
+    bvh_build_options options;
+    options.cache_directory = 0;
+    flat_bvh reference(list.data(), n, 0, 1, options);
+
+    bool ok = true;
+    for (int segments = 1; segments <= 4; segments += 3) {
+        ok = check("SAH", list, reference, bvh_build_options::split_sah, segments, rays, gen)
+             && ok;
+        ok = check("SBVH", list, reference, bvh_build_options::split_sbvh, segments, rays, gen)
+             && ok;
+    }
+
+    for (auto p : list)
+        delete p;
+    return ok ? 0 : 1;
+}
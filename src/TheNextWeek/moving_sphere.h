@@ -21,7 +21,11 @@ class moving_sphere: public hittable  {
         moving_sphere(vec3 cen0, vec3 cen1, double t0, double t1, double r, material *m)
             : center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r), mat_ptr(m)
         {};
-        virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+        virtual bool find_hit(
+            const ray& r, double tmin, double tmax, hit_record& rec, rng& gen
+        ) const;
+        virtual void finish_hit(const ray& r, hit_record& rec) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax, rng& gen) const;
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
         vec3 center(double time) const;
         vec3 center0, center1;
@@ -47,7 +51,9 @@ bool moving_sphere::bounding_box(double t0, double t1, aabb& output_box) const {
 
 
 // replace "center" with "center(r.time())"
-bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool moving_sphere::find_hit(
+    const ray& r, double t_min, double t_max, hit_record& rec, rng& gen
+) const {
     vec3 oc = r.origin() - center(r.time());
     auto a = dot(r.direction(), r.direction());
     auto b = dot(oc, r.direction());
@@ -57,21 +63,39 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
         auto temp = (-b - sqrt(discriminant))/a;
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            rec.normal = (rec.p - center(r.time())) / radius;
-            rec.mat_ptr = mat_ptr;
+            rec.object = this;
             return true;
         }
         temp = (-b + sqrt(discriminant))/a;
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            rec.normal = (rec.p - center(r.time())) / radius;
-            rec.mat_ptr = mat_ptr;
+            rec.object = this;
             return true;
         }
     }
     return false;
 }
 
+void moving_sphere::finish_hit(const ray& r, hit_record& rec) const {
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = (rec.p - center(r.time())) / radius;
+    rec.mat_ptr = mat_ptr;
+}
+
+bool moving_sphere::occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+    vec3 oc = r.origin() - center(r.time());
+    auto a = dot(r.direction(), r.direction());
+    auto b = dot(oc, r.direction());
+    auto c = dot(oc, oc) - radius*radius;
+    auto discriminant = b*b - a*c;
+    if (discriminant <= 0)
+        return false;
+
+    auto temp = (-b - sqrt(discriminant))/a;
+    if (temp < t_max && temp > t_min)
+        return true;
+    temp = (-b + sqrt(discriminant))/a;
+    return temp < t_max && temp > t_min;
+}
+
 #endif
@@ -33,4 +33,20 @@ class ray
         double _time;
 };
 
+// What box tests need from a ray, worked out once per ray instead of once per box: the reciprocal
+// of its direction, and along each axis whether it points the negative way.
+struct ray_query {
+    ray_query(const ray& r)
+      : origin(r.origin()),
+        inv_dir(1/r.direction().x(), 1/r.direction().y(), 1/r.direction().z())
+    {
+        for (int a = 0; a < 3; a++)
+            sign[a] = inv_dir[a] < 0;
+    }
+
+    vec3 origin;
+    vec3 inv_dir;
+    int sign[3];    // 1 where the direction is negative, including -0
+};
+
 #endif
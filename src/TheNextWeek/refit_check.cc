@@ -0,0 +1,199 @@
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "common/thread_pool.h"
+#include "flat_bvh.h"
+#include "sphere.h"
+#include "wide_bvh.h"
+
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <vector>
+
+
+// Checks that refitting on a thread pool gives the same nodes as refitting on one thread, for
+// trees large enough to be refit in parallel, and that every primitive lies inside the box of its
+// leaf afterwards; and that updating trees built with spatial splits rebuilds them over each
+// primitive once. Exits with 1 on any difference.
+//
+//     refit_check [SPHERES]
+
+bool inside(const aabb& box, float *low, float *high) {
+    for (int a = 0; a < 3; a++)
+        if (box.min()[a] < low[a] || box.max()[a] > high[a])
+            return false;
+    return true;
+}
+
+int outside_leaves(const flat_bvh& tree) {
+    int outside = 0;
+    for (int i = 0; i < tree.num_nodes; i++) {
+        const flat_bvh_node& node = tree.nodes[i];
+        if (!node.is_leaf())
+            continue;
+        float low[3], high[3];
+        for (int a = 0; a < 3; a++) {
+            low[a] = node.bounds_min[a];
+            high[a] = node.bounds_max[a];
+        }
+        for (int p = node.offset; p < int(node.offset + node.count); p++) {
+            aabb box;
+            tree.prims[p]->bounding_box(0, 1, box);
+            outside += !inside(box, low, high);
+        }
+    }
+    return outside;
+}
+
+template <int width>
+int outside_leaves(const wide_bvh<width>& tree) {
+    int outside = 0;
+    for (int i = 0; i < tree.num_nodes; i++) {
+        const wide_bvh_node<width>& node = tree.nodes[i];
+        for (int k = 0; k < width; k++) {
+            float low[3], high[3];
+            for (int a = 0; a < 3; a++) {
+                low[a] = node.bounds[a][k];
+                high[a] = node.bounds[3+a][k];
+            }
+            for (uint32_t p = node.child[k]; node.count[k] > 0 && p < node.child[k] + node.count[k];
+                 p++) {
+                aabb box;
+                tree.prims[p]->bounding_box(0, 1, box);
+                outside += !inside(box, low, high);
+            }
+        }
+    }
+    return outside;
+}
+
+bool same_node(const flat_bvh_node& a, const flat_bvh_node& b) {
+    return std::memcmp(a.bounds_min, b.bounds_min, sizeof a.bounds_min) == 0
+           && std::memcmp(a.bounds_max, b.bounds_max, sizeof a.bounds_max) == 0
+           && a.offset == b.offset && a.count == b.count;
+}
+
+// Field by field: the padding of a wide node need not match.
+template <int width>
+bool same_node(const wide_bvh_node<width>& a, const wide_bvh_node<width>& b) {
+    return std::memcmp(a.bounds, b.bounds, sizeof a.bounds) == 0
+           && std::memcmp(a.child, b.child, sizeof a.child) == 0
+           && std::memcmp(a.count, b.count, sizeof a.count) == 0;
+}
+
+void place(std::vector<sphere*>& spheres, const std::vector<vec3>& centers) {
+    for (size_t i = 0; i < spheres.size(); i++)
+        spheres[i]->center = centers[i];
+}
+
+// Builds two copies of a tree over the spheres, moves the spheres, refits one copy serially and
+// the other on the pool, and compares them.
+template <typename tree_type>
+bool check(
+    const char *name, std::vector<sphere*>& spheres, const std::vector<vec3>& home,
+    const std::vector<vec3>& moved, thread_pool& pool
+) {
+    std::vector<hittable*> list(spheres.begin(), spheres.end());
+    bvh_build_options options;
+    options.cache_directory = 0;
+    options.threads = 1;
+    place(spheres, home);
+    tree_type serial(list.data(), static_cast<int>(list.size()), 0, 1, options);
+    tree_type pooled(list.data(), static_cast<int>(list.size()), 0, 1, options);
+
+    place(spheres, moved);
+    serial.refit(0, 1);
+    pooled.refit(0, 1, &pool);
+
+    bool same = serial.num_nodes == pooled.num_nodes;
+    for (int i = 0; same && i < serial.num_nodes; i++)
+        same = same_node(serial.nodes[i], pooled.nodes[i]);
+    int serial_outside = outside_leaves(serial), pooled_outside = outside_leaves(pooled);
+
+    bool ok = same && serial_outside == 0 && pooled_outside == 0;
+    std::cout << name << ": " << serial.num_nodes << " nodes, "
+              << (same ? "pooled refit matches serial" : "pooled refit differs from serial")
+              << ", " << serial_outside << " and " << pooled_outside
+              << " primitives outside their leaves" << (ok ? "" : "  FAILED") << '\n';
+    return ok;
+}
+
+// Builds a tree with spatial splits, then moves the spheres back and forth far enough for every
+// update() to rebuild it, and checks that each rebuilt tree holds every sphere in as many
+// references as a tree built afresh would: no more than the split budget allows, and not the
+// references of the tree before. Split spheres stick out of their clipped leaves.
+template <typename tree_type>
+bool check_spatial(
+    const char *name, std::vector<sphere*>& spheres, const std::vector<vec3>& home,
+    const std::vector<vec3>& scattered, thread_pool& pool
+) {
+    std::vector<hittable*> list(spheres.begin(), spheres.end());
+    bvh_build_options options;
+    options.cache_directory = 0;
+    options.threads = 1;
+    options.split = bvh_build_options::split_sbvh;
+    place(spheres, home);
+    tree_type tree(list.data(), static_cast<int>(list.size()), 0, 1, options);
+    int initial = tree.num_prims;
+    int limit = static_cast<int>(list.size() * (1 + options.spatial_split_budget));
+
+    int rebuilds = 0, most = 0;
+    bool ok = true;
+    for (int frame = 0; frame < 4; frame++) {
+        place(spheres, frame % 2 ? home : scattered);
+        rebuilds += tree.update(0, 1, &pool) == flat_bvh::rebuilt;
+        tree_type fresh(list.data(), static_cast<int>(list.size()), 0, 1, options);
+        std::set<hittable*> present(tree.prims, tree.prims + tree.num_prims);
+        ok = ok && present.size() == list.size() && tree.num_prims == fresh.num_prims;
+        most = std::max(most, tree.num_prims);
+    }
+    ok = ok && rebuilds == 4 && most <= limit;
+
+    std::cout << name << " with spatial splits: " << initial << " references built, at most "
+              << most << " after " << rebuilds << " of 4 updates rebuilt it"
+              << (ok ? "" : "  FAILED") << '\n';
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? std::atoi(argv[1]) : 200000;
+    rng gen;
+    std::vector<sphere*> spheres;
+    std::vector<vec3> home, moved;
+    for (int i = 0; i < n; i++) {
+        vec3 center(1000 * random_double(gen), 1000 * random_double(gen),
+                    1000 * random_double(gen));
+        spheres.push_back(new sphere(center, 0.5 + random_double(gen), 0));
+        home.push_back(center);
+        moved.push_back(center + vec3(50, 0, 0.001 * (i % 7)));
+    }
+
+    // Four threads even on one core: the split into subtrees is what is being checked.
+    thread_pool pool(4);
+    bool ok = check<flat_bvh>("flat_bvh", spheres, home, moved, pool);
+    ok = check<bvh4>("bvh4", spheres, home, moved, pool) && ok;
+    ok = check<bvh8>("bvh8", spheres, home, moved, pool) && ok;
+
+    // Fewer spheres, some of them large enough to be split, each moved to another's place.
+    std::vector<sphere*> split_spheres;
+    std::vector<vec3> split_home;
+    for (int i = 0; i < 10000; i++) {
+        vec3 center(1000 * random_double(gen), 1000 * random_double(gen),
+                    1000 * random_double(gen));
+        double radius = i % 100 == 0 ? 20 + 20 * random_double(gen) : 0.5 + random_double(gen);
+        split_spheres.push_back(new sphere(center, radius, 0));
+        split_home.push_back(center);
+    }
+    std::vector<vec3> scattered(split_home.rbegin(), split_home.rend());
+    ok = check_spatial<flat_bvh>("flat_bvh", split_spheres, split_home, scattered, pool) && ok;
+    ok = check_spatial<bvh8>("bvh8", split_spheres, split_home, scattered, pool) && ok;
+    return ok ? 0 : 1;
+}
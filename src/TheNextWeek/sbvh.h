@@ -0,0 +1,328 @@
+#ifndef SBVH_H
+#define SBVH_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "bvh_build.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <vector>
+
+
+// Spatial split BVH construction (Stich, Friedrich and Dietrich, "Spatial Splits in Bounding
+// Volume Hierarchies", 2009).
+//
+// The tree is built over references to primitives, each with a box that bounds the part of its
+// primitive the reference stands for. At every node the best object split is found as usual. If
+// the two halves it makes overlap by more than a small fraction of the scene's area, spatial
+// splits are priced too: the node's box is cut into equal slabs along each axis, every reference
+// is clipped to each slab it crosses (hittable::clipped_bounding_box), and each plane between
+// slabs is priced with the references wholly on either side plus the clipped pieces of those that
+// cross it. A spatial split that wins sends each crossing reference to both sides, clipped to
+// each, until the references number more than (1 + spatial_split_budget) times the primitives.
+//
+// The nodes come out in flat_bvh's depth-first layout: an interior node's first child follows it
+// and `offset` is its second; a leaf's primitives are refs[offset, offset + count).
+
+class sbvh {
+    public:
+        // Below median_depth, nodes are split at the median only, so that the depth stays
+        // bounded.
+        sbvh(
+            hittable **l, const bvh_primitives& info, double time0, double time1,
+            const bvh_build_options& options, int median_depth
+        );
+
+        struct node {
+            aabb bounds;
+            int offset;
+            int count;      // 0 for interior nodes
+            int axis;
+        };
+
+        std::vector<node> nodes;
+        std::vector<int> refs;      // the primitive of each leaf entry
+
+    private:
+        void build(std::vector<int>& index, int depth);
+        double spatial_split(
+            const std::vector<int>& index, const aabb& bounds, int& axis, double& plane,
+            int& duplicates
+        ) const;
+        void split_spatially(
+            std::vector<int>& index, int axis, double plane, std::vector<int>& left,
+            std::vector<int>& right
+        );
+        bool clip(int ref, const aabb& clip_box, aabb& output_box) const;
+        double split_cost(const aabb& bounds, const aabb& left, int left_count,
+                          const aabb& right, int right_count) const;
+
+        // Below this fraction of the scene's area, the overlap of an object split's halves is
+        // not worth pricing spatial splits for.
+        static constexpr double overlap_threshold = 1e-5;
+
+        hittable **list;
+        double time0, time1;
+        bvh_build_options options;
+        int median_depth;
+        int max_refs;
+        double root_area;
+
+        bvh_primitives ref_info;    // the box and centroid of every reference
+        std::vector<int> ref_prim;  // and the primitive it refers to
+};
+
+
+sbvh::sbvh(
+    hittable **l, const bvh_primitives& info, double time0, double time1,
+    const bvh_build_options& options, int median_depth
+) : list(l), time0(time0), time1(time1), options(options), median_depth(median_depth),
+    ref_info(info)
+{
+    int n = static_cast<int>(info.boxes.size());
+    auto budget = std::max(options.spatial_split_budget, 0.0);
+    max_refs = static_cast<int>(std::min(n * (1 + budget), 2e9));
+    std::vector<int> index(n);
+    ref_prim.resize(n);
+    for (int i = 0; i < n; i++)
+        index[i] = ref_prim[i] = i;
+
+    aabb bounds, centroid_bounds;
+    bvh_range_bounds(ref_info, index.data(), 0, n, bounds, centroid_bounds);
+    root_area = bounds.area();
+    build(index, 0);
+}
+
+double sbvh::split_cost(
+    const aabb& bounds, const aabb& left, int left_count, const aabb& right, int right_count
+) const {
+    auto area = bounds.area();
+    auto inv_area = area > 0 ? 1 / area : 0;
+    return options.traversal_cost + options.intersection_cost
+         * (left.area()*left_count + right.area()*right_count) * inv_area;
+}
+
+// Appends the subtree over the references in index, which it empties.
+void sbvh::build(std::vector<int>& index, int depth) {
+    int this_node = static_cast<int>(nodes.size());
+    nodes.push_back(node());
+
+    int n = static_cast<int>(index.size());
+    aabb bounds, centroid_bounds;
+    bvh_range_bounds(ref_info, index.data(), 0, n, bounds, centroid_bounds);
+    nodes[this_node].bounds = bounds;
+
+    int axis = 0, mid = 0;
+    auto best_cost = infinity;
+    bool spatial = false;
+    int spatial_axis = 0;
+    double plane = 0;
+    if (n > 1) {
+        bvh_build_options split_options = options;
+        split_options.split = depth >= median_depth ? bvh_build_options::split_median
+                                                    : bvh_build_options::split_sah;
+        mid = bvh_split(
+            ref_info, index.data(), 0, n, bounds, centroid_bounds, split_options, false, axis);
+
+        aabb left_bounds, right_bounds, unused;
+        bvh_range_bounds(ref_info, index.data(), 0, mid, left_bounds, unused);
+        bvh_range_bounds(ref_info, index.data(), mid, n, right_bounds, unused);
+        best_cost = split_cost(bounds, left_bounds, mid, right_bounds, n - mid);
+
+        aabb overlap;
+        if (depth < median_depth && root_area > 0
+            && overlapping_box(left_bounds, right_bounds, overlap)
+            && overlap.area() > overlap_threshold * root_area
+        ) {
+            int duplicates;
+            auto cost = spatial_split(index, bounds, spatial_axis, plane, duplicates);
+            if (cost < best_cost && static_cast<int>(ref_prim.size()) + duplicates <= max_refs) {
+                best_cost = cost;
+                spatial = true;
+            }
+        }
+    }
+
+    if (n <= 1 || (n <= options.max_leaf_size && options.intersection_cost * n <= best_cost)) {
+        // Pieces of one primitive can meet again in a leaf, which needs it only once.
+        auto& leaf = nodes[this_node];
+        leaf.offset = static_cast<int>(refs.size());
+        leaf.axis = 0;
+        for (int ref : index)
+            if (std::find(refs.begin() + leaf.offset, refs.end(), ref_prim[ref]) == refs.end())
+                refs.push_back(ref_prim[ref]);
+        leaf.count = static_cast<int>(refs.size()) - leaf.offset;
+        index.clear();
+        return;
+    }
+
+    std::vector<int> left, right;
+    if (spatial) {
+        split_spatially(index, spatial_axis, plane, left, right);
+        if (left.empty() || right.empty()) {
+            // Every piece fell on one side after all, in the order it came in; split by object.
+            left.clear();
+            right.clear();
+            spatial = false;
+        }
+        else
+            axis = spatial_axis;
+    }
+    if (!spatial) {
+        left.assign(index.begin(), index.begin() + mid);
+        right.assign(index.begin() + mid, index.end());
+    }
+
+    index.clear();
+    index.shrink_to_fit();
+    build(left, depth + 1);
+    nodes[this_node].offset = static_cast<int>(nodes.size());
+    nodes[this_node].count = 0;
+    nodes[this_node].axis = axis;
+    build(right, depth + 1);
+}
+
+bool sbvh::clip(int ref, const aabb& clip_box, aabb& output_box) const {
+    aabb box;
+    return overlapping_box(ref_info.boxes[ref], clip_box, box)
+        && list[ref_prim[ref]]->clipped_bounding_box(time0, time1, box, output_box);
+}
+
+// Returns the cost of the best spatial split of the node, and sets its axis, its plane and how
+// many references crossing the plane it would duplicate.
+double sbvh::spatial_split(
+    const std::vector<int>& index, const aabb& bounds, int& axis, double& plane,
+    int& duplicates
+) const {
+    const int bins = std::max(options.bins, 2);
+    auto best_cost = infinity;
+    axis = duplicates = 0;
+    plane = 0;
+    std::vector<aabb> bin_bounds(bins);
+    std::vector<int> entries(bins), exits(bins), filled(bins);
+    std::vector<double> right_area(bins);
+    std::vector<int> right_count(bins);
+
+    for (int a = 0; a < 3; a++) {
+        auto low = bounds.min()[a];
+        auto extent = bounds.max()[a] - low;
+        if (extent <= 0)
+            continue;
+        auto width = extent / bins;
+        auto bin = [&](double x) {
+            return std::max(0, std::min(static_cast<int>((x - low) / width), bins-1));
+        };
+
+        std::fill(entries.begin(), entries.end(), 0);
+        std::fill(exits.begin(), exits.end(), 0);
+        std::fill(filled.begin(), filled.end(), 0);
+        for (int ref : index) {
+            const aabb& box = ref_info.boxes[ref];
+            int first = bin(box.min()[a]), last = bin(box.max()[a]);
+            entries[first]++;
+            exits[last]++;
+            for (int b = first; b <= last; b++) {
+                aabb piece = box;
+                if (first != last) {
+                    vec3 small = box.min(), big = box.max();
+                    small[a] = ffmax(small[a], low + b*width);
+                    big[a] = b == bins-1 ? big[a] : ffmin(big[a], low + (b+1)*width);
+                    if (!clip(ref, aabb(small, big), piece))
+                        continue;
+                }
+                bin_bounds[b] = filled[b]++ ? surrounding_box(bin_bounds[b], piece) : piece;
+            }
+        }
+
+        // Sweep from the right for the area and count right of each plane, then from the left to
+        // price every plane.
+        aabb sweep;
+        int count = 0, pieces = 0;
+        for (int b = bins-1; b > 0; b--) {
+            if (filled[b])
+                sweep = pieces++ ? surrounding_box(sweep, bin_bounds[b]) : bin_bounds[b];
+            count += exits[b];
+            right_area[b] = pieces ? sweep.area() : 0;
+            right_count[b] = count;
+        }
+
+        count = pieces = 0;
+        for (int b = 0; b < bins-1; b++) {
+            if (filled[b])
+                sweep = pieces++ ? surrounding_box(sweep, bin_bounds[b]) : bin_bounds[b];
+            count += entries[b];
+            if (count == 0 || right_count[b+1] == 0)
+                continue;
+            auto area = bounds.area();
+            auto cost = options.traversal_cost + options.intersection_cost
+                      * (sweep.area()*count + right_area[b+1]*right_count[b+1])
+                      / (area > 0 ? area : 1);
+            if (cost < best_cost) {
+                best_cost = cost;
+                axis = a;
+                plane = low + (b+1)*width;
+                duplicates = count + right_count[b+1] - static_cast<int>(index.size());
+            }
+        }
+    }
+    return best_cost;
+}
+
+// Sends each reference to the side of the plane it lies on, and clips those crossing it to both.
+void sbvh::split_spatially(
+    std::vector<int>& index, int axis, double plane, std::vector<int>& left,
+    std::vector<int>& right
+) {
+    for (int ref : index) {
+        const aabb box = ref_info.boxes[ref];
+        if (box.max()[axis] <= plane) {
+            left.push_back(ref);
+            continue;
+        }
+        if (box.min()[axis] >= plane) {
+            right.push_back(ref);
+            continue;
+        }
+
+        vec3 left_max = box.max(), right_min = box.min();
+        left_max[axis] = right_min[axis] = plane;
+        aabb left_piece, right_piece;
+        bool in_left = clip(ref, aabb(box.min(), left_max), left_piece);
+        bool in_right = clip(ref, aabb(right_min, box.max()), right_piece);
+        if (in_left && in_right) {
+            ref_info.boxes[ref] = left_piece;
+            ref_info.centroids[ref] = 0.5 * (left_piece.min() + left_piece.max());
+            left.push_back(ref);
+
+            int copy = static_cast<int>(ref_prim.size());
+            ref_prim.push_back(ref_prim[ref]);
+            ref_info.boxes.push_back(right_piece);
+            ref_info.centroids.push_back(0.5 * (right_piece.min() + right_piece.max()));
+            right.push_back(copy);
+        }
+        else if (in_right) {
+            ref_info.boxes[ref] = right_piece;
+            ref_info.centroids[ref] = 0.5 * (right_piece.min() + right_piece.max());
+            right.push_back(ref);
+        }
+        else {
+            // The clipped box found nothing on the right, so the reference lies on the left;
+            // if it found nothing on either side, it keeps its box rather than vanish.
+            if (in_left) {
+                ref_info.boxes[ref] = left_piece;
+                ref_info.centroids[ref] = 0.5 * (left_piece.min() + left_piece.max());
+            }
+            left.push_back(ref);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,162 @@
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "wide_bvh.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+
+// Times the ray-box tests against each other: every ray against every box, counting hits.
+//
+//     original   aabb::hit as it was, dividing by the direction twice per axis per box
+//     scalar     aabb::hit with a ray_query made once per ray
+//     float      flat_bvh's test of a node's float bounds
+//     sse/avx    wide_bvh's test of 4 or 8 boxes at a time
+//
+// One ray in eight runs along an axis, through the planes of boxes that share its coordinates,
+// so the NaN cases are exercised too.
+
+bool original_hit(const aabb& box, const ray& r, double tmin, double tmax) {
+    for (int a = 0; a < 3; a++) {
+        auto t0 = ffmin((box.min()[a] - r.origin()[a]) / r.direction()[a],
+                        (box.max()[a] - r.origin()[a]) / r.direction()[a]);
+        auto t1 = ffmax((box.min()[a] - r.origin()[a]) / r.direction()[a],
+                        (box.max()[a] - r.origin()[a]) / r.direction()[a]);
+        tmin = ffmax(t0, tmin);
+        tmax = ffmin(t1, tmax);
+        if (tmax <= tmin)
+            return false;
+    }
+    return true;
+}
+
+// The nodes are over-aligned for the vector loads, which std::vector does not promise before C++17.
+template <typename node_type>
+node_type *allocate_aligned(int count, std::vector<char>& storage) {
+    const uintptr_t alignment = alignof(node_type);
+    storage.resize(count * sizeof(node_type) + alignment - 1);
+    auto address = (reinterpret_cast<uintptr_t>(storage.data()) + alignment - 1) & ~(alignment - 1);
+    return reinterpret_cast<node_type*>(address);
+}
+
+template <typename test_function>
+void run(const char *name, long long tests, long long expected, const test_function& test) {
+    auto start = std::chrono::steady_clock::now();
+    long long hits = test();
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    std::cout << std::setw(10) << name << std::setw(10) << std::fixed << std::setprecision(2)
+              << 1e9 * seconds.count() / tests << " ns/box  " << hits << " hits";
+    if (expected >= 0 && hits != expected)
+        std::cout << "  (" << hits - expected << " against scalar)";
+    std::cout << '\n';
+}
+
+int main() {
+    const int num_boxes = 1024;
+    const int num_rays = 20000;
+
+    std::vector<aabb> boxes;
+    std::vector<char> storage[3];
+    auto flat = allocate_aligned<flat_bvh_node>(num_boxes, storage[0]);
+    auto packs4 = allocate_aligned<wide_bvh_node<4>>(num_boxes / 4, storage[1]);
+    auto packs8 = allocate_aligned<wide_bvh_node<8>>(num_boxes / 8, storage[2]);
+    for (int i = 0; i < num_boxes; i++) {
+        // Integer corners, so axis-aligned rays from integer origins hit their planes exactly.
+        vec3 corner(int(100*random_double()), int(100*random_double()), int(100*random_double()));
+        vec3 size(1 + int(10*random_double()), 1 + int(10*random_double()),
+                  1 + int(10*random_double()));
+        boxes.push_back(aabb(corner, corner + size));
+        flat[i] = flat_bvh_bounds_node(boxes[i]);
+        for (int a = 0; a < 3; a++) {
+            packs4[i/4].bounds[a][i%4] = packs8[i/8].bounds[a][i%8] = flat[i].bounds_min[a];
+            packs4[i/4].bounds[3+a][i%4] = packs8[i/8].bounds[3+a][i%8] = flat[i].bounds_max[a];
+        }
+    }
+
+    std::vector<ray> rays;
+    for (int i = 0; i < num_rays; i++) {
+        vec3 origin(int(100*random_double()), int(100*random_double()), -20);
+        vec3 direction(random_double() - 0.5, random_double() - 0.5, 1);
+        if (i % 8 == 0)
+            direction = vec3(0, 0, 1);
+        rays.push_back(ray(origin, direction));
+    }
+
+    const long long tests = static_cast<long long>(num_boxes) * num_rays;
+    std::cout << num_rays << " rays against " << num_boxes << " boxes\n";
+
+    long long expected = 0;
+    for (const auto& r : rays) {
+        ray_query q(r);
+        for (const auto& box : boxes)
+            expected += box.hit(q, 0, infinity);
+    }
+
+    run("original", tests, expected, [&] {
+        long long hits = 0;
+        for (const auto& r : rays)
+            for (const auto& box : boxes)
+                hits += original_hit(box, r, 0, infinity);
+        return hits;
+    });
+
+    run("scalar", tests, expected, [&] {
+        long long hits = 0;
+        for (const auto& r : rays) {
+            ray_query q(r);
+            for (const auto& box : boxes)
+                hits += box.hit(q, 0, infinity);
+        }
+        return hits;
+    });
+
+    run("float", tests, expected, [&] {
+        long long hits = 0;
+        for (const auto& r : rays) {
+            ray_query q(r);
+            for (int i = 0; i < num_boxes; i++)
+                hits += flat_bvh_node_hit(flat[i], q, 0, infinity);
+        }
+        return hits;
+    });
+
+    run("sse", tests, expected, [&] {
+        long long hits = 0;
+        float t_near[4];
+        for (const auto& r : rays) {
+            ray_query q(r);
+            wide_bvh_ray wr(q);
+            for (int i = 0; i < num_boxes / 4; i++) {
+                auto mask = wide_bvh_box_hits<4>(packs4[i], wr, 0, INFINITY, t_near);
+                for (; mask; mask &= mask - 1)
+                    hits++;
+            }
+        }
+        return hits;
+    });
+
+    run("avx", tests, expected, [&] {
+        long long hits = 0;
+        float t_near[8];
+        for (const auto& r : rays) {
+            ray_query q(r);
+            wide_bvh_ray wr(q);
+            for (int i = 0; i < num_boxes / 8; i++) {
+                auto mask = wide_bvh_box_hits<8>(packs8[i], wr, 0, INFINITY, t_near);
+                for (; mask; mask &= mask - 1)
+                    hits++;
+            }
+        }
+        return hits;
+    });
+}
@@ -19,8 +19,15 @@ class sphere: public hittable  {
     public:
         sphere() {}
         sphere(vec3 cen, double r, material *m) : center(cen), radius(r), mat_ptr(m) {};
-        virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+        virtual bool find_hit(
+            const ray& r, double tmin, double tmax, hit_record& rec, rng& gen
+        ) const;
+        virtual void finish_hit(const ray& r, hit_record& rec) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax, rng& gen) const;
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+        virtual bool clipped_bounding_box(
+            double t0, double t1, const aabb& clip, aabb& output_box
+        ) const;
 
         vec3 center;
         double radius;
@@ -35,7 +42,49 @@ bool sphere::bounding_box(double t0, double t1, aabb& output_box) const {
     return true;
 }
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+// Along each axis, the part of the surface inside the clipped box can reach no farther from the
+// center than the widest cross-section of the sphere that meets the box's other two ranges. A
+// box wholly inside the sphere holds none of the surface.
+bool sphere::clipped_bounding_box(
+    double t0, double t1, const aabb& clip, aabb& output_box
+) const {
+    aabb clipped;
+    if (!overlapping_box(aabb(center - vec3(radius, radius, radius),
+                              center + vec3(radius, radius, radius)), clip, clipped))
+        return false;
+
+    vec3 low = clipped.min() - center, high = clipped.max() - center;
+    auto farthest = 0.0;
+    vec3 nearest;
+    for (int a = 0; a < 3; a++) {
+        farthest += ffmax(low[a]*low[a], high[a]*high[a]);
+        nearest[a] = low[a] > 0 ? low[a] : (high[a] < 0 ? -high[a] : 0);
+    }
+    auto r2 = radius*radius;
+    if (farthest < r2)
+        return false;
+
+    vec3 small, big;
+    for (int a = 0; a < 3; a++) {
+        auto d2 = 0.0;
+        for (int b = 0; b < 3; b++)
+            if (b != a)
+                d2 += nearest[b]*nearest[b];
+        if (d2 > r2)
+            return false;
+        auto reach = sqrt(r2 - d2);
+        small[a] = ffmax(low[a], -reach);
+        big[a] = ffmin(high[a], reach);
+        if (small[a] > big[a])
+            return false;
+    }
+    output_box = aabb(center + small, center + big);
+    return true;
+}
+
+bool sphere::find_hit(
+    const ray& r, double t_min, double t_max, hit_record& rec, rng& gen
+) const {
     vec3 oc = r.origin() - center;
     auto a = r.direction().squared_length();
     auto half_b = dot(oc, r.direction());
@@ -48,24 +97,42 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
         auto temp = (-half_b - root)/a;
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            get_sphere_uv((rec.p-center)/radius, rec.u, rec.v);
-            rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr;
+            rec.object = this;
             return true;
         }
 
         temp = (-half_b + root)/a;
         if (temp < t_max && temp > t_min) {
             rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            get_sphere_uv((rec.p-center)/radius, rec.u, rec.v);
-            rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr;
+            rec.object = this;
             return true;
         }
     }
     return false;
 }
 
+void sphere::finish_hit(const ray& r, hit_record& rec) const {
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = (rec.p - center) / radius;
+    get_sphere_uv(rec.normal, rec.u, rec.v);
+    rec.mat_ptr = mat_ptr;
+}
+
+bool sphere::occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+    vec3 oc = r.origin() - center;
+    auto a = r.direction().squared_length();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.squared_length() - radius*radius;
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant <= 0)
+        return false;
+
+    auto root = sqrt(discriminant);
+    auto temp = (-half_b - root)/a;
+    if (temp < t_max && temp > t_min)
+        return true;
+    temp = (-half_b + root)/a;
+    return temp < t_max && temp > t_min;
+}
+
 #endif
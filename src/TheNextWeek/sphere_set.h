@@ -0,0 +1,455 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "common/traversal_stats.h"
+#include "bvh_build.h"
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "wide_bvh.h"
+
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+
+// Spheres, still or moving, kept as arrays rather than one hittable each: a float array per
+// coordinate for the vector tests, and the exact description of each sphere beside them. Each
+// sphere names its material by an index into `materials`.
+//
+// A sphere_set keeps its own BVH, a bvh8 built over the spheres' boxes, whose leaves hold as many
+// spheres as one vector test takes: 8 with AVX2, 4 otherwise.
+// A leaf's spheres are tested together in float, against spheres grown by a margin larger than
+// the rounding error of the test, and only the ones the ray may hit are tested again exactly, as
+// sphere and moving_sphere test themselves. The hits are therefore the ones those would find.
+//
+// Add the spheres, then build() the tree before rendering.
+
+#if defined(__AVX2__)
+const int sphere_set_width = 8;
+#else
+const int sphere_set_width = 4;
+#endif
+
+// One sphere, exactly. A still sphere has center1 == center0.
+struct sphere_set_item {
+    vec3 center0, center1;
+    double time0, time1;
+    double radius;
+    uint32_t material;
+    bool moving;
+
+    vec3 center(double time) const {
+        if (!moving)
+            return center0;
+        return center0 + ((time - time0) / (time1 - time0))*(center1 - center0);
+    }
+};
+
+// The ray as the float tests want it: unit direction, and distances along it in its own units.
+struct sphere_set_ray {
+    explicit sphere_set_ray(const ray& r) {
+        length = r.direction().length();
+        scale = 0;
+        double inverse = 1 / length;
+        for (int a = 0; a < 3; a++) {
+            origin[a] = static_cast<float>(r.origin()[a]);
+            direction[a] = static_cast<float>(r.direction()[a] * inverse);
+            scale = ffmax(scale, std::fabs(r.origin()[a]));
+        }
+        time = static_cast<float>(r.time());
+    }
+
+    float origin[3];
+    float direction[3];
+    float time;
+    float scale;        // the largest coordinate of the origin
+    double length;      // of the ray's direction
+};
+
+class sphere_set : public hittable {
+    public:
+        sphere_set() : tree(0) {}
+        ~sphere_set() { delete tree; }
+
+        void add(const vec3& center, double radius, material *m);
+        void add(
+            const vec3& center0, const vec3& center1, double time0, double time1, double radius,
+            material *m
+        );
+
+        // Builds the tree over the spheres' bounds from time0 to time1, and puts the spheres in
+        // the order of its leaves. The options' max_leaf_size is capped at sphere_set_width.
+        void build(
+            double time0, double time1,
+            const bvh_build_options& options = bvh_build_options()
+        );
+
+        virtual bool find_hit(
+            const ray& r, double tmin, double tmax, hit_record& rec, rng& gen
+        ) const;
+        virtual void finish_hit(const ray& r, hit_record& rec) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax, rng& gen) const;
+        virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+
+        int size() const { return static_cast<int>(items.size()); }
+
+        std::vector<sphere_set_item> items;
+        std::vector<material*> materials;
+        bvh8 *tree;     // over the spheres; items are in the order of its leaves
+
+    private:
+        sphere_set(const sphere_set&);
+        sphere_set& operator=(const sphere_set&);
+
+        // Masks the spheres of the leaf at [first, first + count) the ray may hit between lo and
+        // hi, in the float ray's units.
+        unsigned candidates(
+            const sphere_set_ray& r, int first, int count, float lo, float hi
+        ) const;
+        bool hit_item(int i, const ray& r, double t_min, double t_max, double& t) const;
+
+        std::map<material*, uint32_t> material_index;
+
+        // In leaf order, padded by a vector's width: each center at time0, its velocity, and the
+        // time it starts from, so that the center is (x, y, z) + (time - start) * velocity; the
+        // radius; and the largest coordinate a sphere reaches plus its radius, which scales the
+        // margin for rounding.
+        std::vector<float> x, y, z, vx, vy, vz, start, radius, reach;
+};
+
+
+void sphere_set::add(const vec3& center, double r, material *m) {
+    add(center, center, 0, 1, r, m);
+    items.back().moving = false;
+}
+
+void sphere_set::add(
+    const vec3& center0, const vec3& center1, double time0, double time1, double r, material *m
+) {
+    auto found = material_index.find(m);
+    if (found == material_index.end()) {
+        found = material_index.insert(
+            std::make_pair(m, static_cast<uint32_t>(materials.size()))).first;
+        materials.push_back(m);
+    }
+    sphere_set_item item = {center0, center1, time0, time1, r, found->second, true};
+    items.push_back(item);
+}
+
+void sphere_set::build(double time0, double time1, const bvh_build_options& options) {
+    int n = size();
+    bvh_primitives info(n);
+    for (int i = 0; i < n; i++) {
+        const sphere_set_item& s = items[i];
+        vec3 extent(s.radius, s.radius, s.radius);
+        vec3 c0 = s.center(time0), c1 = s.center(time1);
+        info.boxes[i] = surrounding_box(aabb(c0 - extent, c0 + extent),
+                                        aabb(c1 - extent, c1 + extent));
+        info.centroids[i] = 0.5 * (info.boxes[i].min() + info.boxes[i].max());
+    }
+    auto leaf_options = options;
+    if (leaf_options.max_leaf_size > sphere_set_width)
+        leaf_options.max_leaf_size = sphere_set_width;
+    delete tree;
+    tree = new bvh8(info, leaf_options);
+
+    std::vector<sphere_set_item> sorted(n);
+    for (int i = 0; i < n; i++)
+        sorted[i] = items[tree->order[i]];
+    items.swap(sorted);
+
+    std::vector<float> *arrays[] = {&x, &y, &z, &vx, &vy, &vz, &start, &radius, &reach};
+    for (auto array : arrays)
+        array->assign(n + sphere_set_width, 0.0f);
+    for (int i = 0; i < n; i++) {
+        const sphere_set_item& s = items[i];
+        vec3 velocity = s.moving ? (s.center1 - s.center0) / (s.time1 - s.time0) : vec3(0,0,0);
+        double largest = 0;
+        for (int a = 0; a < 3; a++) {
+            largest = ffmax(largest, ffmax(std::fabs(s.center0[a]), std::fabs(s.center1[a])));
+            largest = ffmax(largest, ffmax(std::fabs(s.center(time0)[a]),
+                                           std::fabs(s.center(time1)[a])));
+        }
+        x[i] = static_cast<float>(s.center0.x());
+        y[i] = static_cast<float>(s.center0.y());
+        z[i] = static_cast<float>(s.center0.z());
+        vx[i] = static_cast<float>(velocity.x());
+        vy[i] = static_cast<float>(velocity.y());
+        vz[i] = static_cast<float>(velocity.z());
+        start[i] = static_cast<float>(s.moving ? s.time0 : 0);
+        radius[i] = static_cast<float>(s.radius);
+        reach[i] = static_cast<float>(largest + s.radius);
+    }
+}
+
+// No box until build().
+bool sphere_set::bounding_box(double t0, double t1, aabb& output_box) const {
+    if (!tree)
+        return false;
+    output_box = tree->box;
+    return true;
+}
+
+// The float test of each sphere: the center at the ray's time, its distance along the ray (b)
+// and from the ray (d2), and the chord the ray would cut through it. Every rounding error in these
+// is a few ulps of the origin's or the sphere's largest coordinate, so growing the radius and the
+// interval by 64 ulps of their sum keeps every sphere the exact test would hit.
+unsigned sphere_set::candidates(
+    const sphere_set_ray& r, int first, int count, float lo, float hi
+) const {
+    // A lone sphere is cheaper to test exactly straight away.
+    if (count == 1)
+        return 1;
+
+    const float ulps = 64 * 5.9604645e-8f;
+    unsigned mask = 0;
+#if defined(__AVX2__)
+    auto ox = _mm256_set1_ps(r.origin[0]), oy = _mm256_set1_ps(r.origin[1]);
+    auto oz = _mm256_set1_ps(r.origin[2]);
+    auto dx = _mm256_set1_ps(r.direction[0]), dy = _mm256_set1_ps(r.direction[1]);
+    auto dz = _mm256_set1_ps(r.direction[2]);
+    auto dt = _mm256_sub_ps(_mm256_set1_ps(r.time), _mm256_loadu_ps(&start[first]));
+    auto cx = _mm256_sub_ps(
+        _mm256_add_ps(_mm256_loadu_ps(&x[first]), _mm256_mul_ps(dt, _mm256_loadu_ps(&vx[first]))),
+        ox);
+    auto cy = _mm256_sub_ps(
+        _mm256_add_ps(_mm256_loadu_ps(&y[first]), _mm256_mul_ps(dt, _mm256_loadu_ps(&vy[first]))),
+        oy);
+    auto cz = _mm256_sub_ps(
+        _mm256_add_ps(_mm256_loadu_ps(&z[first]), _mm256_mul_ps(dt, _mm256_loadu_ps(&vz[first]))),
+        oz);
+    auto b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cx, dx), _mm256_mul_ps(cy, dy)),
+                           _mm256_mul_ps(cz, dz));
+    auto fx = _mm256_sub_ps(cx, _mm256_mul_ps(b, dx));
+    auto fy = _mm256_sub_ps(cy, _mm256_mul_ps(b, dy));
+    auto fz = _mm256_sub_ps(cz, _mm256_mul_ps(b, dz));
+    auto d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(fx, fx), _mm256_mul_ps(fy, fy)),
+                            _mm256_mul_ps(fz, fz));
+    auto slack = _mm256_mul_ps(_mm256_set1_ps(ulps),
+                               _mm256_add_ps(_mm256_set1_ps(r.scale),
+                                             _mm256_loadu_ps(&reach[first])));
+    auto grown = _mm256_add_ps(_mm256_loadu_ps(&radius[first]), slack);
+    auto h2 = _mm256_sub_ps(_mm256_mul_ps(grown, grown), d2);
+    auto h = _mm256_sqrt_ps(_mm256_max_ps(h2, _mm256_setzero_ps()));
+    auto near = _mm256_sub_ps(_mm256_sub_ps(b, h), slack);
+    auto far = _mm256_add_ps(_mm256_add_ps(b, h), slack);
+    auto inside = _mm256_and_ps(
+        _mm256_cmp_ps(h2, _mm256_setzero_ps(), _CMP_GE_OQ),
+        _mm256_and_ps(_mm256_cmp_ps(far, _mm256_set1_ps(lo), _CMP_GE_OQ),
+                      _mm256_cmp_ps(near, _mm256_set1_ps(hi), _CMP_LE_OQ)));
+    mask = static_cast<unsigned>(_mm256_movemask_ps(inside));
+#elif defined(WIDE_BVH_SSE)
+    auto ox = _mm_set1_ps(r.origin[0]), oy = _mm_set1_ps(r.origin[1]);
+    auto oz = _mm_set1_ps(r.origin[2]);
+    auto dx = _mm_set1_ps(r.direction[0]), dy = _mm_set1_ps(r.direction[1]);
+    auto dz = _mm_set1_ps(r.direction[2]);
+    auto dt = _mm_sub_ps(_mm_set1_ps(r.time), _mm_loadu_ps(&start[first]));
+    auto cx = _mm_sub_ps(
+        _mm_add_ps(_mm_loadu_ps(&x[first]), _mm_mul_ps(dt, _mm_loadu_ps(&vx[first]))), ox);
+    auto cy = _mm_sub_ps(
+        _mm_add_ps(_mm_loadu_ps(&y[first]), _mm_mul_ps(dt, _mm_loadu_ps(&vy[first]))), oy);
+    auto cz = _mm_sub_ps(
+        _mm_add_ps(_mm_loadu_ps(&z[first]), _mm_mul_ps(dt, _mm_loadu_ps(&vz[first]))), oz);
+    auto b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, dx), _mm_mul_ps(cy, dy)), _mm_mul_ps(cz, dz));
+    auto fx = _mm_sub_ps(cx, _mm_mul_ps(b, dx));
+    auto fy = _mm_sub_ps(cy, _mm_mul_ps(b, dy));
+    auto fz = _mm_sub_ps(cz, _mm_mul_ps(b, dz));
+    auto d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(fx, fx), _mm_mul_ps(fy, fy)), _mm_mul_ps(fz, fz));
+    auto slack = _mm_mul_ps(_mm_set1_ps(ulps),
+                            _mm_add_ps(_mm_set1_ps(r.scale), _mm_loadu_ps(&reach[first])));
+    auto grown = _mm_add_ps(_mm_loadu_ps(&radius[first]), slack);
+    auto h2 = _mm_sub_ps(_mm_mul_ps(grown, grown), d2);
+    auto h = _mm_sqrt_ps(_mm_max_ps(h2, _mm_setzero_ps()));
+    auto near = _mm_sub_ps(_mm_sub_ps(b, h), slack);
+    auto far = _mm_add_ps(_mm_add_ps(b, h), slack);
+    auto inside = _mm_and_ps(_mm_cmpge_ps(h2, _mm_setzero_ps()),
+                             _mm_and_ps(_mm_cmpge_ps(far, _mm_set1_ps(lo)),
+                                        _mm_cmple_ps(near, _mm_set1_ps(hi))));
+    mask = static_cast<unsigned>(_mm_movemask_ps(inside));
+#else
+    for (int k = 0; k < count; k++) {
+        int i = first + k;
+        float dt = r.time - start[i];
+        float c[3] = {
+            x[i] + dt*vx[i] - r.origin[0], y[i] + dt*vy[i] - r.origin[1],
+            z[i] + dt*vz[i] - r.origin[2]
+        };
+        float b = c[0]*r.direction[0] + c[1]*r.direction[1] + c[2]*r.direction[2];
+        float d2 = 0;
+        for (int a = 0; a < 3; a++)
+            d2 += (c[a] - b*r.direction[a]) * (c[a] - b*r.direction[a]);
+        float slack = ulps * (r.scale + reach[i]);
+        float grown = radius[i] + slack;
+        float h2 = grown*grown - d2;
+        float h = std::sqrt(h2 > 0 ? h2 : 0);
+        if (h2 >= 0 && b + h + slack >= lo && b - h - slack <= hi)
+            mask |= 1u << k;
+    }
+#endif
+    return mask & ((1u << count) - 1);
+}
+
+// The exact test, as sphere::hit and moving_sphere::hit make it.
+bool sphere_set::hit_item(int i, const ray& r, double t_min, double t_max, double& t) const {
+    const sphere_set_item& s = items[i];
+    vec3 oc = r.origin() - s.center(r.time());
+    auto a = r.direction().squared_length();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.squared_length() - s.radius*s.radius;
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant <= 0)
+        return false;
+
+    auto root = sqrt(discriminant);
+    auto temp = (-half_b - root)/a;
+    if (temp < t_max && temp > t_min) {
+        t = temp;
+        return true;
+    }
+    temp = (-half_b + root)/a;
+    if (temp < t_max && temp > t_min) {
+        t = temp;
+        return true;
+    }
+    return false;
+}
+
+// The walk of wide_bvh::find_hit, testing each leaf's spheres together. Leaves the sphere as the
+// record's primitive.
+bool sphere_set::find_hit(
+    const ray& r, double t_min, double t_max, hit_record& rec, rng& gen
+) const {
+    ray_query q(r);
+    wide_bvh_ray wr(q);
+    sphere_set_ray w(r);
+    float float_t_min = float_down(t_min);
+    auto lo = static_cast<float>(t_min * w.length);
+
+    struct entry {
+        uint32_t child;
+        uint32_t count;
+        float t;
+    };
+    entry stack[bvh8::stack_size];
+    int num_entries = 0;
+
+    int closest = -1;
+    double closest_so_far = t_max;
+    float float_closest = float_up(t_max);
+    entry current = { 0, 0, float_t_min };
+
+    for (;;) {
+        if (current.count > 0) {
+            for (uint32_t k = 0; k < current.count; k++)
+                count_primitive_test();
+            auto hi = static_cast<float>(closest_so_far * w.length);
+            for (auto mask = candidates(w, current.child, current.count, lo, hi); mask;
+                 mask &= mask - 1) {
+                int i = current.child + lowest_bit(mask);
+                double t;
+                if (hit_item(i, r, t_min, closest_so_far, t)) {
+                    closest = i;
+                    closest_so_far = t;
+                    float_closest = float_up(closest_so_far);
+                }
+            }
+        }
+        else {
+            count_node_visit();
+            const wide_bvh_node<8>& node = tree->nodes[current.child];
+            float t_near[8];
+            unsigned mask = wide_bvh_box_hits<8>(node, wr, float_t_min, float_closest, t_near);
+            int base = num_entries;
+            for (; mask; mask &= mask - 1) {
+                int k = lowest_bit(mask);
+                entry e = { node.child[k], node.count[k], t_near[k] };
+                int j = num_entries++;
+                for (; j > base && stack[j-1].t < e.t; j--)
+                    stack[j] = stack[j-1];
+                stack[j] = e;
+            }
+            if (num_entries > base) {
+                current = stack[--num_entries];
+                continue;
+            }
+        }
+
+        do {
+            if (num_entries == 0) {
+                if (closest < 0)
+                    return false;
+                rec.t = closest_so_far;
+                rec.object = this;
+                rec.primitive = closest;
+                return true;
+            }
+            current = stack[--num_entries];
+        } while (current.t > float_closest);
+    }
+}
+
+// As with sphere and moving_sphere, only a still sphere gets texture coordinates.
+void sphere_set::finish_hit(const ray& r, hit_record& rec) const {
+    const sphere_set_item& s = items[rec.primitive];
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = (rec.p - s.center(r.time())) / s.radius;
+    if (!s.moving)
+        get_sphere_uv(rec.normal, rec.u, rec.v);
+    rec.mat_ptr = materials[s.material];
+}
+
+bool sphere_set::occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+    ray_query q(r);
+    wide_bvh_ray wr(q);
+    sphere_set_ray w(r);
+    float float_t_min = float_down(t_min);
+    float float_t_max = float_up(t_max);
+    auto lo = static_cast<float>(t_min * w.length);
+    auto hi = static_cast<float>(t_max * w.length);
+
+    uint32_t stack[bvh8::stack_size];
+    uint32_t counts[bvh8::stack_size];
+    int num_entries = 0;
+    uint32_t child = 0, count = 0;
+
+    for (;;) {
+        if (count > 0) {
+            for (uint32_t k = 0; k < count; k++)
+                count_primitive_test();
+            for (auto mask = candidates(w, child, count, lo, hi); mask; mask &= mask - 1) {
+                double t;
+                if (hit_item(child + lowest_bit(mask), r, t_min, t_max, t))
+                    return true;
+            }
+        }
+        else {
+            count_node_visit();
+            const wide_bvh_node<8>& node = tree->nodes[child];
+            float t_near[8];
+            unsigned mask = wide_bvh_box_hits<8>(node, wr, float_t_min, float_t_max, t_near);
+            for (; mask; mask &= mask - 1) {
+                int k = lowest_bit(mask);
+                stack[num_entries] = node.child[k];
+                counts[num_entries++] = node.count[k];
+            }
+        }
+
+        if (num_entries == 0)
+            return false;
+        num_entries--;
+        child = stack[num_entries];
+        count = counts[num_entries];
+    }
+}
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "common/traversal_stats.h"
+#include "bvh_build.h"
+#include "flat_bvh.h"
+#include "hittable.h"
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+
+// The arrays a triangle mesh is made of: a position per vertex, optionally a normal and a
+// texture coordinate per vertex, and three vertex indices per triangle, wound counterclockwise
+// seen from the outside. Meshes read them through the pointers, which point either into the
+// vectors here or into a mapped mesh file (see mesh_file.h). Any number of triangle_meshes may
+// share one set of buffers.
+class mesh_buffers {
+    public:
+        mesh_buffers()
+          : positions(0), normals(0), uvs(0), indices(0), num_vertices(0), num_triangles(0),
+            nodes(0), num_nodes(0) {}
+        virtual ~mesh_buffers() {}
+
+        // Points the arrays at the vectors, once they have been filled.
+        void use_vectors() {
+            positions = position_data.data();
+            normals = normal_data.empty() ? 0 : normal_data.data();
+            uvs = uv_data.empty() ? 0 : uv_data.data();
+            indices = index_data.data();
+            num_vertices = static_cast<int>(position_data.size() / 3);
+            num_triangles = static_cast<int>(index_data.size() / 3);
+        }
+
+        const float *positions;     // x, y, z of each vertex
+        const float *normals;       // x, y, z of each vertex, or null for flat shading
+        const float *uvs;           // u, v of each vertex, or null
+        const uint32_t *indices;
+        int num_vertices;
+        int num_triangles;
+
+        // A BVH over the triangles, in flat_bvh's layout, with the triangles stored in the order
+        // its leaves take them; null if each mesh is to build its own.
+        const flat_bvh_node *nodes;
+        int num_nodes;
+
+        std::vector<float> position_data;
+        std::vector<float> normal_data;
+        std::vector<float> uv_data;
+        std::vector<uint32_t> index_data;
+
+    private:
+        mesh_buffers(const mesh_buffers&);
+        mesh_buffers& operator=(const mesh_buffers&);
+};
+
+// The bounding box and centroid of each triangle, which its BVH is built from; spread over the
+// pool if there is one.
+bvh_primitives triangle_primitives(const mesh_buffers& buffers, thread_pool *pool = 0) {
+    bvh_primitives info(buffers.num_triangles);
+    bvh_for_pieces(pool, 0, buffers.num_triangles, [&](int begin, int end, int) {
+        for (int i = begin; i < end; i++) {
+            vec3 v[3];
+            for (int k = 0; k < 3; k++) {
+                const float *p = &buffers.positions[3*buffers.indices[3*i + k]];
+                v[k] = vec3(p[0], p[1], p[2]);
+            }
+            info.boxes[i] = aabb(
+                vec3(ffmin(v[0].x(), ffmin(v[1].x(), v[2].x())),
+                     ffmin(v[0].y(), ffmin(v[1].y(), v[2].y())),
+                     ffmin(v[0].z(), ffmin(v[1].z(), v[2].z()))),
+                vec3(ffmax(v[0].x(), ffmax(v[1].x(), v[2].x())),
+                     ffmax(v[0].y(), ffmax(v[1].y(), v[2].y())),
+                     ffmax(v[0].z(), ffmax(v[1].z(), v[2].z()))));
+            info.centroids[i] = (v[0] + v[1] + v[2]) / 3;
+        }
+    });
+    return info;
+}
+
+// A ray set up for the watertight ray-triangle test (Woop, Benthin and Wald, "Watertight
+// Ray/Triangle Intersection", 2013): the axes are permuted so that z is the direction's largest
+// component, and the shear that maps the direction onto z is kept, so that each triangle is
+// tested in 2D by the signs of three edge functions. Rays through a shared edge or vertex hit at
+// least one of the triangles that meet there.
+struct watertight_ray {
+    explicit watertight_ray(const ray& r) : origin(r.origin()) {
+        vec3 d = r.direction();
+        kz = std::fabs(d.x()) > std::fabs(d.y())
+           ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2)
+           : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        // Keep the winding of the triangles as it was.
+        if (d[kz] < 0) {
+            int k = kx;
+            kx = ky;
+            ky = k;
+        }
+        sz = 1 / d[kz];
+        sx = d[kx] * sz;
+        sy = d[ky] * sz;
+    }
+
+    vec3 origin;
+    int kx, ky, kz;
+    double sx, sy, sz;
+};
+
+// Tests the triangle (a, b, c), setting t and the barycentric weights of its vertices if the
+// ray crosses it between t_min and t_max, from either side.
+inline bool watertight_hit(
+    const watertight_ray& w, const vec3& a, const vec3& b, const vec3& c,
+    double t_min, double t_max, double& t, double& wa, double& wb, double& wc
+) {
+    vec3 A = a - w.origin, B = b - w.origin, C = c - w.origin;
+    double ax = A[w.kx] - w.sx*A[w.kz], ay = A[w.ky] - w.sy*A[w.kz];
+    double bx = B[w.kx] - w.sx*B[w.kz], by = B[w.ky] - w.sy*B[w.kz];
+    double cx = C[w.kx] - w.sx*C[w.kz], cy = C[w.ky] - w.sy*C[w.kz];
+
+    double u = cx*by - cy*bx;
+    double v = ax*cy - ay*cx;
+    double e = bx*ay - by*ax;
+    if ((u < 0 || v < 0 || e < 0) && (u > 0 || v > 0 || e > 0))
+        return false;
+    double det = u + v + e;
+    if (det == 0)
+        return false;
+
+    double dist = (u*A[w.kz] + v*B[w.kz] + e*C[w.kz]) * w.sz / det;
+    if (!(dist > t_min && dist < t_max))
+        return false;
+    t = dist;
+    wa = u / det;
+    wb = v / det;
+    wc = e / det;
+    return true;
+}
+
+
+// A mesh of triangles, read from shared mesh_buffers rather than made one hittable per
+// triangle. It walks a BVH over the triangles as flat_bvh does, whose leaves hold triangle ids:
+// the buffers' own, or else one it builds; an enclosing BVH sees the mesh as one primitive, and
+// transform_instance can place copies of it. Triangles are tested with the watertight
+// algorithm above.
+//
+// Hits get the vertex normals interpolated, or the face normal if the mesh has none, and the
+// vertex texture coordinates interpolated, or the barycentric weights of the second and third
+// vertices if it has none. The build options are for the mesh's own tree, and go unused when the
+// buffers come with one.
+class triangle_mesh : public hittable {
+    public:
+        triangle_mesh(
+            const mesh_buffers *buffers, material *m,
+            const bvh_build_options& options = bvh_build_options()
+        );
+        ~triangle_mesh() { delete tree; }
+
+        virtual bool find_hit(
+            const ray& r, double tmin, double tmax, hit_record& rec, rng& gen
+        ) const;
+        virtual void finish_hit(const ray& r, hit_record& rec) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax, rng& gen) const;
+        virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
+            output_box = box;
+            return true;
+        }
+
+        vec3 vertex(uint32_t i) const {
+            const float *p = &buffers->positions[3*i];
+            return vec3(p[0], p[1], p[2]);
+        }
+
+        // The triangle at a leaf position.
+        int triangle(int i) const { return order ? order[i] : i; }
+
+        const mesh_buffers *buffers;
+        material *mat_ptr;
+        const flat_bvh_node *nodes;
+        int num_nodes;
+        const int *order;   // the triangle at each leaf position, or null if it is the same
+        flat_bvh *tree;     // the tree built for this mesh, if the buffers have none
+        aabb box;
+
+    private:
+        triangle_mesh(const triangle_mesh&);
+        triangle_mesh& operator=(const triangle_mesh&);
+
+        bool hit_triangle(
+            const watertight_ray& w, int id, double t_min, double t_max,
+            double& t, double *weights
+        ) const {
+            const uint32_t *v = &buffers->indices[3*id];
+            return watertight_hit(
+                w, vertex(v[0]), vertex(v[1]), vertex(v[2]), t_min, t_max,
+                t, weights[0], weights[1], weights[2]);
+        }
+};
+
+
+triangle_mesh::triangle_mesh(
+    const mesh_buffers *buffers, material *m, const bvh_build_options& options
+) : buffers(buffers), mat_ptr(m), nodes(buffers->nodes), num_nodes(buffers->num_nodes),
+    order(0), tree(0)
+{
+    if (nodes) {
+        const flat_bvh_node& root = nodes[0];
+        box = aabb(vec3(root.bounds_min[0], root.bounds_min[1], root.bounds_min[2]),
+                   vec3(root.bounds_max[0], root.bounds_max[1], root.bounds_max[2]));
+        return;
+    }
+
+    tree = new flat_bvh(triangle_primitives(*buffers), options);
+    nodes = tree->nodes;
+    num_nodes = tree->num_nodes;
+    order = tree->order.data();
+    box = tree->box;
+}
+
+// Leaves the triangle as the record's primitive, and the barycentric weights of its second and
+// third vertices in u and v.
+bool triangle_mesh::find_hit(
+    const ray& r, double t_min, double t_max, hit_record& rec, rng&
+) const {
+    ray_query q(r);
+    watertight_ray w(r);
+
+    int closest = -1;
+    double closest_so_far = t_max;
+    double weights[3] = {0, 0, 0};
+    int stack[flat_bvh::max_depth];
+    int stack_size = 0;
+    int current = 0;
+
+    for (;;) {
+        count_node_visit();
+        const flat_bvh_node& node = nodes[current];
+        if (flat_bvh_node_hit(node, q, t_min, closest_so_far)) {
+            if (node.is_leaf()) {
+                for (int i = node.offset; i < int(node.offset + node.count); i++) {
+                    count_primitive_test();
+                    double t, b[3];
+                    if (hit_triangle(w, triangle(i), t_min, closest_so_far, t, b)) {
+                        closest = triangle(i);
+                        closest_so_far = t;
+                        weights[0] = b[0];
+                        weights[1] = b[1];
+                        weights[2] = b[2];
+                    }
+                }
+            }
+            else {
+                if (q.sign[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                }
+                else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+    if (closest < 0)
+        return false;
+    rec.t = closest_so_far;
+    rec.u = weights[1];
+    rec.v = weights[2];
+    rec.object = this;
+    rec.primitive = closest;
+    return true;
+}
+
+void triangle_mesh::finish_hit(const ray& r, hit_record& rec) const {
+    const uint32_t *v = &buffers->indices[3*rec.primitive];
+    double weights[3] = { 1 - rec.u - rec.v, rec.u, rec.v };
+    rec.p = r.point_at_parameter(rec.t);
+    if (!buffers->normals) {
+        rec.normal = unit_vector(cross(vertex(v[1]) - vertex(v[0]), vertex(v[2]) - vertex(v[0])));
+    }
+    else {
+        vec3 normal(0,0,0);
+        for (int k = 0; k < 3; k++) {
+            const float *n = &buffers->normals[3*v[k]];
+            normal += weights[k] * vec3(n[0], n[1], n[2]);
+        }
+        rec.normal = unit_vector(normal);
+    }
+    if (buffers->uvs) {
+        rec.u = rec.v = 0;
+        for (int k = 0; k < 3; k++) {
+            rec.u += weights[k] * buffers->uvs[2*v[k]];
+            rec.v += weights[k] * buffers->uvs[2*v[k] + 1];
+        }
+    }
+    rec.mat_ptr = mat_ptr;
+}
+
+bool triangle_mesh::occluded(const ray& r, double t_min, double t_max, rng&) const {
+    ray_query q(r);
+    watertight_ray w(r);
+
+    int stack[flat_bvh::max_depth];
+    int stack_size = 0;
+    int current = 0;
+
+    for (;;) {
+        count_node_visit();
+        const flat_bvh_node& node = nodes[current];
+        if (flat_bvh_node_hit(node, q, t_min, t_max)) {
+            if (node.is_leaf()) {
+                for (int i = node.offset; i < int(node.offset + node.count); i++) {
+                    count_primitive_test();
+                    double t, b[3];
+                    if (hit_triangle(w, triangle(i), t_min, t_max, t, b))
+                        return true;
+                }
+            }
+            else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            return false;
+        current = stack[--stack_size];
+    }
+}
+
+#endif
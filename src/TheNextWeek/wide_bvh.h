@@ -0,0 +1,601 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "common/traversal_stats.h"
+#include "bvh_build.h"
+#include "flat_bvh.h"
+#include "hittable.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define WIDE_BVH_SSE 1
+#endif
+
+
+// A node of a wide_bvh, holding the boxes of up to `width` children side by side, one array per
+// bound, so that all of them are tested at once. A child with a nonzero count is a leaf whose
+// primitives start at `child`; otherwise `child` is the index of another node. Unused slots have
+// inverted bounds, which no ray enters.
+template <int width>
+struct alignas(32) wide_bvh_node {
+    float bounds[6][width];     // min x, y, z, then max x, y, z
+    uint32_t child[width];
+    uint16_t count[width];
+};
+
+// The ray as the box tests want it, in float.
+struct wide_bvh_ray {
+    explicit wide_bvh_ray(const ray_query& q) {
+        for (int a = 0; a < 3; a++) {
+            origin[a] = static_cast<float>(q.origin[a]);
+            inv_dir[a] = static_cast<float>(q.inv_dir[a]);
+            near_plane[a] = q.sign[a] ? 3+a : a;
+            far_plane[a] = q.sign[a] ? a : 3+a;
+        }
+    }
+
+    float origin[3];
+    float inv_dir[3];
+    int near_plane[3];  // per axis, the index into bounds of the plane the ray enters through
+    int far_plane[3];   // and of the one it leaves through
+};
+
+// Tests the ray against every child box of a node, returning a mask of those it enters between
+// t_min and t_max and storing the entry distances in t_near. The float products can round either
+// way, so t_max is widened by a few ulps rather than risk missing a box the ray grazes.
+//
+// The slab tests keep the running t_min and t_max as the second operand of min and max. x86
+// min/max return that operand when the other is NaN, which is what a ray lying in a slab's plane
+// (0 * infinity) should get.
+template <int width>
+inline unsigned wide_bvh_box_hits(
+    const wide_bvh_node<width>& node, const wide_bvh_ray& r, float t_min, float t_max,
+    float *t_near
+) {
+    const float widen = 1 + 4 * 1.1920929e-7f;
+    unsigned mask = 0;
+#if defined(WIDE_BVH_SSE)
+    for (int g = 0; g < width; g += 4) {
+        auto lo = _mm_set1_ps(t_min);
+        auto hi = _mm_set1_ps(t_max);
+        for (int a = 0; a < 3; a++) {
+            auto origin = _mm_set1_ps(r.origin[a]);
+            auto inv_dir = _mm_set1_ps(r.inv_dir[a]);
+            auto enter = _mm_load_ps(&node.bounds[r.near_plane[a]][g]);
+            auto leave = _mm_load_ps(&node.bounds[r.far_plane[a]][g]);
+            lo = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(enter, origin), inv_dir), lo);
+            hi = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(leave, origin), inv_dir), hi);
+        }
+        hi = _mm_mul_ps(hi, _mm_set1_ps(widen));
+        _mm_storeu_ps(t_near + g, lo);
+        mask |= static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(lo, hi))) << g;
+    }
+#else
+    for (int i = 0; i < width; i++) {
+        auto lo = t_min, hi = t_max;
+        for (int a = 0; a < 3; a++) {
+            auto enter = (node.bounds[r.near_plane[a]][i] - r.origin[a]) * r.inv_dir[a];
+            auto leave = (node.bounds[r.far_plane[a]][i] - r.origin[a]) * r.inv_dir[a];
+            lo = enter > lo ? enter : lo;
+            hi = leave < hi ? leave : hi;
+        }
+        t_near[i] = lo;
+        if (lo <= hi * widen)
+            mask |= 1u << i;
+    }
+#endif
+    return mask;
+}
+
+#if defined(__AVX2__)
+template <>
+inline unsigned wide_bvh_box_hits<8>(
+    const wide_bvh_node<8>& node, const wide_bvh_ray& r, float t_min, float t_max, float *t_near
+) {
+    auto lo = _mm256_set1_ps(t_min);
+    auto hi = _mm256_set1_ps(t_max);
+    for (int a = 0; a < 3; a++) {
+        auto origin = _mm256_set1_ps(r.origin[a]);
+        auto inv_dir = _mm256_set1_ps(r.inv_dir[a]);
+        auto enter = _mm256_load_ps(node.bounds[r.near_plane[a]]);
+        auto leave = _mm256_load_ps(node.bounds[r.far_plane[a]]);
+        lo = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(enter, origin), inv_dir), lo);
+        hi = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(leave, origin), inv_dir), hi);
+    }
+    hi = _mm256_mul_ps(hi, _mm256_set1_ps(1 + 4 * 1.1920929e-7f));
+    _mm256_storeu_ps(t_near, lo);
+    return static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(lo, hi, _CMP_LE_OQ)));
+}
+#endif
+
+inline int lowest_bit(unsigned mask) {
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int k = 0;
+    while (!(mask & (1u << k)))
+        k++;
+    return k;
+#endif
+}
+
+
+// A BVH with `width` children per node (4 or 8), made by collapsing the binary tree that
+// flat_bvh builds with the same options: each node takes the children of a binary node and keeps
+// opening the largest of them until it has `width`. Traversal tests all of a node's children at
+// once and visits the ones it hits nearest first. Can stand in for bvh_node or flat_bvh anywhere.
+// It refits and updates as flat_bvh does, except that update() only ever rebuilds the whole tree.
+template <int width>
+class wide_bvh : public hittable {
+    public:
+        wide_bvh(
+            hittable **l, int n, double time0, double time1,
+            const bvh_build_options& options = bvh_build_options()
+        );
+
+        // A tree over primitives known only by their boxes, as flat_bvh builds one: no prims,
+        // an `order` saying which primitive each leaf entry is, and an owner that walks the
+        // nodes itself.
+        explicit wide_bvh(
+            const bvh_primitives& info, const bvh_build_options& options = bvh_build_options()
+        );
+        ~wide_bvh() {
+            std::free(node_storage);
+            delete cache_file;
+            delete[] prims;
+        }
+
+        virtual bool find_hit(
+            const ray& r, double tmin, double tmax, hit_record& rec, rng& gen
+        ) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax, rng& gen) const;
+        virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+
+        typedef flat_bvh::update_result update_result;
+
+        void refit(double time0, double time1, thread_pool *pool = 0);
+        update_result update(double time0, double time1, thread_pool *pool = 0);
+        double sah_cost() const;
+
+        // Every level of the binary tree adds at most width-1 entries to the stack, and no node
+        // lies max_depth deep (wide_bvh_nodes_valid() holds cached trees to that too).
+        static const int stack_size = flat_bvh::max_depth * (width - 1) + 1;
+
+        wide_bvh_node<width> *nodes;
+        int num_nodes;
+        hittable **prims;
+        int num_prims;
+        aabb box;
+        std::vector<int> order;     // only for a tree over boxes
+
+    private:
+        wide_bvh(const wide_bvh&);
+        wide_bvh& operator=(const wide_bvh&);
+
+        static wide_bvh_node<width> *allocate_nodes(int count, void *&storage);
+        void collapse_tree(const flat_bvh& binary);
+        int collapse(const flat_bvh& binary, int node);
+        void own_nodes();
+
+        void *node_storage;
+        bvh_cache_file *cache_file;     // holding the nodes, if they came from the cache
+        bvh_build_options build_options;    // for the binary tree, without the cache
+        double built_cost;  // sah_cost() when built, or -1 before the first refit
+};
+
+typedef wide_bvh<4> bvh4;
+typedef wide_bvh<8> bvh8;
+
+
+// Whether nodes read from a cache file can be traversed, as flat_bvh_nodes_valid() checks: every
+// interior slot a node in the array, every leaf slot's primitives in range, and no node as deep
+// as max_depth, where its slots would overrun the traversal stack, visiting no more nodes than
+// there are.
+template <int width>
+bool wide_bvh_nodes_valid(const wide_bvh_node<width> *nodes, int num_nodes, int num_prims) {
+    std::vector<std::pair<int, int>> pending(1, std::make_pair(0, 0));  // node, depth
+    int visits = 0;
+    while (!pending.empty()) {
+        int i = pending.back().first;
+        int depth = pending.back().second;
+        pending.pop_back();
+        if (++visits > num_nodes || depth >= flat_bvh::max_depth)
+            return false;
+        const wide_bvh_node<width>& node = nodes[i];
+        for (int k = 0; k < width; k++) {
+            if (node.count[k] > 0) {
+                if (uint64_t(node.child[k]) + node.count[k] > uint64_t(num_prims))
+                    return false;
+            }
+            else if (node.child[k] != 0) {
+                if (node.child[k] >= uint32_t(num_nodes))
+                    return false;
+                pending.push_back(std::make_pair(int(node.child[k]), depth + 1));
+            }
+        }
+    }
+    return true;
+}
+
+template <int width>
+wide_bvh<width>::wide_bvh(
+    hittable **l, int n, double time0, double time1, const bvh_build_options& options
+) : nodes(0), num_nodes(0), prims(0), num_prims(n), node_storage(0), cache_file(0),
+    build_options(options), built_cost(-1)
+{
+    build_options.cache_directory = 0;
+    bool cached = options.cache_directory && n > 0
+                  && options.split != bvh_build_options::split_sbvh;
+    uint64_t cache_key = 0;
+    if (cached) {
+        bvh_primitives info(l, n, time0, time1);
+        cache_key = bvh_cache_key(info, time0, time1, options, width);
+        cache_file = bvh_cache_open(
+            bvh_cache_path(options.cache_directory, width, cache_key), cache_key, width, n,
+            wide_bvh_nodes_valid<width>);
+    }
+    if (cache_file) {
+        nodes = const_cast<wide_bvh_node<width>*>(
+            static_cast<const wide_bvh_node<width>*>(cache_file->nodes()));
+        num_nodes = cache_file->header().num_nodes;
+        box = bvh_cache_bounds(cache_file->header());
+        prims = new hittable*[n];
+        for (int i = 0; i < n; i++)
+            prims[i] = fold_transforms(l[cache_file->order()[i]]);
+        return;
+    }
+
+    // Only the collapsed tree is worth keeping.
+    flat_bvh binary(l, n, time0, time1, build_options);
+    collapse_tree(binary);
+
+    if (cached) {
+        bvh_cache_write(
+            bvh_cache_path(options.cache_directory, width, cache_key), cache_key, width,
+            sizeof(wide_bvh_node<width>), nodes, num_nodes, binary.order.data(), n, box);
+    }
+}
+
+template <int width>
+wide_bvh<width>::wide_bvh(const bvh_primitives& info, const bvh_build_options& options)
+  : nodes(0), num_nodes(0), prims(0), num_prims(0), node_storage(0), cache_file(0),
+    build_options(options), built_cost(-1)
+{
+    build_options.cache_directory = 0;
+    flat_bvh binary(info, build_options);
+    collapse_tree(binary);
+    order = binary.order;
+}
+
+template <int width>
+wide_bvh_node<width> *wide_bvh<width>::allocate_nodes(int count, void *&storage) {
+    const uintptr_t alignment = alignof(wide_bvh_node<width>);
+    storage = std::malloc(count * sizeof(wide_bvh_node<width>) + alignment - 1);
+    auto address = (reinterpret_cast<uintptr_t>(storage) + alignment - 1) & ~(alignment - 1);
+    return reinterpret_cast<wide_bvh_node<width>*>(address);
+}
+
+// Takes the primitives and the bounds of a binary tree, and collapses its nodes in place of any
+// there were.
+template <int width>
+void wide_bvh<width>::collapse_tree(const flat_bvh& binary) {
+    box = binary.box;
+    delete[] prims;
+    prims = 0;
+    num_prims = binary.num_prims;
+    if (binary.prims) {
+        prims = new hittable*[num_prims > 0 ? num_prims : 1];
+        std::copy(binary.prims, binary.prims + num_prims, prims);
+    }
+    std::free(node_storage);
+    num_nodes = 0;
+
+    // Every wide node takes up at least one binary interior node, except a root over a single
+    // leaf.
+    void *built_storage;
+    nodes = allocate_nodes(binary.num_nodes, built_storage);
+    collapse(binary, 0);
+
+    auto built = nodes;
+    nodes = allocate_nodes(num_nodes, node_storage);
+    std::copy(built, built + num_nodes, nodes);
+    std::free(built_storage);
+}
+
+// Appends the wide node for the binary subtree at `node`, and those below it, in depth-first
+// order. Returns its index.
+template <int width>
+int wide_bvh<width>::collapse(const flat_bvh& binary, int node) {
+    int this_node = num_nodes++;
+
+    int children[width];
+    int num_children = 0;
+    const flat_bvh_node& root = binary.nodes[node];
+    if (root.is_leaf() || binary.num_prims == 0) {
+        if (binary.num_prims > 0)
+            children[num_children++] = node;
+    }
+    else {
+        children[num_children++] = node + 1;
+        children[num_children++] = root.offset;
+        while (num_children < width) {
+            int best = -1;
+            double best_area = -1;
+            for (int k = 0; k < num_children; k++) {
+                const flat_bvh_node& c = binary.nodes[children[k]];
+                if (!c.is_leaf() && flat_bvh_node_area(c) > best_area) {
+                    best = k;
+                    best_area = flat_bvh_node_area(c);
+                }
+            }
+            if (best < 0)
+                break;
+            int opened = children[best];
+            children[best] = opened + 1;
+            children[num_children++] = binary.nodes[opened].offset;
+        }
+    }
+
+    // The children below this node are appended first, so nodes[this_node] is filled in last.
+    wide_bvh_node<width> wide;
+    for (int k = 0; k < width; k++) {
+        if (k >= num_children) {
+            for (int a = 0; a < 3; a++) {
+                wide.bounds[a][k] = INFINITY;
+                wide.bounds[3+a][k] = -INFINITY;
+            }
+            wide.child[k] = 0;
+            wide.count[k] = 0;
+            continue;
+        }
+        const flat_bvh_node& c = binary.nodes[children[k]];
+        for (int a = 0; a < 3; a++) {
+            wide.bounds[a][k] = c.bounds_min[a];
+            wide.bounds[3+a][k] = c.bounds_max[a];
+        }
+        wide.count[k] = c.count;
+        wide.child[k] = c.is_leaf() ? c.offset : collapse(binary, children[k]);
+    }
+    nodes[this_node] = wide;
+    return this_node;
+}
+
+template <int width>
+bool wide_bvh<width>::bounding_box(double t0, double t1, aabb& output_box) const {
+    output_box = box;
+    return true;
+}
+
+template <int width>
+bool wide_bvh<width>::find_hit(
+    const ray& r, double t_min, double t_max, hit_record& rec, rng& gen
+) const {
+    ray_query q(r);
+    wide_bvh_ray wr(q);
+    float float_t_min = float_down(t_min);
+
+    // A stack entry is a node (count 0) or a leaf, with the distance at which the ray enters it.
+    struct entry {
+        uint32_t child;
+        uint32_t count;
+        float t;
+    };
+    entry stack[stack_size];
+    int num_entries = 0;
+
+    bool hit_anything = false;
+    double closest_so_far = t_max;
+    float float_closest = float_up(t_max);
+    entry current = { 0, 0, float_t_min };
+
+    for (;;) {
+        if (current.count > 0) {
+            hit_record temp_rec;
+            for (uint32_t i = current.child; i < current.child + current.count; i++) {
+                count_primitive_test();
+                if (prims[i]->find_hit(r, t_min, closest_so_far, temp_rec, gen)) {
+                    hit_anything = true;
+                    closest_so_far = temp_rec.t;
+                    float_closest = float_up(closest_so_far);
+                    rec = temp_rec;
+                }
+            }
+        }
+        else {
+            count_node_visit();
+            const wide_bvh_node<width>& node = nodes[current.child];
+            float t_near[width];
+            unsigned mask = wide_bvh_box_hits<width>(node, wr, float_t_min, float_closest, t_near);
+
+            // Push the children hit farthest first, sorting them into place on the stack, and
+            // go straight on to the nearest.
+            int base = num_entries;
+            for (; mask; mask &= mask - 1) {
+                int k = lowest_bit(mask);
+                entry e = { node.child[k], node.count[k], t_near[k] };
+                int j = num_entries++;
+                for (; j > base && stack[j-1].t < e.t; j--)
+                    stack[j] = stack[j-1];
+                stack[j] = e;
+            }
+            if (num_entries > base) {
+                current = stack[--num_entries];
+                continue;
+            }
+        }
+
+        // Skip anything the ray now enters only beyond the closest hit.
+        do {
+            if (num_entries == 0)
+                return hit_anything;
+            current = stack[--num_entries];
+        } while (current.t > float_closest);
+    }
+}
+
+// Like hit(), but returns at the first primitive hit, so the children need no sorting.
+template <int width>
+bool wide_bvh<width>::occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+    ray_query q(r);
+    wide_bvh_ray wr(q);
+    float float_t_min = float_down(t_min);
+    float float_t_max = float_up(t_max);
+
+    uint32_t stack[stack_size];
+    uint32_t counts[stack_size];
+    int num_entries = 0;
+    uint32_t child = 0, count = 0;
+
+    for (;;) {
+        if (count > 0) {
+            for (uint32_t i = child; i < child + count; i++) {
+                count_primitive_test();
+                if (prims[i]->occluded(r, t_min, t_max, gen))
+                    return true;
+            }
+        }
+        else {
+            count_node_visit();
+            const wide_bvh_node<width>& node = nodes[child];
+            float t_near[width];
+            unsigned mask = wide_bvh_box_hits<width>(node, wr, float_t_min, float_t_max, t_near);
+            for (; mask; mask &= mask - 1) {
+                int k = lowest_bit(mask);
+                stack[num_entries] = node.child[k];
+                counts[num_entries++] = node.count[k];
+            }
+        }
+
+        if (num_entries == 0)
+            return false;
+        num_entries--;
+        child = stack[num_entries];
+        count = counts[num_entries];
+    }
+}
+
+template <int width>
+void wide_bvh<width>::own_nodes() {
+    if (!cache_file)
+        return;
+    auto mapped = nodes;
+    nodes = allocate_nodes(num_nodes, node_storage);
+    std::copy(mapped, mapped + num_nodes, nodes);
+    delete cache_file;
+    cache_file = 0;
+}
+
+// Refits each child box from the primitives, or from the boxes of the child node's own children.
+// Unused slots keep their inverted bounds, which take no part in the minimums and maximums.
+template <int width>
+void wide_bvh<width>::refit(double time0, double time1, thread_pool *pool) {
+    if (num_prims == 0)
+        return;
+    own_nodes();
+    if (built_cost < 0)
+        built_cost = sah_cost();
+    bvh_primitives info(prims, num_prims, time0, time1, pool);
+
+    auto children = [&](int i, int *out) {
+        int count = 0;
+        for (int k = 0; k < width; k++)
+            if (nodes[i].count[k] == 0 && nodes[i].child[k] != 0)
+                out[count++] = nodes[i].child[k];
+        return count;
+    };
+    bvh_refit_depth_first(num_nodes, pool, children, [&](int i) {
+        wide_bvh_node<width>& node = nodes[i];
+        for (int k = 0; k < width; k++) {
+            if (node.count[k] > 0) {
+                aabb bounds = info.boxes[node.child[k]];
+                for (uint32_t p = node.child[k] + 1; p < node.child[k] + node.count[k]; p++)
+                    bounds = surrounding_box(bounds, info.boxes[p]);
+                for (int a = 0; a < 3; a++) {
+                    node.bounds[a][k] = float_down(bounds.min()[a]);
+                    node.bounds[3+a][k] = float_up(bounds.max()[a]);
+                }
+            }
+            else if (node.child[k] != 0) {
+                const wide_bvh_node<width>& c = nodes[node.child[k]];
+                for (int a = 0; a < 6; a++) {
+                    float bound = c.bounds[a][0];
+                    for (int j = 1; j < width; j++)
+                        bound = a < 3 ? std::min(bound, c.bounds[a][j])
+                                      : std::max(bound, c.bounds[a][j]);
+                    node.bounds[a][k] = bound;
+                }
+            }
+        }
+    });
+
+    box = info.boxes[0];
+    for (int i = 1; i < num_prims; i++)
+        box = surrounding_box(box, info.boxes[i]);
+}
+
+template <int width>
+typename wide_bvh<width>::update_result wide_bvh<width>::update(
+    double time0, double time1, thread_pool *pool
+) {
+    refit(time0, time1, pool);
+    if (num_prims == 0 || sah_cost() <= build_options.rebuild_growth * built_cost)
+        return flat_bvh::refitted;
+
+    // Spatial splits leave some primitives in several leaves; the rebuild takes one of each, in
+    // the order they come, and splits them afresh.
+    std::vector<hittable*> current;
+    if (build_options.split == bvh_build_options::split_sbvh) {
+        std::unordered_set<hittable*> seen;
+        for (int i = 0; i < num_prims; i++)
+            if (seen.insert(prims[i]).second)
+                current.push_back(prims[i]);
+    }
+    else
+        current.assign(prims, prims + num_prims);
+    flat_bvh binary(current.data(), static_cast<int>(current.size()), time0, time1,
+                    build_options);
+    collapse_tree(binary);
+    built_cost = sah_cost();
+    return flat_bvh::rebuilt;
+}
+
+// Every node costs a traversal step weighted by its box's area, every leaf its primitives' tests.
+template <int width>
+double wide_bvh<width>::sah_cost() const {
+    auto root_area = box.area();
+    if (num_prims == 0 || root_area <= 0)
+        return 0;
+    auto total = build_options.traversal_cost * root_area;
+    for (int i = 0; i < num_nodes; i++) {
+        const wide_bvh_node<width>& node = nodes[i];
+        for (int k = 0; k < width; k++) {
+            if (node.count[k] == 0 && node.child[k] == 0)
+                continue;
+            double x = node.bounds[3][k] - node.bounds[0][k];
+            double y = node.bounds[4][k] - node.bounds[1][k];
+            double z = node.bounds[5][k] - node.bounds[2][k];
+            auto area = 2*(x*y + y*z + z*x);
+            total += area * (node.count[k] > 0 ? build_options.intersection_cost * node.count[k]
+                                               : build_options.traversal_cost);
+        }
+    }
+    return total / root_area;
+}
+
+#endif
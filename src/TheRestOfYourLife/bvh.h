@@ -12,20 +12,61 @@
 //==============================================================================================
 
 #include "common/rtweekend.h"
+#include "common/traversal_stats.h"
+#include "bvh_build.h"
 #include "hittable.h"
+#include "instance.h"
 
+#include <algorithm>
+#include <vector>
 
+
+// Splits are chosen by bvh_split() (binned SAH unless the options say otherwise), from bounds
+// queried once per primitive. Every leaf holds one or two primitives, as left and right.
 class bvh_node : public hittable  {
     public:
-        bvh_node() {}
-        bvh_node(hittable **l, int n, double time0, double time1);
-
-        virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+        bvh_node() : left_is_node(false), right_is_node(false) {}
+        bvh_node(
+            hittable **l, int n, double time0, double time1,
+            const bvh_build_options& options = bvh_build_options()
+        );
+
+        virtual bool find_hit(
+            const ray& r, double tmin, double tmax, hit_record& rec, rng& gen
+        ) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax, rng& gen) const;
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
 
         hittable *left;
         hittable *right;
         aabb box;
+        int axis;   // left lies below right along this axis
+        bool left_is_node, right_is_node;   // whether the children are bvh_nodes
+
+    private:
+        bool hit_node(
+            const ray& r, const ray_query& q, double t_min, double t_max, hit_record& rec,
+            rng& gen
+        ) const;
+        bool occluded_node(
+            const ray& r, const ray_query& q, double t_min, double t_max, rng& gen
+        ) const;
+        static bool hit_child(
+            const hittable *child, bool is_node, const ray& r, const ray_query& q,
+            double t_min, double t_max, hit_record& rec, rng& gen
+        );
+        static bool occluded_child(
+            const hittable *child, bool is_node, const ray& r, const ray_query& q,
+            double t_min, double t_max, rng& gen
+        );
+        void build(
+            hittable **l, const bvh_primitives& info, const bvh_build_options& options,
+            int *index, int begin, int end
+        );
+        static hittable *subtree(
+            hittable **l, const bvh_primitives& info, const bvh_build_options& options,
+            int *index, int begin, int end
+        );
 };
 
 bool bvh_node::bounding_box(double t0, double t1, aabb& output_box) const {
@@ -33,143 +74,125 @@ bool bvh_node::bounding_box(double t0, double t1, aabb& output_box) const {
     return true;
 }
 
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    if (box.hit(r, t_min, t_max)) {
-        hit_record left_rec, right_rec;
-        bool hit_left = left->hit(r, t_min, t_max, left_rec);
-        bool hit_right = right->hit(r, t_min, t_max, right_rec);
-
-        if (hit_left && hit_right) {
-            if (left_rec.t < right_rec.t)
-                rec = left_rec;
-            else
-                rec = right_rec;
-            return true;
-        }
-        else if (hit_left) {
-            rec = left_rec;
-            return true;
-        }
-        else if (hit_right) {
-            rec = right_rec;
-            return true;
-        }
-        else
-            return false;
-    }
-    else return false;
+bool bvh_node::find_hit(
+    const ray& r, double t_min, double t_max, hit_record& rec, rng& gen
+) const {
+    return hit_node(r, ray_query(r), t_min, t_max, rec, gen);
 }
 
-int box_x_compare (const void * a, const void * b) {
-    aabb box_left, box_right;
-    hittable *ah = *(hittable**)a;
-    hittable *bh = *(hittable**)b;
-
-    if (!ah->bounding_box(0,0, box_left) || !bh->bounding_box(0,0, box_right))
-        std::cerr << "no bounding box in bvh_node constructor\n";
-
-    if (box_left.min().x() - box_right.min().x() < 0.0)
-        return -1;
-    else
-        return 1;
+bool bvh_node::occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+    return occluded_node(r, ray_query(r), t_min, t_max, gen);
 }
 
-int box_y_compare (const void * a, const void * b)
-{
-    aabb box_left, box_right;
-    hittable *ah = *(hittable**)a;
-    hittable *bh = *(hittable**)b;
-
-    if (!ah->bounding_box(0,0, box_left) || !bh->bounding_box(0,0, box_right))
-        std::cerr << "no bounding box in bvh_node constructor\n";
+// Below the root, child nodes are entered directly with the root's ray_query; only primitives
+// go through the virtual calls.
+bool bvh_node::hit_child(
+    const hittable *child, bool is_node, const ray& r, const ray_query& q,
+    double t_min, double t_max, hit_record& rec, rng& gen
+) {
+    if (is_node)
+        return static_cast<const bvh_node*>(child)->hit_node(r, q, t_min, t_max, rec, gen);
+    count_primitive_test();
+    return child->find_hit(r, t_min, t_max, rec, gen);
+}
 
-    if (box_left.min().y() - box_right.min().y() < 0.0)
-        return -1;
-    else
-        return 1;
+bool bvh_node::occluded_child(
+    const hittable *child, bool is_node, const ray& r, const ray_query& q,
+    double t_min, double t_max, rng& gen
+) {
+    if (is_node)
+        return static_cast<const bvh_node*>(child)->occluded_node(r, q, t_min, t_max, gen);
+    count_primitive_test();
+    return child->occluded(r, t_min, t_max, gen);
 }
 
-int box_z_compare (const void * a, const void * b)
-{
-    aabb box_left, box_right;
-    hittable *ah = *(hittable**)a;
-    hittable *bh = *(hittable**)b;
+bool bvh_node::hit_node(
+    const ray& r, const ray_query& q, double t_min, double t_max, hit_record& rec, rng& gen
+) const {
+    count_node_visit();
+    if (!box.hit(q, t_min, t_max))
+        return false;
+
+    // Visit the child on the near side of the split first. Once it has hit something, the far
+    // child only has to find a closer hit, and overwrites rec only if it does.
+    const hittable *first = left, *second = right;
+    bool first_node = left_is_node, second_node = right_is_node;
+    if (q.sign[axis]) {
+        std::swap(first, second);
+        std::swap(first_node, second_node);
+    }
 
-    if (!ah->bounding_box(0,0, box_left) || !bh->bounding_box(0,0, box_right))
-        std::cerr << "no bounding box in bvh_node constructor\n";
+    bool hit_first = hit_child(first, first_node, r, q, t_min, t_max, rec, gen);
+    if (second == first)
+        return hit_first;
+    bool hit_second = hit_child(
+        second, second_node, r, q, t_min, hit_first ? rec.t : t_max, rec, gen);
+    return hit_first || hit_second;
+}
 
-    if (box_left.min().z() - box_right.min().z() < 0.0)
-        return -1;
-    else
-        return 1;
+bool bvh_node::occluded_node(
+    const ray& r, const ray_query& q, double t_min, double t_max, rng& gen
+) const {
+    count_node_visit();
+    if (!box.hit(q, t_min, t_max))
+        return false;
+    if (occluded_child(left, left_is_node, r, q, t_min, t_max, gen))
+        return true;
+    if (right == left)
+        return false;
+    return occluded_child(right, right_is_node, r, q, t_min, t_max, gen);
 }
 
-bvh_node::bvh_node(hittable **l, int n, double time0, double time1) {
-    aabb *boxes = new aabb[n];
-    auto *left_area = new double[n];
-    auto *right_area = new double[n];
-    aabb main_box;
-    bool dummy = l[0]->bounding_box(time0, time1, main_box);
-    for (int i = 1; i < n; i++) {
-        aabb new_box;
-        bool dummy = l[i]->bounding_box(time0, time1, new_box);
-        main_box = surrounding_box(new_box, main_box);
-    }
-    int axis = main_box.longest_axis();
-    if (axis == 0)
-        qsort(l, n, sizeof(hittable *), box_x_compare);
-    else if (axis == 1)
-        qsort(l, n, sizeof(hittable *), box_y_compare);
-    else
-        qsort(l, n, sizeof(hittable *), box_z_compare);
+bvh_node::bvh_node(
+    hittable **l, int n, double time0, double time1, const bvh_build_options& options
+) {
+    bvh_primitives info(l, n, time0, time1);
+    std::vector<int> index(n);
     for (int i = 0; i < n; i++)
-        bool dummy = l[i]->bounding_box(time0, time1, boxes[i]);
-    left_area[0] = boxes[0].area();
-    aabb left_box = boxes[0];
-    for (int i = 1; i < n-1; i++) {
-        left_box = surrounding_box(left_box, boxes[i]);
-        left_area[i] = left_box.area();
-    }
-    right_area[n-1] = boxes[n-1].area();
-    aabb right_box = boxes[n-1];
-    for (int i = n-2; i > 0; i--) {
-        right_box = surrounding_box(right_box, boxes[i]);
-        right_area[i] = right_box.area();
-    }
-    auto min_SAH = infinity;
-    int min_SAH_idx;
-    for (int i = 0; i < n-1; i++) {
-        auto SAH = i*left_area[i] + (n-i-1)*right_area[i+1];
-        if (SAH < min_SAH) {
-            min_SAH_idx = i;
-            min_SAH = SAH;
-        }
-    }
+        index[i] = i;
+    build(l, info, options, index.data(), 0, n);
+}
 
-    /*
-    if (min_SAH_idx == 0)
-        left = l[0];
-    else
-        left = new bvh_node(l, min_SAH_idx+1, time0, time1);
-    if (min_SAH_idx == n-2)
-        right = l[min_SAH_idx+1];
-    else
-        right = new bvh_node(l + min_SAH_idx+1, n - min_SAH_idx -1, time0, time1);
-    */
+void bvh_node::build(
+    hittable **l, const bvh_primitives& info, const bvh_build_options& options,
+    int *index, int begin, int end
+) {
+    aabb centroid_bounds;
+    bvh_range_bounds(info, index, begin, end, box, centroid_bounds);
 
+    int n = end - begin;
+    left_is_node = right_is_node = false;
     if (n == 1) {
-        left = right = l[0];
+        axis = 0;
+        left = right = fold_transforms(l[index[begin]]);
     }
     else if (n == 2) {
-        left = l[0];
-        right = l[1];
+        axis = centroid_bounds.longest_axis();
+        int a = index[begin], b = index[begin+1];
+        if (info.centroids[b][axis] < info.centroids[a][axis])
+            std::swap(a, b);
+        left = fold_transforms(l[a]);
+        right = fold_transforms(l[b]);
     }
     else {
-        left = new bvh_node(l, n/2, time0, time1);
-        right = new bvh_node(l + n/2, n - n/2, time0, time1);
+        int mid = bvh_split(info, index, begin, end, box, centroid_bounds, options, false, axis);
+        left = subtree(l, info, options, index, begin, mid);
+        right = subtree(l, info, options, index, mid, end);
+        left_is_node = mid - begin > 1;
+        right_is_node = end - mid > 1;
     }
+}
 
-    box = main_box;
+// A single primitive stands on its own instead of getting a node of its own.
+hittable *bvh_node::subtree(
+    hittable **l, const bvh_primitives& info, const bvh_build_options& options,
+    int *index, int begin, int end
+) {
+    if (end - begin == 1)
+        return fold_transforms(l[index[begin]]);
+    auto node = new bvh_node();
+    node->build(l, info, options, index, begin, end);
+    return node;
 }
 
 #endif
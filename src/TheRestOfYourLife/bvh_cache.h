@@ -0,0 +1,245 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "bvh_build.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RTW_BVH_CACHE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// Built BVHs saved to disk, so that rendering a scene again skips the build. A file holds one
+// tree's nodes exactly as they lie in memory, then the position in the caller's array of each
+// primitive the leaves refer to. Its name and header carry a key hashed from everything the
+// builder looks at: the primitives' bounding boxes, the time interval, the build options and the
+// node width. The primitives themselves are not saved; the scene makes them again, and the key
+// finds the tree built for them.
+//
+// Files are mapped read-only and traversed where they lie, so loading copies nothing and every
+// process rendering the same scene shares the pages. They are written under a temporary name and
+// renamed into place, so a concurrent render never maps half a file. The layout is the writing
+// machine's own; a file whose version, node size or key doesn't match, or whose nodes refer
+// outside the tree, is ignored, and replaced once the tree has been built. Without mmap (on
+// Windows) nothing is cached.
+
+struct bvh_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;         // children per node
+    uint32_t node_size;
+    uint32_t num_nodes;
+    uint32_t num_prims;
+    uint32_t pad;
+    uint64_t key;
+    uint64_t nodes_offset;
+    uint64_t order_offset;
+    double bounds[6];       // of the whole tree, min then max
+};
+
+const char bvh_cache_magic[8] = {'r', 't', 'w', 'b', 'v', 'h', 0, 0};
+const uint32_t bvh_cache_version = 1;
+const uint64_t bvh_cache_alignment = 64;
+
+// Mixes in 64-bit words: an FNV-style multiply and xor per word, and a final avalanche.
+class bvh_cache_hasher {
+    public:
+        bvh_cache_hasher() : h(14695981039346656037ULL) {}
+
+        void add(uint64_t word) {
+            h = (h ^ word) * 1099511628211ULL;
+            h ^= h >> 29;
+        }
+
+        void add(double x) {
+            uint64_t word;
+            std::memcpy(&word, &x, sizeof word);
+            add(word);
+        }
+
+        uint64_t value() const {
+            auto x = h;
+            x = (x ^ (x >> 33)) * 0xff51afd7ed558ccdULL;
+            x = (x ^ (x >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+            return x ^ (x >> 33);
+        }
+
+    private:
+        uint64_t h;
+};
+
+inline uint64_t bvh_cache_key(
+    const bvh_primitives& info, double time0, double time1, const bvh_build_options& options,
+    int width
+) {
+    bvh_cache_hasher hash;
+    hash.add(uint64_t(bvh_cache_version));
+    hash.add(uint64_t(width));
+    hash.add(uint64_t(info.boxes.size()));
+    hash.add(time0);
+    hash.add(time1);
+    hash.add(uint64_t(options.split));
+    hash.add(uint64_t(options.bins));
+    hash.add(uint64_t(options.max_leaf_size));
+    hash.add(options.traversal_cost);
+    hash.add(options.intersection_cost);
+    hash.add(uint64_t(options.treelet_passes));
+    for (const auto& box : info.boxes) {
+        for (int a = 0; a < 3; a++) {
+            hash.add(box.min()[a]);
+            hash.add(box.max()[a]);
+        }
+    }
+    return hash.value();
+}
+
+inline std::string bvh_cache_path(const std::string& directory, int width, uint64_t key) {
+    char name[64];
+    std::snprintf(name, sizeof name, "/bvh%d-%016llx.bin", width, (unsigned long long)key);
+    return directory + name;
+}
+
+// A cache file mapped into memory, unmapped when deleted.
+class bvh_cache_file {
+    public:
+        bvh_cache_file(void *address, size_t length) : address(address), length(length) {}
+        ~bvh_cache_file() {
+#if defined(RTW_BVH_CACHE_MMAP)
+            munmap(address, length);
+#endif
+        }
+
+        const bvh_cache_header& header() const {
+            return *static_cast<const bvh_cache_header*>(address);
+        }
+        const void *nodes() const {
+            return static_cast<const char*>(address) + header().nodes_offset;
+        }
+        const uint32_t *order() const {
+            return reinterpret_cast<const uint32_t*>(
+                static_cast<const char*>(address) + header().order_offset);
+        }
+
+    private:
+        bvh_cache_file(const bvh_cache_file&);
+        bvh_cache_file& operator=(const bvh_cache_file&);
+
+        void *address;
+        size_t length;
+};
+
+// Maps the file at path if it holds the tree with this key and width over num_prims primitives,
+// and nodes_valid passes its nodes. Returns null otherwise.
+template <typename node_type>
+bvh_cache_file *bvh_cache_open(
+    const std::string& path, uint64_t key, int width, int num_prims,
+    bool (*nodes_valid)(const node_type *nodes, int num_nodes, int num_prims)
+) {
+    const size_t node_size = sizeof(node_type);
+#if defined(RTW_BVH_CACHE_MMAP)
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat status;
+    void *address = MAP_FAILED;
+    size_t length = 0;
+    if (fstat(fd, &status) == 0 && status.st_size >= off_t(sizeof(bvh_cache_header))) {
+        length = size_t(status.st_size);
+        address = mmap(0, length, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (address == MAP_FAILED)
+        return 0;
+
+    auto file = new bvh_cache_file(address, length);
+    const bvh_cache_header& h = file->header();
+    bool valid =
+        std::memcmp(h.magic, bvh_cache_magic, sizeof h.magic) == 0
+        && h.version == bvh_cache_version && h.key == key && h.width == uint32_t(width)
+        && h.node_size == node_size && h.num_prims == uint32_t(num_prims) && h.num_nodes > 0
+        && h.nodes_offset % bvh_cache_alignment == 0
+        && h.nodes_offset >= sizeof h && h.nodes_offset <= length
+        && uint64_t(h.num_nodes) * node_size <= length - h.nodes_offset
+        && h.nodes_offset + uint64_t(h.num_nodes) * node_size <= h.order_offset
+        && h.order_offset <= length
+        && h.order_offset % sizeof(uint32_t) == 0
+        && h.order_offset + uint64_t(num_prims) * sizeof(uint32_t) <= length;
+    for (int i = 0; valid && i < num_prims; i++)
+        valid = file->order()[i] < uint32_t(num_prims);
+    valid = valid && nodes_valid(static_cast<const node_type*>(file->nodes()),
+                                 static_cast<int>(h.num_nodes), num_prims);
+    if (valid)
+        return file;
+    delete file;
+#endif
+    return 0;
+}
+
+// Saves a tree for bvh_cache_open to find. Failing to is not an error: the next run builds the
+// tree again.
+void bvh_cache_write(
+    const std::string& path, uint64_t key, int width, size_t node_size, const void *nodes,
+    int num_nodes, const int *order, int num_prims, const aabb& bounds
+) {
+#if defined(RTW_BVH_CACHE_MMAP)
+    bvh_cache_header h;
+    std::memset(&h, 0, sizeof h);
+    std::memcpy(h.magic, bvh_cache_magic, sizeof h.magic);
+    h.version = bvh_cache_version;
+    h.width = width;
+    h.node_size = static_cast<uint32_t>(node_size);
+    h.num_nodes = num_nodes;
+    h.num_prims = num_prims;
+    h.key = key;
+    h.nodes_offset = (sizeof h + bvh_cache_alignment - 1) / bvh_cache_alignment
+                   * bvh_cache_alignment;
+    h.order_offset = h.nodes_offset + uint64_t(num_nodes) * node_size;
+    for (int a = 0; a < 3; a++) {
+        h.bounds[a] = bounds.min()[a];
+        h.bounds[3+a] = bounds.max()[a];
+    }
+
+    std::vector<uint32_t> order_words(order, order + num_prims);
+    char padding[bvh_cache_alignment] = {0};
+    auto padding_size = h.nodes_offset - sizeof h;
+
+    auto temporary = path + "." + std::to_string(getpid());
+    FILE *file = std::fopen(temporary.c_str(), "wb");
+    if (!file)
+        return;
+    bool written =
+        std::fwrite(&h, sizeof h, 1, file) == 1
+        && (padding_size == 0 || std::fwrite(padding, padding_size, 1, file) == 1)
+        && std::fwrite(nodes, node_size, num_nodes, file) == size_t(num_nodes)
+        && std::fwrite(order_words.data(), sizeof(uint32_t), num_prims, file)
+           == size_t(num_prims);
+    written = std::fclose(file) == 0 && written;
+    if (!written || std::rename(temporary.c_str(), path.c_str()) != 0)
+        std::remove(temporary.c_str());
+#endif
+}
+
+inline aabb bvh_cache_bounds(const bvh_cache_header& h) {
+    return aabb(vec3(h.bounds[0], h.bounds[1], h.bounds[2]),
+                vec3(h.bounds[3], h.bounds[4], h.bounds[5]));
+}
+
+#endif
@@ -15,10 +15,10 @@
 #include "ray.h"
 
 
-vec3 random_in_unit_disk() {
+vec3 random_in_unit_disk(rng& gen) {
     vec3 p;
     do {
-        p = 2.0*vec3(random_double(),random_double(),0) - vec3(1,1,0);
+        p = 2.0*vec3(random_double(gen),random_double(gen),0) - vec3(1,1,0);
     } while (dot(p,p) >= 1.0);
     return p;
 }
@@ -50,10 +50,10 @@ class camera {
         }
 
         // new: add time to construct ray
-        ray get_ray(double s, double t) {
-            vec3 rd = lens_radius*random_in_unit_disk();
+        ray get_ray(double s, double t, rng& gen) const {
+            vec3 rd = lens_radius*random_in_unit_disk(gen);
             vec3 offset = u * rd.x() + v * rd.y();
-            auto time = time0 + random_double()*(time1-time0);
+            auto time = time0 + random_double(gen)*(time1-time0);
             return ray(
                 origin + offset,
                 lower_left_corner + s*horizontal + t*vertical - origin - offset,
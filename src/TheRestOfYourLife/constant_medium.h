@@ -13,17 +13,21 @@
 
 #include "common/rtweekend.h"
 #include "hittable.h"
+#include "instance.h"
 #include "material.h"
 #include "texture.h"
 
 
 class constant_medium : public hittable  {
     public:
-        constant_medium(hittable *b, double d, texture *a) : boundary(b), density(d) {
+        constant_medium(hittable *b, double d, texture *a)
+          : boundary(fold_transforms(b)), density(d)
+        {
             phase_function = new isotropic(a);
         }
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const;
+        virtual bool occluded(const ray& r, double t_min, double t_max, rng& gen) const;
 
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
             return boundary->bounding_box(t0, t1, output_box);
@@ -35,15 +39,18 @@ class constant_medium : public hittable  {
 };
 
 
-bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool constant_medium::hit(
+    const ray& r, double t_min, double t_max, hit_record& rec, rng& gen
+) const {
     // Print occasional samples when debugging. To enable, set enableDebug true.
     const bool enableDebug = false;
-    bool debugging = enableDebug && random_double() < 0.00001;
+    bool debugging = enableDebug && random_double(gen) < 0.00001;
 
+    // Only the distances to the boundary matter, so its hits are left unfinished.
     hit_record rec1, rec2;
 
-    if (boundary->hit(r, -infinity, infinity, rec1)) {
-        if (boundary->hit(r, rec1.t+0.0001, infinity, rec2)) {
+    if (boundary->find_hit(r, -infinity, infinity, rec1, gen)) {
+        if (boundary->find_hit(r, rec1.t+0.0001, infinity, rec2, gen)) {
 
             if (debugging) std::cerr << "\nt0 t1 " << rec1.t << " " << rec2.t << '\n';
 
@@ -56,7 +63,7 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
                 rec1.t = 0;
 
             auto distance_inside_boundary = (rec2.t - rec1.t) * r.direction().length();
-            auto hit_distance = -(1/density) * log(random_double());
+            auto hit_distance = -(1/density) * log(random_double(gen));
 
             if (hit_distance < distance_inside_boundary) {
 
@@ -78,4 +85,22 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
     return false;
 }
 
+// Makes the same random choice as hit(), from the same draws.
+bool constant_medium::occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+    hit_record rec1, rec2;
+    if (!boundary->find_hit(r, -infinity, infinity, rec1, gen)
+        || !boundary->find_hit(r, rec1.t+0.0001, infinity, rec2, gen))
+        return false;
+
+    if (rec1.t < t_min) rec1.t = t_min;
+    if (rec2.t > t_max) rec2.t = t_max;
+    if (rec1.t >= rec2.t)
+        return false;
+    if (rec1.t < 0)
+        rec1.t = 0;
+
+    auto distance_inside_boundary = (rec2.t - rec1.t) * r.direction().length();
+    return -(1/density) * log(random_double(gen)) < distance_inside_boundary;
+}
+
 #endif
@@ -0,0 +1,939 @@
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "common/traversal_stats.h"
+#include "bvh_build.h"
+#include "bvh_cache.h"
+#include "hittable.h"
+#include "instance.h"
+#include "lbvh.h"
+#include "sbvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+
+// One node of a flat_bvh, 32 bytes. The first child of an interior node is the node right after
+// it in the array and `offset` is the index of the second; in a leaf, `offset` is the first of
+// its `count` primitives. Bounds are rounded outward to float, so they never shrink.
+struct alignas(32) flat_bvh_node {
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t offset;
+    uint16_t count;     // 0 for interior nodes
+    uint8_t axis;       // split axis of an interior node
+    uint8_t pad;
+
+    bool is_leaf() const { return count > 0; }
+};
+
+// A bounding volume hierarchy stored as one array of nodes in depth-first order, with the
+// primitives reordered so that every leaf covers a contiguous range of them. Traversal walks the
+// array with an explicit stack instead of making a virtual call per node. Takes the same
+// arguments as bvh_node and can stand in for it anywhere; unlike bvh_node it leaves the caller's
+// array as it was. The options pick the split method and leaf sizes (see bvh_build.h), and
+// where to cache the tree between runs; a cached tree is traversed where it is mapped.
+//
+// For animation, refit() and update() bring the tree up to date with primitives that have moved,
+// without building it again; see update().
+class flat_bvh : public hittable {
+    public:
+        flat_bvh(
+            hittable **l, int n, double time0, double time1,
+            const bvh_build_options& options = bvh_build_options()
+        );
+
+        // A tree over primitives that are not hittables, such as the triangles of a
+        // triangle_mesh, known only by their boxes. It has no prims: `order` says which
+        // primitive each leaf entry is, and the owner walks the nodes itself rather than call
+        // hit(), occluded(), refit() or update(). Spatial splits fall back on SAH.
+        explicit flat_bvh(
+            const bvh_primitives& info, const bvh_build_options& options = bvh_build_options()
+        );
+        ~flat_bvh() {
+            std::free(node_storage);
+            delete cache_file;
+            delete[] prims;
+        }
+
+        virtual bool find_hit(
+            const ray& r, double tmin, double tmax, hit_record& rec, rng& gen
+        ) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax, rng& gen) const;
+        virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+
+        enum update_result { refitted, partially_rebuilt, rebuilt };
+
+        // Recomputes every node's bounds from the primitives' bounds over [time0, time1), bottom
+        // up, keeping the shape of the tree. Primitives that spatial splits had cut up between
+        // leaves are fit whole in each.
+        void refit(double time0, double time1, thread_pool *pool = 0);
+
+        // For each frame of an animation: refits the tree, then rebuilds the subtrees whose SAH
+        // cost per unit area has grown by options.rebuild_growth since they were built. The whole
+        // tree is rebuilt instead if that takes in the root or more than half the primitives.
+        // Both spread their work over the pool, if given one. A tree built with spatial splits
+        // is always rebuilt whole, splits and all, from the primitives it was built over: its
+        // leaves repeat the primitives the splits cut up, and a rebuild over those would keep
+        // every copy, each with its whole box.
+        update_result update(double time0, double time1, thread_pool *pool = 0);
+
+        // The tree's SAH cost per unit area of the root: the expected cost of a ray through it.
+        double sah_cost() const;
+
+        static const int max_depth = 64;
+
+        flat_bvh_node *nodes;
+        int num_nodes;
+        hittable **prims;
+        int num_prims;      // more than the caller's, if spatial splits repeat some
+        aabb box;
+        std::vector<int> order;     // prims[i] is made from l[order[i]]
+
+    private:
+        flat_bvh(const flat_bvh&);
+        flat_bvh& operator=(const flat_bvh&);
+
+        // A node of the top levels of a parallel build, or a subtree left to a task.
+        struct top_node {
+            aabb bounds;
+            int axis;
+            int left, right;
+            int task;   // -1 unless the subtree is built by tasks[task]
+        };
+
+        struct subtree_task {
+            int begin, end, depth;
+            flat_bvh_node *nodes;
+            int num_nodes;
+            void *storage;
+        };
+
+        static flat_bvh_node *allocate_nodes(int count, void *&storage);
+        static void build(
+            const bvh_primitives& info, const bvh_build_options& options,
+            int *index, int begin, int end, int depth, flat_bvh_node *out, int& count
+        );
+        void build_parallel(
+            const bvh_primitives& info, const bvh_build_options& options, int *index, int n,
+            thread_pool& pool
+        );
+        static int build_top(
+            const bvh_primitives& info, const bvh_build_options& options,
+            int *index, int begin, int end, int depth, int grain, thread_pool& pool,
+            std::vector<top_node>& top, std::vector<subtree_task>& tasks
+        );
+        void emit(const std::vector<top_node>& top, const std::vector<subtree_task>& tasks, int t);
+        void append(const subtree_task& task);
+        void emit_lbvh(
+            const lbvh& tree, const bvh_primitives& info, const bvh_build_options& options,
+            int *index, int& next_prim, int node, int depth
+        );
+        void build_nodes(const bvh_primitives& info, int *index, thread_pool *pool);
+        void rebuild_spatial(double time0, double time1, thread_pool *pool);
+        void construct(
+            hittable **l, const bvh_primitives& info, double time0, double time1,
+            const bvh_build_options& options, thread_pool *pool
+        );
+        void make_empty();
+        static thread_pool *build_pool(const bvh_build_options& options, int n);
+
+        void own_nodes();
+        void refit_nodes(const bvh_primitives& info, thread_pool *pool);
+        void price_subtrees(std::vector<double>& subtree_cost) const;
+        void record_built_costs();
+        double growth(int node) const;
+        void find_degraded(
+            int node, int depth, std::vector<int>& roots, std::vector<subtree_task>& tasks,
+            int& covered
+        ) const;
+        void splice(
+            const flat_bvh_node *old, int node, const std::vector<int>& task_at,
+            const std::vector<subtree_task>& tasks, const std::vector<float>& old_built_cost
+        );
+
+        void *node_storage;
+        bvh_cache_file *cache_file;     // holding the nodes, if they came from the cache
+        bvh_build_options build_options;    // as limited for building, without the cache
+
+        // For update(): each subtree's SAH cost, and its cost per unit area when it was built.
+        std::vector<double> cost;
+        std::vector<float> built_cost;
+};
+
+
+bool flat_bvh::bounding_box(double t0, double t1, aabb& output_box) const {
+    output_box = box;
+    return true;
+}
+
+// The branchless slab test of aabb::hit, against a node's float bounds. A ray through an edge or
+// corner of the box enters and leaves it at the same distance, which rounding can put either
+// way round, so t_max is widened by a few ulps: mesh vertices lie on their leaves' corners, and
+// rays through them must not miss.
+inline bool flat_bvh_node_hit(
+    const flat_bvh_node& node, const ray_query& q, double t_min, double t_max
+) {
+    for (int a = 0; a < 3; a++) {
+        const float *enter = q.sign[a] ? node.bounds_max : node.bounds_min;
+        const float *leave = q.sign[a] ? node.bounds_min : node.bounds_max;
+        auto t0 = (enter[a] - q.origin[a]) * q.inv_dir[a];
+        auto t1 = (leave[a] - q.origin[a]) * q.inv_dir[a];
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+    }
+    return t_min <= t_max * (1 + 4 * 2.220446049250313e-16);
+}
+
+bool flat_bvh::find_hit(
+    const ray& r, double t_min, double t_max, hit_record& rec, rng& gen
+) const {
+    ray_query q(r);
+
+    bool hit_anything = false;
+    double closest_so_far = t_max;
+    int stack[max_depth];
+    int stack_size = 0;
+    int current = 0;
+
+    for (;;) {
+        count_node_visit();
+        const flat_bvh_node& node = nodes[current];
+        if (flat_bvh_node_hit(node, q, t_min, closest_so_far)) {
+            if (node.is_leaf()) {
+                hit_record temp_rec;
+                for (int i = node.offset; i < int(node.offset + node.count); i++) {
+                    count_primitive_test();
+                    if (prims[i]->find_hit(r, t_min, closest_so_far, temp_rec, gen)) {
+                        hit_anything = true;
+                        closest_so_far = temp_rec.t;
+                        rec = temp_rec;
+                    }
+                }
+            }
+            else {
+                // Visit the child on the near side of the split first; the far one waits on the
+                // stack.
+                if (q.sign[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                }
+                else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+
+    return hit_anything;
+}
+
+// The same walk as hit(), without the ordering: any hit will do.
+bool flat_bvh::occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+    ray_query q(r);
+
+    int stack[max_depth];
+    int stack_size = 0;
+    int current = 0;
+
+    for (;;) {
+        count_node_visit();
+        const flat_bvh_node& node = nodes[current];
+        if (flat_bvh_node_hit(node, q, t_min, t_max)) {
+            if (node.is_leaf()) {
+                for (int i = node.offset; i < int(node.offset + node.count); i++) {
+                    count_primitive_test();
+                    if (prims[i]->occluded(r, t_min, t_max, gen))
+                        return true;
+                }
+            }
+            else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            return false;
+        current = stack[--stack_size];
+    }
+}
+
+// Outward rounding from double to float.
+inline float float_down(double x) {
+    auto f = static_cast<float>(x);
+    return f > x ? std::nextafter(f, -INFINITY) : f;
+}
+
+inline float float_up(double x) {
+    auto f = static_cast<float>(x);
+    return f < x ? std::nextafter(f, INFINITY) : f;
+}
+
+inline flat_bvh_node flat_bvh_bounds_node(const aabb& bounds) {
+    flat_bvh_node node;
+    for (int a = 0; a < 3; a++) {
+        node.bounds_min[a] = float_down(bounds.min()[a]);
+        node.bounds_max[a] = float_up(bounds.max()[a]);
+    }
+    node.pad = 0;
+    return node;
+}
+
+// Whether nodes read from a cache file can be traversed: every child a node in the array, every
+// leaf's primitives in range, and no leaf deeper than the traversal stack allows. The walk gives
+// up after more visits than there are nodes, so shared subtrees cannot make it run long.
+inline bool flat_bvh_nodes_valid(const flat_bvh_node *nodes, int num_nodes, int num_prims) {
+    std::vector<std::pair<int, int>> pending(1, std::make_pair(0, 0));  // node, depth
+    int visits = 0;
+    while (!pending.empty()) {
+        int i = pending.back().first;
+        int depth = pending.back().second;
+        pending.pop_back();
+        if (++visits > num_nodes || depth > flat_bvh::max_depth)
+            return false;
+        const flat_bvh_node& node = nodes[i];
+        if (node.is_leaf()) {
+            if (uint64_t(node.offset) + node.count > uint64_t(num_prims))
+                return false;
+            continue;
+        }
+        if (i + 1 >= num_nodes || node.offset >= uint32_t(num_nodes))
+            return false;
+        pending.push_back(std::make_pair(i + 1, depth + 1));
+        pending.push_back(std::make_pair(int(node.offset), depth + 1));
+    }
+    return true;
+}
+
+flat_bvh::flat_bvh(
+    hittable **l, int n, double time0, double time1, const bvh_build_options& options
+) : nodes(0), num_nodes(0), prims(0), num_prims(n), node_storage(0), cache_file(0),
+    build_options(options)
+{
+    if (n == 0) {
+        make_empty();
+        return;
+    }
+    thread_pool *pool = build_pool(options, n);
+    bvh_primitives info(l, n, time0, time1, pool);
+    construct(l, info, time0, time1, options, pool);
+    delete pool;
+}
+
+flat_bvh::flat_bvh(const bvh_primitives& info, const bvh_build_options& options)
+  : nodes(0), num_nodes(0), prims(0), num_prims(static_cast<int>(info.boxes.size())),
+    node_storage(0), cache_file(0), build_options(options)
+{
+    if (num_prims == 0) {
+        make_empty();
+        return;
+    }
+    thread_pool *pool = build_pool(options, num_prims);
+    construct(0, info, 0, 0, options, pool);
+    delete pool;
+}
+
+// A single node with inverted bounds, which no ray enters.
+void flat_bvh::make_empty() {
+    prims = new hittable*[1];
+    nodes = allocate_nodes(1, node_storage);
+    nodes[0] = flat_bvh_node();
+    for (int a = 0; a < 3; a++) {
+        nodes[0].bounds_min[a] = INFINITY;
+        nodes[0].bounds_max[a] = -INFINITY;
+    }
+    nodes[0].offset = 0;
+    nodes[0].count = 0;
+    num_nodes = 1;
+    box = aabb(vec3(0,0,0), vec3(0,0,0));
+}
+
+// Small trees are not worth starting threads for.
+thread_pool *flat_bvh::build_pool(const bvh_build_options& options, int n) {
+    if (options.threads != 1 && n >= 2*bvh_parallel_grain)
+        return new thread_pool(options.threads);
+    return 0;
+}
+
+// Builds the tree over info's primitives, or maps it from the cache, and takes the hittables
+// from l in leaf order if there are any.
+void flat_bvh::construct(
+    hittable **l, const bvh_primitives& info, double time0, double time1,
+    const bvh_build_options& options, thread_pool *pool
+) {
+    int n = num_prims;
+    build_options.max_leaf_size = std::min(std::max(options.max_leaf_size, 1), 65535);
+    build_options.cache_directory = 0;
+    if (!l && options.split == bvh_build_options::split_sbvh)
+        build_options.split = bvh_build_options::split_sah;
+
+    std::vector<int> index(n);
+    for (int i = 0; i < n; i++)
+        index[i] = i;
+
+    bool spatial = build_options.split == bvh_build_options::split_sbvh;
+    bool cached = options.cache_directory && !spatial;
+    uint64_t cache_key = 0;
+    if (cached) {
+        cache_key = bvh_cache_key(info, time0, time1, options, 2);
+        cache_file = bvh_cache_open(
+            bvh_cache_path(options.cache_directory, 2, cache_key), cache_key, 2, n,
+            flat_bvh_nodes_valid);
+    }
+
+    if (cache_file) {
+        nodes = const_cast<flat_bvh_node*>(static_cast<const flat_bvh_node*>(cache_file->nodes()));
+        num_nodes = cache_file->header().num_nodes;
+        index.assign(cache_file->order(), cache_file->order() + n);
+    }
+    else if (spatial) {
+        sbvh tree(l, info, time0, time1, build_options, max_depth - 32);
+        num_nodes = static_cast<int>(tree.nodes.size());
+        nodes = allocate_nodes(num_nodes, node_storage);
+        for (int i = 0; i < num_nodes; i++) {
+            const sbvh::node& built = tree.nodes[i];
+            nodes[i] = flat_bvh_bounds_node(built.bounds);
+            nodes[i].offset = built.offset;
+            nodes[i].count = static_cast<uint16_t>(built.count);
+            nodes[i].axis = static_cast<uint8_t>(built.axis);
+        }
+        index.swap(tree.refs);
+        num_prims = static_cast<int>(index.size());
+    }
+    else
+        build_nodes(info, index.data(), pool);
+
+    if (l) {
+        // A primitive split between leaves is folded once for all of them.
+        std::vector<hittable*> folded(n);
+        for (int i = 0; i < n; i++)
+            folded[i] = fold_transforms(l[i]);
+        prims = new hittable*[num_prims];
+        for (int i = 0; i < num_prims; i++)
+            prims[i] = folded[index[i]];
+    }
+
+    box = info.boxes[0];
+    for (int i = 1; i < n; i++)
+        box = surrounding_box(box, info.boxes[i]);
+
+    if (cached && !cache_file) {
+        bvh_cache_write(
+            bvh_cache_path(options.cache_directory, 2, cache_key), cache_key, 2,
+            sizeof(flat_bvh_node), nodes, num_nodes, index.data(), n, box);
+    }
+    order.swap(index);
+}
+
+inline double flat_bvh_node_area(const flat_bvh_node& node) {
+    double a = node.bounds_max[0] - node.bounds_min[0];
+    double b = node.bounds_max[1] - node.bounds_min[1];
+    double c = node.bounds_max[2] - node.bounds_min[2];
+    return 2*(a*b + b*c + c*a);
+}
+
+// Builds the nodes over all of info's primitives in place of any there were, leaving index in the
+// order the leaves take the primitives in.
+void flat_bvh::build_nodes(const bvh_primitives& info, int *index, thread_pool *pool) {
+    std::free(node_storage);
+    node_storage = 0;
+    num_nodes = 0;
+    int n = num_prims;
+    if (pool && build_options.split != bvh_build_options::split_lbvh) {
+        build_parallel(info, build_options, index, n, *pool);
+        return;
+    }
+
+    // A binary tree with at least one primitive per leaf has at most 2n-1 nodes. Build into that
+    // much space, then move the nodes to an array of the right size.
+    void *built_storage;
+    nodes = allocate_nodes(2*n - 1, built_storage);
+    if (build_options.split == bvh_build_options::split_lbvh) {
+        lbvh tree(info, build_options, pool);
+        int next_prim = 0;
+        emit_lbvh(tree, info, build_options, index, next_prim, 0, 0);
+    }
+    else
+        build(info, build_options, index, 0, n, 0, nodes, num_nodes);
+    auto built = nodes;
+    nodes = allocate_nodes(num_nodes, node_storage);
+    std::copy(built, built + num_nodes, nodes);
+    std::free(built_storage);
+}
+
+// Returns uninitialized, 32-byte aligned room for `count` nodes; storage is the pointer to free.
+flat_bvh_node *flat_bvh::allocate_nodes(int count, void *&storage) {
+    const uintptr_t alignment = alignof(flat_bvh_node);
+    storage = std::malloc(count * sizeof(flat_bvh_node) + alignment - 1);
+    auto address = (reinterpret_cast<uintptr_t>(storage) + alignment - 1) & ~(alignment - 1);
+    return reinterpret_cast<flat_bvh_node*>(address);
+}
+
+// Appends the subtree over index[begin, end) to out[count...] in depth-first order.
+void flat_bvh::build(
+    const bvh_primitives& info, const bvh_build_options& options,
+    int *index, int begin, int end, int depth, flat_bvh_node *out, int& count
+) {
+    int this_node = count++;
+
+    aabb bounds, centroid_bounds;
+    bvh_range_bounds(info, index, begin, end, bounds, centroid_bounds);
+
+    flat_bvh_node node = flat_bvh_bounds_node(bounds);
+
+    // Past this depth, median splits take over: they halve the primitive count at every level,
+    // so the tree stays within the fixed traversal stack.
+    bvh_build_options split_options = options;
+    if (depth >= max_depth - 32)
+        split_options.split = bvh_build_options::split_median;
+
+    int axis;
+    int mid = bvh_split(
+        info, index, begin, end, bounds, centroid_bounds, split_options, true, axis);
+    if (mid < 0) {
+        node.offset = begin;
+        node.count = static_cast<uint16_t>(end - begin);
+        node.axis = 0;
+        out[this_node] = node;
+        return;
+    }
+
+    build(info, options, index, begin, mid, depth + 1, out, count);
+    node.offset = static_cast<uint32_t>(count);
+    node.count = 0;
+    node.axis = static_cast<uint8_t>(axis);
+    build(info, options, index, mid, end, depth + 1, out, count);
+    out[this_node] = node;
+}
+
+// The top levels are split one node at a time, each binned across the pool, until the ranges
+// are small enough to hand out whole. Those subtrees are then built side by side, each into its
+// own array, and spliced into place in depth-first order. Every split is decided exactly as
+// build() would decide it, so the result is the serial build's, node for node.
+void flat_bvh::build_parallel(
+    const bvh_primitives& info, const bvh_build_options& options, int *index, int n,
+    thread_pool& pool
+) {
+    std::vector<top_node> top;
+    std::vector<subtree_task> tasks;
+    int grain = std::max(bvh_parallel_grain, n / (8 * pool.size()));
+    build_top(info, options, index, 0, n, 0, grain, pool, top, tasks);
+
+    pool.parallel_for(static_cast<int>(tasks.size()), [&](int t, int) {
+        auto& task = tasks[t];
+        task.nodes = allocate_nodes(2*(task.end - task.begin) - 1, task.storage);
+        task.num_nodes = 0;
+        build(info, options, index, task.begin, task.end, task.depth, task.nodes, task.num_nodes);
+    });
+
+    int total = 0;
+    for (const auto& t : top)
+        total += t.task < 0 ? 1 : tasks[t.task].num_nodes;
+    nodes = allocate_nodes(total, node_storage);
+    num_nodes = 0;
+    emit(top, tasks, 0);
+
+    for (auto& task : tasks)
+        std::free(task.storage);
+}
+
+int flat_bvh::build_top(
+    const bvh_primitives& info, const bvh_build_options& options,
+    int *index, int begin, int end, int depth, int grain, thread_pool& pool,
+    std::vector<top_node>& top, std::vector<subtree_task>& tasks
+) {
+    int t = static_cast<int>(top.size());
+    top.push_back(top_node());
+    top[t].task = -1;
+
+    int axis, mid = -1;
+    aabb bounds, centroid_bounds;
+    if (end - begin > grain && depth < max_depth - 32) {
+        bvh_range_bounds(info, index, begin, end, bounds, centroid_bounds, &pool);
+        mid = bvh_split(
+            info, index, begin, end, bounds, centroid_bounds, options, true, axis, &pool);
+    }
+
+    if (mid < 0) {
+        top[t].task = static_cast<int>(tasks.size());
+        subtree_task task = { begin, end, depth, 0, 0, 0 };
+        tasks.push_back(task);
+        return t;
+    }
+
+    // The recursion grows `top`, so nothing may hold a reference into it across the calls.
+    int left = build_top(info, options, index, begin, mid, depth + 1, grain, pool, top, tasks);
+    int right = build_top(info, options, index, mid, end, depth + 1, grain, pool, top, tasks);
+    top[t].bounds = bounds;
+    top[t].axis = axis;
+    top[t].left = left;
+    top[t].right = right;
+    return t;
+}
+
+void flat_bvh::emit(
+    const std::vector<top_node>& top, const std::vector<subtree_task>& tasks, int t
+) {
+    if (top[t].task >= 0) {
+        append(tasks[top[t].task]);
+        return;
+    }
+
+    int this_node = num_nodes++;
+    flat_bvh_node node = flat_bvh_bounds_node(top[t].bounds);
+    emit(top, tasks, top[t].left);
+    node.offset = static_cast<uint32_t>(num_nodes);
+    node.count = 0;
+    node.axis = static_cast<uint8_t>(top[t].axis);
+    emit(top, tasks, top[t].right);
+    nodes[this_node] = node;
+}
+
+// Appends the nodes a task built. Task arrays count their second children from their own start.
+void flat_bvh::append(const subtree_task& task) {
+    auto base = static_cast<uint32_t>(num_nodes);
+    for (int i = 0; i < task.num_nodes; i++) {
+        nodes[num_nodes + i] = task.nodes[i];
+        if (!task.nodes[i].is_leaf())
+            nodes[num_nodes + i].offset += base;
+    }
+    num_nodes += task.num_nodes;
+}
+
+// Lists the primitives under an lbvh node in index[next_prim...], left to right.
+inline void lbvh_gather(const lbvh& tree, int node, int *index, int& next_prim) {
+    if (tree.is_leaf(node)) {
+        index[next_prim++] = tree.primitive(node);
+        return;
+    }
+    lbvh_gather(tree, tree.left[node], index, next_prim);
+    lbvh_gather(tree, tree.right[node], index, next_prim);
+}
+
+// Appends an lbvh subtree to the node array in depth-first order, collapsing subtrees into
+// leaves wherever that is no more expensive, and ordering each node's children along the axis
+// that separates them most. A subtree that reaches too deep is rebuilt with build(), which uses
+// median splits at that depth.
+void flat_bvh::emit_lbvh(
+    const lbvh& tree, const bvh_primitives& info, const bvh_build_options& options,
+    int *index, int& next_prim, int node, int depth
+) {
+    if (depth >= max_depth - 32 && !tree.is_leaf(node)) {
+        int begin = next_prim;
+        lbvh_gather(tree, node, index, next_prim);
+        build(info, options, index, begin, next_prim, depth, nodes, num_nodes);
+        return;
+    }
+
+    int this_node = num_nodes++;
+    flat_bvh_node fn = flat_bvh_bounds_node(tree.bounds[node]);
+
+    auto leaf_cost = options.intersection_cost * tree.count[node] * tree.bounds[node].area();
+    if (tree.is_leaf(node)
+        || (tree.count[node] <= options.max_leaf_size && leaf_cost <= tree.cost[node])
+    ) {
+        fn.offset = next_prim;
+        lbvh_gather(tree, node, index, next_prim);
+        fn.count = static_cast<uint16_t>(tree.count[node]);
+        fn.axis = 0;
+        nodes[this_node] = fn;
+        return;
+    }
+
+    int first = tree.left[node], second = tree.right[node];
+    vec3 separation = (tree.bounds[second].min() + tree.bounds[second].max())
+                    - (tree.bounds[first].min() + tree.bounds[first].max());
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+        if (std::fabs(separation[a]) > std::fabs(separation[axis]))
+            axis = a;
+    if (separation[axis] < 0)
+        std::swap(first, second);
+
+    emit_lbvh(tree, info, options, index, next_prim, first, depth + 1);
+    fn.offset = static_cast<uint32_t>(num_nodes);
+    fn.count = 0;
+    fn.axis = static_cast<uint8_t>(axis);
+    emit_lbvh(tree, info, options, index, next_prim, second, depth + 1);
+    nodes[this_node] = fn;
+}
+
+
+// Refitting writes to the nodes, so a tree mapped from the cache is copied out of it first.
+void flat_bvh::own_nodes() {
+    if (!cache_file)
+        return;
+    auto mapped = nodes;
+    nodes = allocate_nodes(num_nodes, node_storage);
+    std::copy(mapped, mapped + num_nodes, nodes);
+    delete cache_file;
+    cache_file = 0;
+}
+
+void flat_bvh::refit(double time0, double time1, thread_pool *pool) {
+    if (num_prims == 0)
+        return;
+    own_nodes();
+    if (built_cost.empty())
+        record_built_costs();
+    bvh_primitives info(prims, num_prims, time0, time1, pool);
+    refit_nodes(info, pool);
+}
+
+// Fits every node to info's boxes, and prices every subtree in `cost`.
+void flat_bvh::refit_nodes(const bvh_primitives& info, thread_pool *pool) {
+    cost.resize(num_nodes);
+    // Leaves are nodes too, so both children count, or a subtree would end before its last
+    // leaves.
+    auto children = [&](int i, int *out) {
+        if (nodes[i].is_leaf())
+            return 0;
+        out[0] = i + 1;
+        out[1] = nodes[i].offset;
+        return 2;
+    };
+    bvh_refit_depth_first(num_nodes, pool, children, [&](int i) {
+        flat_bvh_node& node = nodes[i];
+        if (node.is_leaf()) {
+            aabb bounds = info.boxes[node.offset];
+            for (int p = node.offset + 1; p < int(node.offset + node.count); p++)
+                bounds = surrounding_box(bounds, info.boxes[p]);
+            for (int a = 0; a < 3; a++) {
+                node.bounds_min[a] = float_down(bounds.min()[a]);
+                node.bounds_max[a] = float_up(bounds.max()[a]);
+            }
+            cost[i] = build_options.intersection_cost * node.count * flat_bvh_node_area(node);
+            return;
+        }
+        const flat_bvh_node& c0 = nodes[i+1];
+        const flat_bvh_node& c1 = nodes[node.offset];
+        for (int a = 0; a < 3; a++) {
+            node.bounds_min[a] = std::min(c0.bounds_min[a], c1.bounds_min[a]);
+            node.bounds_max[a] = std::max(c0.bounds_max[a], c1.bounds_max[a]);
+        }
+        cost[i] = build_options.traversal_cost * flat_bvh_node_area(node)
+                + cost[i+1] + cost[node.offset];
+    });
+
+    box = info.boxes[0];
+    for (int i = 1; i < num_prims; i++)
+        box = surrounding_box(box, info.boxes[i]);
+}
+
+// Prices every subtree as it stands.
+void flat_bvh::price_subtrees(std::vector<double>& subtree_cost) const {
+    subtree_cost.resize(num_nodes);
+    for (int i = num_nodes - 1; i >= 0; i--) {
+        const flat_bvh_node& node = nodes[i];
+        auto area = flat_bvh_node_area(node);
+        subtree_cost[i] = node.is_leaf()
+            ? build_options.intersection_cost * node.count * area
+            : build_options.traversal_cost * area + subtree_cost[i+1] + subtree_cost[node.offset];
+    }
+}
+
+// Takes the current prices as the ones the tree was built with.
+void flat_bvh::record_built_costs() {
+    price_subtrees(cost);
+    built_cost.resize(num_nodes);
+    for (int i = 0; i < num_nodes; i++) {
+        auto area = flat_bvh_node_area(nodes[i]);
+        built_cost[i] = static_cast<float>(area > 0 ? cost[i] / area : 0);
+    }
+}
+
+double flat_bvh::sah_cost() const {
+    auto area = flat_bvh_node_area(nodes[0]);
+    if (num_prims == 0 || area <= 0)
+        return 0;
+    if (!cost.empty())
+        return cost[0] / area;
+    std::vector<double> subtree_cost;
+    price_subtrees(subtree_cost);
+    return subtree_cost[0] / area;
+}
+
+// How many times its cost per unit area when it was built a subtree now costs.
+double flat_bvh::growth(int node) const {
+    auto area = flat_bvh_node_area(nodes[node]);
+    if (area <= 0 || built_cost[node] <= 0)
+        return 1;
+    return cost[node] / area / built_cost[node];
+}
+
+// Lists the largest subtrees at or below `node` that have grown past options.rebuild_growth,
+// with a task to build each one again over its primitives. Leaves never grow.
+void flat_bvh::find_degraded(
+    int node, int depth, std::vector<int>& roots, std::vector<subtree_task>& tasks, int& covered
+) const {
+    if (nodes[node].is_leaf())
+        return;
+    if (growth(node) <= build_options.rebuild_growth) {
+        find_degraded(node + 1, depth + 1, roots, tasks, covered);
+        find_degraded(nodes[node].offset, depth + 1, roots, tasks, covered);
+        return;
+    }
+
+    // The subtree's primitives run from its first leaf to its last.
+    int first = node, last = node;
+    while (!nodes[first].is_leaf())
+        first++;
+    while (!nodes[last].is_leaf())
+        last = nodes[last].offset;
+    subtree_task task = {
+        int(nodes[first].offset), int(nodes[last].offset + nodes[last].count), depth, 0, 0, 0
+    };
+    roots.push_back(node);
+    tasks.push_back(task);
+    covered += task.end - task.begin;
+}
+
+flat_bvh::update_result flat_bvh::update(double time0, double time1, thread_pool *pool) {
+    if (num_prims == 0)
+        return refitted;
+    own_nodes();
+    if (built_cost.empty())
+        record_built_costs();
+
+    bvh_primitives info(prims, num_prims, time0, time1, pool);
+    refit_nodes(info, pool);
+
+    std::vector<int> roots;
+    std::vector<subtree_task> tasks;
+    int covered = 0;
+    find_degraded(0, 0, roots, tasks, covered);
+    if (tasks.empty())
+        return refitted;
+    if (build_options.split == bvh_build_options::split_sbvh) {
+        rebuild_spatial(time0, time1, pool);
+        record_built_costs();
+        return rebuilt;
+    }
+
+    std::vector<int> index(num_prims);
+    for (int i = 0; i < num_prims; i++)
+        index[i] = i;
+
+    update_result result;
+    if (roots[0] == 0 || 2*covered > num_prims) {
+        build_nodes(info, index.data(), pool);
+        built_cost.assign(num_nodes, -1);
+        result = rebuilt;
+    }
+    else {
+        auto build_task = [&](int t, int) {
+            auto& task = tasks[t];
+            task.nodes = allocate_nodes(2*(task.end - task.begin) - 1, task.storage);
+            task.num_nodes = 0;
+            build(info, build_options, index.data(), task.begin, task.end, task.depth,
+                  task.nodes, task.num_nodes);
+        };
+        if (pool)
+            pool->parallel_for(static_cast<int>(tasks.size()), build_task);
+        else
+            for (int t = 0; t < int(tasks.size()); t++)
+                build_task(t, 0);
+
+        std::vector<int> task_at(num_nodes, -1);
+        for (int t = 0; t < int(tasks.size()); t++)
+            task_at[roots[t]] = t;
+
+        auto old = nodes;
+        auto old_storage = node_storage;
+        std::vector<float> old_built_cost;
+        old_built_cost.swap(built_cost);
+        void *spliced_storage;
+        nodes = allocate_nodes(2*num_prims - 1, spliced_storage);
+        built_cost.assign(2*num_prims - 1, -1);
+        num_nodes = 0;
+        splice(old, 0, task_at, tasks, old_built_cost);
+        std::free(old_storage);
+
+        auto spliced = nodes;
+        nodes = allocate_nodes(num_nodes, node_storage);
+        std::copy(spliced, spliced + num_nodes, nodes);
+        std::free(spliced_storage);
+        built_cost.resize(num_nodes);
+        for (auto& task : tasks)
+            std::free(task.storage);
+        result = partially_rebuilt;
+    }
+
+    std::vector<hittable*> old_prims(prims, prims + num_prims);
+    std::vector<int> old_order(order);
+    for (int i = 0; i < num_prims; i++) {
+        prims[i] = old_prims[index[i]];
+        order[i] = old_order[index[i]];
+    }
+
+    // What was rebuilt is priced afresh.
+    price_subtrees(cost);
+    for (int i = 0; i < num_nodes; i++) {
+        if (built_cost[i] < 0) {
+            auto area = flat_bvh_node_area(nodes[i]);
+            built_cost[i] = static_cast<float>(area > 0 ? cost[i] / area : 0);
+        }
+    }
+    return result;
+}
+
+// Builds the tree again with spatial splits over one of each primitive, which `order` tells apart
+// from the copies the last splits left in the leaves.
+void flat_bvh::rebuild_spatial(double time0, double time1, thread_pool *pool) {
+    std::vector<hittable*> unique;
+    for (int i = 0; i < num_prims; i++) {
+        if (order[i] >= int(unique.size()))
+            unique.resize(order[i] + 1);
+        unique[order[i]] = prims[i];
+    }
+    delete[] prims;
+    prims = 0;
+    std::free(node_storage);
+    node_storage = 0;
+    num_prims = static_cast<int>(unique.size());
+
+    bvh_primitives info(unique.data(), num_prims, time0, time1, pool);
+    construct(unique.data(), info, time0, time1, build_options, pool);
+}
+
+// Copies the subtree at old[node] to the end of the nodes, with the rebuilt subtrees in place of
+// the ones they replace.
+void flat_bvh::splice(
+    const flat_bvh_node *old, int node, const std::vector<int>& task_at,
+    const std::vector<subtree_task>& tasks, const std::vector<float>& old_built_cost
+) {
+    if (task_at[node] >= 0) {
+        append(tasks[task_at[node]]);
+        return;
+    }
+    int this_node = num_nodes++;
+    flat_bvh_node copy = old[node];
+    built_cost[this_node] = old_built_cost[node];
+    if (!copy.is_leaf()) {
+        splice(old, node + 1, task_at, tasks, old_built_cost);
+        copy.offset = static_cast<uint32_t>(num_nodes);
+        splice(old, old[node].offset, task_at, tasks, old_built_cost);
+    }
+    nodes[this_node] = copy;
+}
+
+#endif
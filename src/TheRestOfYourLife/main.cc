@@ -10,10 +10,17 @@
 //==============================================================================================
 
 #include "common/rtweekend.h"
+#include "common/framebuffer.h"
+#include "common/image_writer.h"
+#include "common/render_options.h"
 #include "common/rtw_stb_image.h"
+#include "common/thread_pool.h"
+#include "common/tile_renderer.h"
+#include "common/traversal_stats.h"
 #include "aarect.h"
 #include "box.h"
 #include "bvh.h"
+#include "bvh_stats.h"
 #include "camera.h"
 #include "constant_medium.h"
 #include "hittable_list.h"
@@ -27,28 +34,40 @@
 #include <iostream>
 
 
-vec3 ray_color(const ray& r, hittable *world, hittable *light_shape, int depth) {
+// Each bounce draws from its own generator, addressed by the pixel and sample the path belongs
+// to and by the remaining depth. Dimension 0 is left to the camera.
+vec3 ray_color(
+    const ray& r, hittable *world, hittable *light_shape, int depth,
+    uint32_t pixel, uint32_t sample, ray_kind kind = camera_ray
+) {
     hit_record hrec;
-    if (depth <= 0 || !world->hit(r, 0.001, infinity, hrec))
+    rng gen(pixel, sample, depth);
+    if (depth <= 0)
+        return vec3(0,0,0);
+    count_ray(kind);
+    if (!world->hit(r, 0.001, infinity, hrec, gen))
         return vec3(0,0,0);
 
     scatter_record srec;
     vec3 emitted = hrec.mat_ptr->emitted(r, hrec, hrec.u, hrec.v, hrec.p);
-    if (!hrec.mat_ptr->scatter(r, hrec, srec))
+    if (!hrec.mat_ptr->scatter(r, hrec, srec, gen))
         return emitted;
 
     if (srec.is_specular) {
-        return srec.attenuation * ray_color(srec.specular_ray, world, light_shape, depth-1);
+        return srec.attenuation
+             * ray_color(
+                   srec.specular_ray, world, light_shape, depth-1, pixel, sample, scattered_ray);
     }
     hittable_pdf plight(light_shape, hrec.p);
     mixture_pdf p(&plight, srec.pdf_ptr);
-    ray scattered = ray(hrec.p, p.generate(), r.time());
+    ray scattered = ray(hrec.p, p.generate(gen), r.time());
     auto pdf_val = p.value(scattered.direction());
     delete srec.pdf_ptr;
 
     return emitted
          + srec.attenuation * hrec.mat_ptr->scattering_pdf(r, hrec, scattered)
-                            * ray_color(scattered, world, light_shape, depth-1)
+                            * ray_color(scattered, world, light_shape, depth-1, pixel, sample,
+                                        scattered_ray)
                             / pdf_val;
 }
 
@@ -81,13 +100,16 @@ void cornell_box(hittable **scene, camera **cam, double aspect) {
                       vfov, aspect, aperture, dist_to_focus, 0.0, 1.0);
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     int nx = 600;
     int ny = 600;
     int num_samples = 100;
     int max_depth = 50;
 
-    std::cout << "P3\n" << nx << ' ' << ny << "\n255\n";
+    render_options options(num_samples);
+    if (!options.parse(argc, argv))
+        return 1;
+    bvh_build_options::default_cache_directory() = options.bvh_cache_directory;
 
     hittable *world;
     camera *cam;
@@ -100,20 +122,24 @@ int main() {
     a[1] = glass_sphere;
     hittable_list hlist(a,2);
 
-    for (int j = ny-1; j >= 0; --j) {
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-        for (int i = 0; i < nx; ++i) {
-            vec3 color;
-            for (int s = 0; s < num_samples; ++s) {
-                auto u = (i + random_double()) / nx;
-                auto v = (j + random_double()) / ny;
-                ray r = cam->get_ray(u, v);
-                vec3 p = r.point_at_parameter(2.0);
-                color += ray_color(r, world, &hlist, max_depth);
-            }
-            color.write_color(std::cout, num_samples);
-        }
-    }
+    framebuffer image(nx, ny);
+    thread_pool pool(options.threads);
+
+    render_progressive(image, pool, options, [&](int i, int j, uint32_t s) {
+        auto pixel = j*nx + i;
+        rng gen(pixel, s, 0);
+        auto u = (i + random_double(gen)) / nx;
+        auto v = (j + random_double(gen)) / ny;
+        ray r = cam->get_ray(u, v, gen);
+        return ray_color(r, world, &hlist, max_depth, pixel, s);
+    });
+
+    // Image files named on the command line (.ppm, .png, .hdr), or a PPM on standard output.
+    if (!write_images(image, options.output_files))
+        return 1;
+    if (options.bvh_stats_file && !write_bvh_report(world, options.bvh_stats_file))
+        return 1;
 
+    print_traversal_stats(std::cerr);
     std::cerr << "\nDone.\n";
 }
@@ -52,7 +52,7 @@ struct scatter_record
 class material  {
     public:
         virtual bool scatter(
-            const ray& r_in, const hit_record& hrec, scatter_record& srec
+            const ray& r_in, const hit_record& hrec, scatter_record& srec, rng& gen
         ) const {
             return false;
         }
@@ -74,7 +74,7 @@ class dielectric : public material {
     public:
         dielectric(double ri) : ref_idx(ri) {}
         virtual bool scatter(
-            const ray& r_in, const hit_record& hrec, scatter_record& srec
+            const ray& r_in, const hit_record& hrec, scatter_record& srec, rng& gen
         ) const {
             srec.is_specular = true;
             srec.pdf_ptr = 0;
@@ -102,7 +102,7 @@ class dielectric : public material {
             else {
                reflect_prob = 1.0;
             }
-            if (random_double() < reflect_prob) {
+            if (random_double(gen) < reflect_prob) {
                srec.specular_ray = ray(hrec.p, reflected);
             }
             else {
@@ -120,10 +120,10 @@ class metal : public material {
         metal(const vec3& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& hrec, scatter_record& srec
+            const ray& r_in, const hit_record& hrec, scatter_record& srec, rng& gen
         ) const {
             vec3 reflected = reflect(unit_vector(r_in.direction()), hrec.normal);
-            srec.specular_ray = ray(hrec.p, reflected + fuzz*random_in_unit_sphere());
+            srec.specular_ray = ray(hrec.p, reflected + fuzz*random_in_unit_sphere(gen));
             srec.attenuation = albedo;
             srec.is_specular = true;
             srec.pdf_ptr = 0;
@@ -148,7 +148,9 @@ class lambertian : public material {
             return cosine / pi;
         }
 
-        bool scatter(const ray& r_in, const hit_record& hrec, scatter_record& srec) const {
+        bool scatter(
+            const ray& r_in, const hit_record& hrec, scatter_record& srec, rng& gen
+        ) const {
             srec.is_specular = false;
             srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.p);
             srec.pdf_ptr = new cosine_pdf(hrec.normal);
@@ -175,21 +177,24 @@ class diffuse_light : public material  {
 };
 
 
-#if 0
+// Scatters uniformly in all directions. There is no pdf to mix light sampling into, so the
+// scattered ray is handed back as if it were specular.
 class isotropic : public material {
     public:
         isotropic(texture *a) : albedo(a) {}
+
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered
-        ) const  {
-            scattered = ray(rec.p, random_in_unit_sphere());
-            attenuation = albedo->value(rec.u, rec.v, rec.p);
+            const ray& r_in, const hit_record& hrec, scatter_record& srec, rng& gen
+        ) const {
+            srec.specular_ray = ray(hrec.p, random_in_unit_sphere(gen), r_in.time());
+            srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.p);
+            srec.is_specular = true;
+            srec.pdf_ptr = 0;
             return true;
         }
 
         texture *albedo;
 };
-#endif
 
 
 #if 0
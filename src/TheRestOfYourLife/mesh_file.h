@@ -0,0 +1,291 @@
+#ifndef MESH_FILE_H
+#define MESH_FILE_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "bvh_cache.h"
+#include "flat_bvh.h"
+#include "triangle_mesh.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+// Meshes saved in the layout mesh_buffers reads, so that they are used where they are mapped
+// instead of being parsed and copied. After the header, each array starts on a 64-byte
+// boundary: positions, then normals and texture coordinates if the mesh has them, indices, and
+// the nodes of a flat_bvh over the triangles if one was saved. The triangles are then stored in
+// the order its leaves take them, and a triangle_mesh over the buffers walks the saved tree
+// rather than building one. As with the BVH cache (see bvh_cache.h), the layout is the writing
+// machine's own, and files are written under a temporary name and renamed into place.
+//
+// source_key is for files made from another, such as the ones mesh_loader.h keeps: it says which
+// version of the source file this was made from, and is 0 otherwise.
+
+struct mesh_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t num_vertices;
+    uint32_t num_triangles;
+    uint32_t num_nodes;     // 0 without a tree
+    uint32_t node_size;
+    uint64_t source_key;
+    uint64_t positions_offset;
+    uint64_t normals_offset;
+    uint64_t uvs_offset;
+    uint64_t indices_offset;
+    uint64_t nodes_offset;
+    double bounds[6];       // of the vertices, min then max
+};
+
+const char mesh_file_magic[8] = {'r', 't', 'w', 'm', 'e', 's', 'h', 0};
+const uint32_t mesh_file_version = 1;
+const uint32_t mesh_file_normals = 1;
+const uint32_t mesh_file_uvs = 2;
+
+// Mesh buffers that point into a mesh file. The file is mapped read-only, or read into memory
+// where there is no mmap, and let go of when the buffers are deleted.
+class mapped_mesh : public mesh_buffers {
+    public:
+        mapped_mesh(void *address, size_t length, void *storage)
+          : address(address), length(length), storage(storage) {}
+        ~mapped_mesh() {
+#if defined(RTW_BVH_CACHE_MMAP)
+            if (!storage)
+                munmap(address, length);
+#endif
+            std::free(storage);
+        }
+
+        const mesh_file_header& header() const {
+            return *static_cast<const mesh_file_header*>(address);
+        }
+
+        aabb bounds() const {
+            const double *b = header().bounds;
+            return aabb(vec3(b[0], b[1], b[2]), vec3(b[3], b[4], b[5]));
+        }
+
+    private:
+        void *address;
+        size_t length;
+        void *storage;      // the copy of the file, if it was read rather than mapped
+};
+
+inline uint64_t mesh_file_align(uint64_t offset) {
+    return (offset + bvh_cache_alignment - 1) / bvh_cache_alignment * bvh_cache_alignment;
+}
+
+// Whether the section [offset, offset + size) lies inside a file of this length, aligned. Empty
+// sections are not written, and may lie past the end.
+inline bool mesh_file_section(uint64_t offset, uint64_t size, uint64_t length) {
+    return size == 0
+        || (offset % bvh_cache_alignment == 0 && offset <= length && size <= length - offset);
+}
+
+// Points the mesh at the arrays of its file, if the header describes a complete mesh file whose
+// indices refer only to vertices it has, and whose tree can be walked as triangle_mesh walks it.
+bool mesh_file_attach(mapped_mesh& mesh, size_t length) {
+    const mesh_file_header& h = mesh.header();
+    const char *base = reinterpret_cast<const char*>(&h);
+    uint64_t nv = h.num_vertices, nt = h.num_triangles;
+    bool normals = (h.flags & mesh_file_normals) != 0;
+    bool uvs = (h.flags & mesh_file_uvs) != 0;
+
+    bool valid =
+        std::memcmp(h.magic, mesh_file_magic, sizeof h.magic) == 0
+        && h.version == mesh_file_version && nv <= INT32_MAX && nt <= INT32_MAX
+        && h.num_nodes <= INT32_MAX
+        && (h.num_nodes == 0 || h.node_size == sizeof(flat_bvh_node))
+        && mesh_file_section(h.positions_offset, 3 * nv * sizeof(float), length)
+        && (!normals || mesh_file_section(h.normals_offset, 3 * nv * sizeof(float), length))
+        && (!uvs || mesh_file_section(h.uvs_offset, 2 * nv * sizeof(float), length))
+        && mesh_file_section(h.indices_offset, 3 * nt * sizeof(uint32_t), length)
+        && mesh_file_section(h.nodes_offset, h.num_nodes * sizeof(flat_bvh_node), length);
+    if (!valid)
+        return false;
+
+    mesh.positions = reinterpret_cast<const float*>(base + h.positions_offset);
+    mesh.normals = normals ? reinterpret_cast<const float*>(base + h.normals_offset) : 0;
+    mesh.uvs = uvs ? reinterpret_cast<const float*>(base + h.uvs_offset) : 0;
+    mesh.indices = reinterpret_cast<const uint32_t*>(base + h.indices_offset);
+    mesh.num_vertices = static_cast<int>(nv);
+    mesh.num_triangles = static_cast<int>(nt);
+    mesh.nodes = h.num_nodes ? reinterpret_cast<const flat_bvh_node*>(base + h.nodes_offset) : 0;
+    mesh.num_nodes = static_cast<int>(h.num_nodes);
+
+    for (uint64_t i = 0; i < 3*nt; i++) {
+        if (mesh.indices[i] >= nv)
+            return false;
+    }
+    // The tree is checked as a cached flat_bvh is, walking every path from the root, so that a
+    // child shared between parents is held to the depth of the deepest. Traversal also picks
+    // the nearer child by the split axis.
+    for (int i = 0; i < mesh.num_nodes; i++) {
+        if (!mesh.nodes[i].is_leaf() && mesh.nodes[i].axis > 2)
+            return false;
+    }
+    return mesh.num_nodes == 0
+           || flat_bvh_nodes_valid(mesh.nodes, mesh.num_nodes, static_cast<int>(nt));
+}
+
+// Opens the mesh file at path, mapping it where there is mmap. Returns null if there is no such
+// file or it is not a mesh file of this version and this machine's layout, with a message in the
+// second case. Given a source_key, it also returns null for a file made from another version of
+// the source, and says nothing if the file is not valid: it is a cache, to be written again.
+mapped_mesh *map_mesh_file(const std::string& path, uint64_t source_key = 0) {
+    void *address = 0;
+    size_t length = 0;
+    void *storage = 0;
+#if defined(RTW_BVH_CACHE_MMAP)
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat status;
+    address = MAP_FAILED;
+    if (fstat(fd, &status) == 0 && status.st_size >= off_t(sizeof(mesh_file_header))) {
+        length = size_t(status.st_size);
+        address = mmap(0, length, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (address == MAP_FAILED) {
+        std::cerr << "Could not map " << path << '\n';
+        return 0;
+    }
+#else
+    FILE *file = std::fopen(path.c_str(), "rb");
+    if (!file)
+        return 0;
+    std::fseek(file, 0, SEEK_END);
+    long size = std::ftell(file);
+    std::fseek(file, 0, SEEK_SET);
+    if (size >= long(sizeof(mesh_file_header))) {
+        length = size_t(size);
+        storage = std::malloc(length + bvh_cache_alignment);
+    }
+    if (storage) {
+        auto aligned = (reinterpret_cast<uintptr_t>(storage) + bvh_cache_alignment - 1)
+                     & ~uintptr_t(bvh_cache_alignment - 1);
+        address = reinterpret_cast<void*>(aligned);
+    }
+    bool read = storage && std::fread(address, 1, length, file) == length;
+    std::fclose(file);
+    if (!read) {
+        std::free(storage);
+        std::cerr << "Could not read " << path << '\n';
+        return 0;
+    }
+#endif
+
+    auto mesh = new mapped_mesh(address, length, storage);
+    if (mesh_file_attach(*mesh, length)
+        && (source_key == 0 || mesh->header().source_key == source_key))
+        return mesh;
+    if (source_key == 0)
+        std::cerr << path << " is not a mesh file this program can read\n";
+    delete mesh;
+    return 0;
+}
+
+// Saves the buffers as a mesh file at path, and the tree if there is one: tree is a flat_bvh over
+// the buffers' triangles, made as triangle_mesh makes its own, and the triangles are written in
+// its leaf order. Buffers that already hold a tree are saved with it. Returns false, with a
+// message, if the file could not be written.
+bool write_mesh_file(
+    const std::string& path, const mesh_buffers& buffers, const flat_bvh *tree,
+    uint64_t source_key = 0
+) {
+    const flat_bvh_node *nodes = tree ? tree->nodes : buffers.nodes;
+    int num_nodes = tree ? tree->num_nodes : buffers.num_nodes;
+    uint64_t nv = buffers.num_vertices, nt = buffers.num_triangles;
+    if (nt == 0)
+        num_nodes = 0;
+
+    mesh_file_header h;
+    std::memset(&h, 0, sizeof h);
+    std::memcpy(h.magic, mesh_file_magic, sizeof h.magic);
+    h.version = mesh_file_version;
+    h.flags = (buffers.normals ? mesh_file_normals : 0) | (buffers.uvs ? mesh_file_uvs : 0);
+    h.num_vertices = static_cast<uint32_t>(nv);
+    h.num_triangles = static_cast<uint32_t>(nt);
+    h.num_nodes = num_nodes;
+    h.node_size = sizeof(flat_bvh_node);
+    h.source_key = source_key;
+    h.positions_offset = mesh_file_align(sizeof h);
+    h.normals_offset = mesh_file_align(h.positions_offset + 3 * nv * sizeof(float));
+    h.uvs_offset = mesh_file_align(
+        h.normals_offset + (buffers.normals ? 3 * nv * sizeof(float) : 0));
+    h.indices_offset = mesh_file_align(h.uvs_offset + (buffers.uvs ? 2 * nv * sizeof(float) : 0));
+    h.nodes_offset = mesh_file_align(h.indices_offset + 3 * nt * sizeof(uint32_t));
+    for (int a = 0; a < 3; a++) {
+        h.bounds[a] = nv ? INFINITY : 0;
+        h.bounds[3+a] = nv ? -INFINITY : 0;
+    }
+    for (uint64_t i = 0; i < nv; i++) {
+        for (int a = 0; a < 3; a++) {
+            h.bounds[a] = ffmin(h.bounds[a], buffers.positions[3*i + a]);
+            h.bounds[3+a] = ffmax(h.bounds[3+a], buffers.positions[3*i + a]);
+        }
+    }
+
+    const uint32_t *indices = buffers.indices;
+    std::vector<uint32_t> reordered;
+    if (tree && nt > 0) {
+        reordered.resize(3*nt);
+        for (uint64_t i = 0; i < nt; i++)
+            std::memcpy(&reordered[3*i], &buffers.indices[3*tree->order[i]], 3*sizeof(uint32_t));
+        indices = reordered.data();
+    }
+
+    auto temporary = path + ".tmp";
+#if defined(RTW_BVH_CACHE_MMAP)
+    temporary = path + "." + std::to_string(getpid());
+#endif
+    FILE *file = std::fopen(temporary.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Could not write " << path << '\n';
+        return false;
+    }
+    uint64_t position = 0;
+    bool written = true;
+    // Pads to offset, then writes size bytes from data.
+    auto section = [&](uint64_t offset, const void *data, uint64_t size) {
+        static const char padding[bvh_cache_alignment] = {0};
+        if (size == 0 || !written)
+            return;
+        written = offset - position <= bvh_cache_alignment
+               && (offset == position
+                   || std::fwrite(padding, size_t(offset - position), 1, file) == 1)
+               && std::fwrite(data, size_t(size), 1, file) == 1;
+        position = offset + size;
+    };
+    section(0, &h, sizeof h);
+    section(h.positions_offset, buffers.positions, 3 * nv * sizeof(float));
+    if (buffers.normals)
+        section(h.normals_offset, buffers.normals, 3 * nv * sizeof(float));
+    if (buffers.uvs)
+        section(h.uvs_offset, buffers.uvs, 2 * nv * sizeof(float));
+    section(h.indices_offset, indices, 3 * nt * sizeof(uint32_t));
+    section(h.nodes_offset, nodes, uint64_t(num_nodes) * sizeof(flat_bvh_node));
+    written = std::fclose(file) == 0 && written;
+    if (written && std::rename(temporary.c_str(), path.c_str()) == 0)
+        return true;
+    std::remove(temporary.c_str());
+    std::cerr << "Could not write " << path << '\n';
+    return false;
+}
+
+#endif
@@ -0,0 +1,280 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "common/traversal_stats.h"
+#include "flat_bvh.h"
+#include "hittable.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+
+// One node of a motion_bvh: a flat_bvh_node with two boxes, bounding the subtree at the start
+// and at the end of its time segment.
+struct alignas(64) motion_bvh_node {
+    float bounds_min[2][3];
+    float bounds_max[2][3];
+    uint32_t offset;
+    uint16_t count;     // 0 for interior nodes
+    uint8_t axis;
+    uint8_t pad;
+
+    bool is_leaf() const { return count > 0; }
+};
+
+// The slab test against a node's boxes interpolated to `s`, the ray's time as a fraction of the
+// node's time segment.
+inline bool motion_bvh_node_hit(
+    const motion_bvh_node& node, const ray_query& q, double s, double t_min, double t_max
+) {
+    for (int a = 0; a < 3; a++) {
+        double low = node.bounds_min[0][a] + s * (node.bounds_min[1][a] - node.bounds_min[0][a]);
+        double high = node.bounds_max[0][a] + s * (node.bounds_max[1][a] - node.bounds_max[0][a]);
+        auto t0 = ((q.sign[a] ? high : low) - q.origin[a]) * q.inv_dir[a];
+        auto t1 = ((q.sign[a] ? low : high) - q.origin[a]) * q.inv_dir[a];
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+    }
+    return t_min < t_max;
+}
+
+// A BVH for scenes that move. A bounding_box over the whole shutter grows with how far each
+// primitive travels, so the boxes of a flat_bvh over moving primitives overlap, and rays enter
+// far more of them than they would if the scene stood still. Each node here instead keeps the
+// boxes of its subtree at the start and the end of the shutter, and a ray tests the box
+// interpolated to its own time. The tree is built over the primitives' boxes at mid-shutter.
+//
+// Interpolating the boxes is exact for primitives that move in a straight line at a steady
+// speed, as moving_sphere does, and for anything made of them; primitives whose bounding_box
+// doesn't depend on time are covered by their whole-shutter box.
+//
+// With time_segments above one, the shutter is split into that many equal intervals, each with
+// its own tree, and rays take the tree for their time: the remedy for motion long enough that
+// the boxes at the two ends of the shutter are still far apart. Rays are expected to fall inside
+// [time0, time1]; times outside it are treated as the nearest end.
+class motion_bvh : public hittable {
+    public:
+        motion_bvh(
+            hittable **l, int n, double time0, double time1,
+            const bvh_build_options& options = bvh_build_options(), int time_segments = 1
+        );
+        ~motion_bvh() {
+            for (const auto& segment : segments) {
+                std::free(segment.storage);
+                delete[] segment.prims;
+            }
+        }
+
+        virtual bool find_hit(
+            const ray& r, double tmin, double tmax, hit_record& rec, rng& gen
+        ) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax, rng& gen) const;
+        virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
+            output_box = box;
+            return true;
+        }
+
+        struct segment {
+            motion_bvh_node *nodes;
+            int num_nodes;
+            hittable **prims;
+            int num_prims;      // references in prims, more than the tree's after spatial splits
+            void *storage;
+        };
+
+        std::vector<segment> segments;
+        int num_prims;          // primitives the tree was built over
+        double time0, time1;
+        aabb box;
+
+    private:
+        motion_bvh(const motion_bvh&);
+        motion_bvh& operator=(const motion_bvh&);
+
+        // The segment a ray's time falls in, and where in it as a fraction.
+        const segment& segment_at(double time, double& s) const {
+            int count = static_cast<int>(segments.size());
+            auto x = (time - time0) / (time1 - time0) * count;
+            x = x > 0 ? x : 0;
+            x = x < count ? x : count;
+            int k = static_cast<int>(x);
+            k = k < count ? k : count - 1;
+            s = x - k;
+            return segments[k];
+        }
+
+        static motion_bvh_node *allocate_nodes(int count, void *&storage);
+};
+
+
+motion_bvh::motion_bvh(
+    hittable **l, int n, double time0, double time1, const bvh_build_options& options,
+    int time_segments
+) : num_prims(n), time0(time0), time1(time1), box(vec3(0,0,0), vec3(0,0,0))
+{
+    if (time_segments < 1 || time1 <= time0)
+        time_segments = 1;
+    bvh_build_options binary_options = options;
+    binary_options.cache_directory = 0;
+
+    for (int k = 0; k < time_segments; k++) {
+        double start = time0 + (time1 - time0) * k / time_segments;
+        double end = time0 + (time1 - time0) * (k+1) / time_segments;
+        double middle = 0.5 * (start + end);
+
+        // Take the shape of the tree from a flat_bvh over the boxes at mid-segment, then fit
+        // the boxes at either end bottom-up. Children follow their parents in the array.
+        flat_bvh binary(l, n, middle, middle, binary_options);
+        segment seg;
+        seg.num_nodes = binary.num_nodes;
+        seg.nodes = allocate_nodes(binary.num_nodes, seg.storage);
+        seg.num_prims = binary.num_prims;
+        seg.prims = new hittable*[binary.num_prims > 0 ? binary.num_prims : 1];
+        std::copy(binary.prims, binary.prims + binary.num_prims, seg.prims);
+
+        for (int i = binary.num_nodes - 1; i >= 0; i--) {
+            const flat_bvh_node& b = binary.nodes[i];
+            motion_bvh_node& node = seg.nodes[i];
+            node.offset = b.offset;
+            node.count = b.count;
+            node.axis = b.axis;
+            node.pad = 0;
+            for (int e = 0; e < 2; e++) {
+                aabb bounds;
+                if (n == 0) {
+                    bounds = aabb(vec3(0,0,0), vec3(0,0,0));
+                }
+                else if (b.is_leaf()) {
+                    for (int p = b.offset; p < int(b.offset + b.count); p++) {
+                        aabb prim_box;
+                        seg.prims[p]->bounding_box(e ? end : start, e ? end : start, prim_box);
+                        bounds = p == int(b.offset) ? prim_box : surrounding_box(bounds, prim_box);
+                    }
+                }
+                else {
+                    const motion_bvh_node& c0 = seg.nodes[i+1];
+                    const motion_bvh_node& c1 = seg.nodes[b.offset];
+                    bounds = aabb(
+                        vec3(ffmin(c0.bounds_min[e][0], c1.bounds_min[e][0]),
+                             ffmin(c0.bounds_min[e][1], c1.bounds_min[e][1]),
+                             ffmin(c0.bounds_min[e][2], c1.bounds_min[e][2])),
+                        vec3(ffmax(c0.bounds_max[e][0], c1.bounds_max[e][0]),
+                             ffmax(c0.bounds_max[e][1], c1.bounds_max[e][1]),
+                             ffmax(c0.bounds_max[e][2], c1.bounds_max[e][2])));
+                }
+                for (int a = 0; a < 3; a++) {
+                    node.bounds_min[e][a] = float_down(bounds.min()[a]);
+                    node.bounds_max[e][a] = float_up(bounds.max()[a]);
+                }
+                // Every primitive moves in a straight line, so the roots' boxes at the ends of
+                // the segments bound the whole shutter.
+                if (i == 0 && n > 0)
+                    box = k == 0 && e == 0 ? bounds : surrounding_box(box, bounds);
+            }
+        }
+        segments.push_back(seg);
+    }
+}
+
+motion_bvh_node *motion_bvh::allocate_nodes(int count, void *&storage) {
+    const uintptr_t alignment = alignof(motion_bvh_node);
+    storage = std::malloc(count * sizeof(motion_bvh_node) + alignment - 1);
+    auto address = (reinterpret_cast<uintptr_t>(storage) + alignment - 1) & ~(alignment - 1);
+    return reinterpret_cast<motion_bvh_node*>(address);
+}
+
+bool motion_bvh::find_hit(
+    const ray& r, double t_min, double t_max, hit_record& rec, rng& gen
+) const {
+    if (num_prims == 0)
+        return false;
+    double s;
+    const segment& seg = segment_at(r.time(), s);
+    ray_query q(r);
+
+    bool hit_anything = false;
+    double closest_so_far = t_max;
+    int stack[flat_bvh::max_depth];
+    int stack_size = 0;
+    int current = 0;
+
+    for (;;) {
+        count_node_visit();
+        const motion_bvh_node& node = seg.nodes[current];
+        if (motion_bvh_node_hit(node, q, s, t_min, closest_so_far)) {
+            if (node.is_leaf()) {
+                hit_record temp_rec;
+                for (int i = node.offset; i < int(node.offset + node.count); i++) {
+                    count_primitive_test();
+                    if (seg.prims[i]->find_hit(r, t_min, closest_so_far, temp_rec, gen)) {
+                        hit_anything = true;
+                        closest_so_far = temp_rec.t;
+                        rec = temp_rec;
+                    }
+                }
+            }
+            else {
+                if (q.sign[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                }
+                else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+
+    return hit_anything;
+}
+
+bool motion_bvh::occluded(const ray& r, double t_min, double t_max, rng& gen) const {
+    if (num_prims == 0)
+        return false;
+    double s;
+    const segment& seg = segment_at(r.time(), s);
+    ray_query q(r);
+
+    int stack[flat_bvh::max_depth];
+    int stack_size = 0;
+    int current = 0;
+
+    for (;;) {
+        count_node_visit();
+        const motion_bvh_node& node = seg.nodes[current];
+        if (motion_bvh_node_hit(node, q, s, t_min, t_max)) {
+            if (node.is_leaf()) {
+                for (int i = node.offset; i < int(node.offset + node.count); i++) {
+                    count_primitive_test();
+                    if (seg.prims[i]->occluded(r, t_min, t_max, gen))
+                        return true;
+                }
+            }
+            else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            return false;
+        current = stack[--stack_size];
+    }
+}
+
+#endif
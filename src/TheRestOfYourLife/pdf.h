@@ -15,9 +15,9 @@
 #include "onb.h"
 
 
-inline vec3 random_cosine_direction() {
-    auto r1 = random_double();
-    auto r2 = random_double();
+inline vec3 random_cosine_direction(rng& gen) {
+    auto r1 = random_double(gen);
+    auto r2 = random_double(gen);
     auto z = sqrt(1-r2);
     auto phi = 2*pi*r1;
     auto x = cos(phi)*sqrt(r2);
@@ -25,9 +25,9 @@ inline vec3 random_cosine_direction() {
     return vec3(x, y, z);
 }
 
-inline vec3 random_to_sphere(double radius, double distance_squared) {
-    auto r1 = random_double();
-    auto r2 = random_double();
+inline vec3 random_to_sphere(double radius, double distance_squared, rng& gen) {
+    auto r1 = random_double(gen);
+    auto r2 = random_double(gen);
     auto z = 1 + r2*(sqrt(1-radius*radius/distance_squared) - 1);
     auto phi = 2*pi*r1;
     auto x = cos(phi)*sqrt(1-z*z);
@@ -35,10 +35,10 @@ inline vec3 random_to_sphere(double radius, double distance_squared) {
     return vec3(x, y, z);
 }
 
-vec3 random_in_unit_sphere() {
+vec3 random_in_unit_sphere(rng& gen) {
     vec3 p;
     do {
-        p = 2*vec3(random_double(),random_double(),random_double()) - vec3(1,1,1);
+        p = 2*vec3(random_double(gen),random_double(gen),random_double(gen)) - vec3(1,1,1);
     } while (p.squared_length() >= 1);
     return p;
 }
@@ -46,7 +46,7 @@ vec3 random_in_unit_sphere() {
 class pdf  {
     public:
         virtual double value(const vec3& direction) const = 0;
-        virtual vec3 generate() const = 0;
+        virtual vec3 generate(rng& gen) const = 0;
         virtual ~pdf() {}
 };
 
@@ -60,8 +60,8 @@ class cosine_pdf : public pdf {
             else
                 return 0;
         }
-        virtual vec3 generate() const  {
-            return uvw.local(random_cosine_direction());
+        virtual vec3 generate(rng& gen) const  {
+            return uvw.local(random_cosine_direction(gen));
         }
         onb uvw;
 };
@@ -72,8 +72,8 @@ class hittable_pdf : public pdf {
         virtual double value(const vec3& direction) const {
             return ptr->pdf_value(o, direction);
         }
-        virtual vec3 generate() const {
-            return ptr->random(o);
+        virtual vec3 generate(rng& gen) const {
+            return ptr->random(o, gen);
         }
         vec3 o;
         hittable *ptr;
@@ -85,11 +85,11 @@ class mixture_pdf : public pdf {
         virtual double value(const vec3& direction) const {
             return 0.5 * p[0]->value(direction) + 0.5 *p[1]->value(direction);
         }
-        virtual vec3 generate() const {
-            if (random_double() < 0.5)
-                return p[0]->generate();
+        virtual vec3 generate(rng& gen) const {
+            if (random_double(gen) < 0.5)
+                return p[0]->generate(gen);
             else
-                return p[1]->generate();
+                return p[1]->generate(gen);
         }
         pdf *p[2];
 };
@@ -0,0 +1,95 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/framebuffer.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+
+// A checkpoint is the framebuffer as it is in memory, in native byte order:
+//
+//     char     magic[8]       "RTWCKPT\0"
+//     uint32_t version
+//     uint32_t width, height
+//     float    pixels[3*width*height]     color sums
+//     uint32_t samples[width*height]      sample counts
+//     float    luminance_m2[width*height] luminance sums of squared differences
+//
+// Sample s of a pixel always draws from the generators addressed by (pixel, s), so the sample
+// counts double as the position of every pixel's random number sequence.
+
+const char checkpoint_magic[8] = { 'R','T','W','C','K','P','T','\0' };
+const uint32_t checkpoint_version = 2;
+
+// Writes to a temporary file first and renames it into place, so that a job killed mid-write
+// leaves the previous checkpoint intact.
+inline bool save_checkpoint(const framebuffer& image, const char *filename) {
+    std::string temp = std::string(filename) + ".tmp";
+    {
+        std::ofstream out(temp.c_str(), std::ios::binary);
+        uint32_t header[3] = {
+            checkpoint_version,
+            static_cast<uint32_t>(image.width),
+            static_cast<uint32_t>(image.height)
+        };
+        out.write(checkpoint_magic, sizeof checkpoint_magic);
+        out.write(reinterpret_cast<const char*>(header), sizeof header);
+        out.write(reinterpret_cast<const char*>(image.pixels.data()),
+                  image.pixels.size() * sizeof(float));
+        out.write(reinterpret_cast<const char*>(image.samples.data()),
+                  image.samples.size() * sizeof(uint32_t));
+        out.write(reinterpret_cast<const char*>(image.luminance_m2.data()),
+                  image.luminance_m2.size() * sizeof(float));
+        if (!out)
+            return false;
+    }
+
+    std::remove(filename);
+    return std::rename(temp.c_str(), filename) == 0;
+}
+
+// Returns false, leaving the image untouched, if the file is missing or was written for an
+// image of another size.
+inline bool load_checkpoint(framebuffer& image, const char *filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+        return false;
+
+    char magic[sizeof checkpoint_magic];
+    uint32_t header[3];
+    in.read(magic, sizeof magic);
+    in.read(reinterpret_cast<char*>(header), sizeof header);
+    if (!in
+        || std::char_traits<char>::compare(magic, checkpoint_magic, sizeof magic) != 0
+        || header[0] != checkpoint_version
+        || header[1] != static_cast<uint32_t>(image.width)
+        || header[2] != static_cast<uint32_t>(image.height)
+    )
+        return false;
+
+    framebuffer loaded(image.width, image.height);
+    in.read(reinterpret_cast<char*>(loaded.pixels.data()),
+            loaded.pixels.size() * sizeof(float));
+    in.read(reinterpret_cast<char*>(loaded.samples.data()),
+            loaded.samples.size() * sizeof(uint32_t));
+    in.read(reinterpret_cast<char*>(loaded.luminance_m2.data()),
+            loaded.luminance_m2.size() * sizeof(float));
+    if (!in)
+        return false;
+
+    image = loaded;
+    return true;
+}
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+
+#include <cstdint>
+#include <vector>
+
+
+// Accumulates linear RGB color sums, the number of samples behind each one, and the running
+// variance of their luminance (for adaptive sampling). Pixels are addressed like the camera
+// addresses them, with j counting rows from the bottom, but are stored top row first so the
+// buffers can be written out as they are.
+
+class framebuffer {
+    public:
+        framebuffer(int w, int h)
+          : width(w), height(h), pixels(3*w*h, 0.0f), samples(w*h, 0), luminance_m2(w*h, 0.0f) {}
+
+        size_t index(int i, int j) const {
+            return static_cast<size_t>(height-1 - j) * width + i;
+        }
+
+        // The sum of all samples taken so far.
+        vec3 pixel(int i, int j) const {
+            auto p = &pixels[3*index(i, j)];
+            return vec3(p[0], p[1], p[2]);
+        }
+
+        // Also the index of the pixel's next sample, which is all it takes to pick up its random
+        // number sequence where it left off.
+        uint32_t sample_count(int i, int j) const {
+            return samples[index(i, j)];
+        }
+
+        // The sample variance of the pixel's luminance, from Welford's running sum of squared
+        // differences. Infinite until there are two samples.
+        double luminance_variance(size_t k) const {
+            if (samples[k] < 2)
+                return infinity;
+            return luminance_m2[k] / (samples[k] - 1);
+        }
+
+        double mean_luminance(size_t k) const {
+            if (samples[k] == 0)
+                return 0;
+            auto p = &pixels[3*k];
+            return luminance(vec3(p[0], p[1], p[2])) / samples[k];
+        }
+
+        void add_samples(int i, int j, const vec3& color_sum, uint32_t count, double m2) {
+            auto k = index(i, j);
+            auto p = &pixels[3*k];
+            p[0] += static_cast<float>(color_sum.x());
+            p[1] += static_cast<float>(color_sum.y());
+            p[2] += static_cast<float>(color_sum.z());
+            samples[k] += count;
+            luminance_m2[k] = static_cast<float>(m2);
+        }
+
+        static double luminance(const vec3& c) {
+            return 0.2126*c.x() + 0.7152*c.y() + 0.0722*c.z();
+        }
+
+        int width;
+        int height;
+        std::vector<float> pixels;
+        std::vector<uint32_t> samples;
+        std::vector<float> luminance_m2;
+};
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "common/framebuffer.h"
+#include "common/rtw_stb_image_write.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define RTW_IMAGE_WRITER_SSE2
+    #include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+    #include <fcntl.h>
+    #include <io.h>
+#endif
+
+
+// Turns the framebuffer's color sums into the two buffers the output formats need, in a single
+// pass: each pixel's linear average color with NaNs replaced by zero (for HDR output), and its
+// gamma 2 corrected [0,255] value (for PPM and PNG). Matches vec3::write_color.
+inline void encode_image(
+    const framebuffer& image, std::vector<float>& linear, std::vector<unsigned char>& bytes
+) {
+    auto num_pixels = image.samples.size();
+    linear.resize(3*num_pixels);
+    bytes.resize(3*num_pixels);
+
+    const float *src = image.pixels.data();
+    const uint32_t *count = image.samples.data();
+    float *lin = linear.data();
+    unsigned char *out = bytes.data();
+    size_t k = 0;
+
+#ifdef RTW_IMAGE_WRITER_SSE2
+    auto zero = _mm_setzero_ps();
+    auto one = _mm_set1_ps(1.0f);
+    auto max_byte = _mm_set1_ps(255.999f);
+
+    // Four pixels (twelve channels, three vectors) per iteration. Pixels without samples get an
+    // infinite scale, and 0*inf is a NaN that is then cleared like any other.
+    for (; k + 4 <= num_pixels; k += 4) {
+        auto n = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(count + k)));
+        auto scale = _mm_div_ps(one, n);
+        __m128 scales[3] = {
+            _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(1,0,0,0)),
+            _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(2,2,1,1)),
+            _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(3,3,3,2))
+        };
+
+        __m128i q[3];
+        for (int b = 0; b < 3; b++) {
+            // max() returns its second operand when either one is NaN, so NaNs become zero.
+            auto c = _mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src + 3*k + 4*b), scales[b]), zero);
+            _mm_storeu_ps(lin + 3*k + 4*b, c);
+            auto g = _mm_min_ps(_mm_sqrt_ps(c), one);
+            q[b] = _mm_cvttps_epi32(_mm_mul_ps(g, max_byte));
+        }
+        auto packed = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[2]));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + 3*k), packed);
+        auto last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+        std::memcpy(out + 3*k + 8, &last, 4);
+    }
+#endif
+
+    for (; k < num_pixels; k++) {
+        auto scale = 1.0f / count[k];
+        for (int c = 0; c < 3; c++) {
+            auto v = src[3*k + c] * scale;
+            if (!(v > 0.0f)) v = 0.0f;
+            lin[3*k + c] = v;
+            out[3*k + c] = static_cast<unsigned char>(255.999f * std::min(std::sqrt(v), 1.0f));
+        }
+    }
+}
+
+inline void write_ppm(std::ostream& out, int width, int height, const unsigned char *bytes) {
+    out << "P6\n" << width << ' ' << height << "\n255\n";
+    out.write(reinterpret_cast<const char*>(bytes), 3*static_cast<std::streamsize>(width)*height);
+}
+
+inline bool has_extension(const char *filename, const char *ext) {
+    auto n = std::strlen(filename);
+    auto m = std::strlen(ext);
+    if (n < m)
+        return false;
+    for (size_t i = 0; i < m; i++)
+        if (std::tolower(filename[n-m+i]) != ext[i])
+            return false;
+    return true;
+}
+
+// Writes the image to every named file, choosing the format from the extension: .ppm (binary
+// P6), .png or .hdr (Radiance RGBE, linear). With no file names, writes P6 to standard output.
+// Returns false if any file could not be written.
+inline bool write_images(const framebuffer& image, const std::vector<const char*>& filenames) {
+    std::vector<float> linear;
+    std::vector<unsigned char> bytes;
+    encode_image(image, linear, bytes);
+
+    auto w = image.width;
+    auto h = image.height;
+
+    if (filenames.empty()) {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        write_ppm(std::cout, w, h, bytes.data());
+        std::cout.flush();
+        return bool(std::cout);
+    }
+
+    bool ok = true;
+    for (auto filename : filenames) {
+        bool written;
+        if (has_extension(filename, ".png")) {
+            written = stbi_write_png(filename, w, h, 3, bytes.data(), 3*w) != 0;
+        }
+        else if (has_extension(filename, ".hdr")) {
+            written = stbi_write_hdr(filename, w, h, 3, linear.data()) != 0;
+        }
+        else if (has_extension(filename, ".ppm")) {
+            std::ofstream out(filename, std::ios::binary);
+            write_ppm(out, w, h, bytes.data());
+            written = bool(out);
+        }
+        else {
+            std::cerr << "Unknown image format: " << filename << '\n';
+            written = false;
+        }
+
+        if (!written)
+            std::cerr << "Could not write " << filename << '\n';
+        ok = ok && written;
+    }
+    return ok;
+}
+
+#endif
@@ -1,11 +1,93 @@
 #ifndef RANDOM_H
 #define RANDOM_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
 
-#include <cstdlib>
+#include <cstdint>
 
 
+// Philox4x32-10 counter-based generator (Salmon et al., "Parallel Random Numbers: As Easy as
+// 1, 2, 3"). Scrambles a 128-bit counter under a 64-bit key; the result depends on nothing but
+// its inputs, so any counter can be evaluated on its own.
+
+inline void philox4x32(uint32_t ctr[4], uint32_t key0, uint32_t key1) {
+    for (int round = 0; round < 10; round++) {
+        auto p0 = static_cast<uint64_t>(0xD2511F53u) * ctr[0];
+        auto p1 = static_cast<uint64_t>(0xCD9E8D57u) * ctr[2];
+        uint32_t next[4] = {
+            static_cast<uint32_t>(p1 >> 32) ^ ctr[1] ^ key0,
+            static_cast<uint32_t>(p1),
+            static_cast<uint32_t>(p0 >> 32) ^ ctr[3] ^ key1,
+            static_cast<uint32_t>(p0)
+        };
+        for (int i = 0; i < 4; i++)
+            ctr[i] = next[i];
+        key0 += 0x9E3779B9u;
+        key1 += 0xBB67AE85u;
+    }
+}
+
+
+// PCG32 (XSH RR) stream generator, O'Neill, "PCG: A Family of Simple Fast Space-Efficient
+// Statistically Good Algorithms for Random Number Generation". Renderers keep one per bounce on
+// the stack and pass it down explicitly, so there is no shared state to lock.
+
+class rng {
+    public:
+        rng() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+        rng(uint64_t initstate, uint64_t stream) { seed(initstate, stream); }
+
+        // A generator addressed by (pixel, sample, dimension). Philox maps the address to the
+        // starting state and stream, so the draws for any one address can be reproduced without
+        // replaying the ones before it.
+        rng(uint32_t pixel, uint32_t sample, uint32_t dimension, uint64_t key = 0) {
+            uint32_t ctr[4] = { pixel, sample, dimension, 0 };
+            philox4x32(ctr, static_cast<uint32_t>(key), static_cast<uint32_t>(key >> 32));
+            seed((static_cast<uint64_t>(ctr[0]) << 32) | ctr[1],
+                 (static_cast<uint64_t>(ctr[2]) << 32) | ctr[3]);
+        }
+
+        uint32_t next_uint() {
+            auto old = state;
+            state = old * 6364136223846793005ULL + inc;
+            auto xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+            auto rot = static_cast<uint32_t>(old >> 59);
+            return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+        }
+
+        // Returns a double in [0,1).
+        double next_double() {
+            return next_uint() * (1.0 / 4294967296.0);
+        }
+
+    private:
+        void seed(uint64_t initstate, uint64_t stream) {
+            state = 0;
+            inc = (stream << 1) | 1;
+            next_uint();
+            state += initstate;
+            next_uint();
+        }
+
+        uint64_t state;
+        uint64_t inc;
+};
+
+
+inline double random_double(rng& gen) {
+    return gen.next_double();
+}
+
+// For scene setup and the small stand-alone programs. Each thread has its own generator.
 inline double random_double() {
-    return rand() / (RAND_MAX + 1.0);
+    thread_local rng gen;
+    return gen.next_double();
 }
 
 #endif
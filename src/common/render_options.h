@@ -0,0 +1,133 @@
+#ifndef RENDER_OPTIONS_H
+#define RENDER_OPTIONS_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+
+// Settings shared by the rendering programs. Each program sets its own defaults, then lets the
+// command line override them:
+//
+//     --spp N              samples per pixel to reach
+//     --pass N             samples per pixel added per progressive pass
+//     --threads N          worker threads (0 = one per hardware thread)
+//     --checkpoint FILE    resume from FILE if it exists, and save progress to it
+//     --interval SECONDS   minimum time between checkpoint saves
+//     --noise THRESHOLD    sample adaptively: stop on pixels whose estimated error is below
+//                          THRESHOLD (in display units, 1/255 is one 8-bit step), and spend the
+//                          --spp budget on the noisiest ones
+//     --bvh-cache DIR      keep built BVHs in DIR and load them from there on later runs
+//     --bvh-stats FILE     write the shape and quality of the scene's BVHs to FILE as JSON, and
+//                          the traversal counts of the render if the program keeps them
+//
+// Every other argument names an output image.
+
+struct render_options {
+    render_options(int spp)
+      : samples_per_pixel(spp), samples_per_pass(spp >= 10 ? spp/10 : 1), threads(0),
+        checkpoint_file(0), checkpoint_interval(60), noise_threshold(0), bvh_cache_directory(0),
+        bvh_stats_file(0) {}
+
+    bool parse(int argc, char *argv[]) {
+        for (int i = 1; i < argc; i++) {
+            const char *arg = argv[i];
+            if (std::strncmp(arg, "--", 2) != 0) {
+                output_files.push_back(arg);
+                continue;
+            }
+
+            if (i+1 >= argc) {
+                std::cerr << "Missing value for " << arg << '\n';
+                return false;
+            }
+            const char *value = argv[++i];
+
+            if (std::strcmp(arg, "--spp") == 0) {
+                if (!parse_count(arg, value, 1, samples_per_pixel))
+                    return false;
+            }
+            else if (std::strcmp(arg, "--pass") == 0) {
+                if (!parse_count(arg, value, 1, samples_per_pass))
+                    return false;
+            }
+            else if (std::strcmp(arg, "--threads") == 0) {
+                if (!parse_count(arg, value, 0, threads))
+                    return false;
+            }
+            else if (std::strcmp(arg, "--checkpoint") == 0)
+                checkpoint_file = value;
+            else if (std::strcmp(arg, "--interval") == 0) {
+                if (!parse_amount(arg, value, checkpoint_interval))
+                    return false;
+            }
+            else if (std::strcmp(arg, "--noise") == 0) {
+                if (!parse_amount(arg, value, noise_threshold))
+                    return false;
+            }
+            else if (std::strcmp(arg, "--bvh-cache") == 0)
+                bvh_cache_directory = value;
+            else if (std::strcmp(arg, "--bvh-stats") == 0)
+                bvh_stats_file = value;
+            else {
+                std::cerr << "Unknown option " << arg << '\n';
+                return false;
+            }
+        }
+
+        if (samples_per_pass < 1)
+            samples_per_pass = 1;
+        return true;
+    }
+
+    // Reads value as a whole number of at least min into result, or complains and returns false.
+    static bool parse_count(const char *arg, const char *value, long min, int& result) {
+        char *end;
+        errno = 0;
+        long n = std::strtol(value, &end, 10);
+        if (end == value || *end != '\0' || errno == ERANGE || n < min || n > INT_MAX) {
+            std::cerr << "Invalid value " << value << " for " << arg << ", expected a whole number"
+                      << (min > 0 ? " above 0" : " of 0 or more") << '\n';
+            return false;
+        }
+        result = static_cast<int>(n);
+        return true;
+    }
+
+    // Reads value as a number of 0 or more into result, or complains and returns false.
+    static bool parse_amount(const char *arg, const char *value, double& result) {
+        char *end;
+        errno = 0;
+        double x = std::strtod(value, &end);
+        if (end == value || *end != '\0' || errno == ERANGE || !(x >= 0)) {
+            std::cerr << "Invalid value " << value << " for " << arg
+                      << ", expected a number of 0 or more\n";
+            return false;
+        }
+        result = x;
+        return true;
+    }
+
+    int samples_per_pixel;
+    int samples_per_pass;
+    int threads;
+    const char *checkpoint_file;
+    double checkpoint_interval;
+    double noise_threshold;
+    const char *bvh_cache_directory;
+    const char *bvh_stats_file;
+    std::vector<const char*> output_files;
+};
+
+#endif
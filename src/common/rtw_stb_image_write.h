@@ -0,0 +1,35 @@
+#ifndef RTWEEKEND_STB_IMAGE_WRITE_H
+#define RTWEEKEND_STB_IMAGE_WRITE_H
+
+
+// Disable pedantic warnings for this external library.
+#ifdef _MSC_VER
+    // Microsoft Visual C++ Compiler
+    #pragma warning (push, 0)
+    #define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+    // GCC
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "common/external/stb_image_write.h"
+
+
+// Restore warning levels.
+#ifdef _MSC_VER
+    // Microsoft Visual C++ Compiler
+    #pragma warning (pop)
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+    // GCC
+    #pragma GCC diagnostic pop
+#endif
+
+#endif
@@ -23,12 +23,9 @@ inline double clamp(double x, double min, double max) {
     return x;
 }
 
-inline double random_double() {
-    return rand() / (RAND_MAX + 1.0);
-}
-
 // Common Headers
 
+#include "common/random.h"
 #include "common/vec3.h"
 
 #endif
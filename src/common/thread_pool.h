@@ -0,0 +1,139 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// A fixed set of worker threads with one task queue per worker. parallel_for() deals the task
+// indices out to the queues in contiguous blocks; each worker drains its own queue from the
+// front and, once it runs dry, steals from the back of another worker's queue.
+
+class thread_pool {
+    public:
+        thread_pool(int num_threads = 0) : stopping(false), generation(0), remaining(0) {
+            if (num_threads <= 0)
+                num_threads = std::thread::hardware_concurrency();
+            if (num_threads <= 0)
+                num_threads = 1;
+
+            std::vector<task_queue>(num_threads).swap(queues);
+            for (int i = 0; i < num_threads; i++)
+                workers.push_back(std::thread(&thread_pool::worker_loop, this, i));
+        }
+
+        ~thread_pool() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& worker : workers)
+                worker.join();
+        }
+
+        int size() const { return static_cast<int>(workers.size()); }
+
+        // Calls task(index, worker) for every index in [0, count) and returns once all of them
+        // have finished. The worker argument is in [0, size()) and may be used to index
+        // per-thread scratch data. Not reentrant: tasks must not call parallel_for themselves.
+        void parallel_for(int count, const std::function<void(int, int)>& task) {
+            if (count <= 0)
+                return;
+
+            job = task;
+            remaining = count;
+
+            auto n = size();
+            for (int w = 0; w < n; w++) {
+                int begin = static_cast<int>(static_cast<long long>(count) * w / n);
+                int end   = static_cast<int>(static_cast<long long>(count) * (w+1) / n);
+                std::lock_guard<std::mutex> guard(queues[w].lock);
+                for (int i = begin; i < end; i++)
+                    queues[w].tasks.push_back(i);
+            }
+
+            std::unique_lock<std::mutex> guard(lock);
+            generation++;
+            wake.notify_all();
+            done.wait(guard, [this] { return remaining == 0; });
+        }
+
+    private:
+        struct task_queue {
+            std::mutex lock;
+            std::deque<int> tasks;
+        };
+
+        bool pop(int worker, int& task) {
+            auto& q = queues[worker];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.tasks.empty())
+                return false;
+            task = q.tasks.front();
+            q.tasks.pop_front();
+            return true;
+        }
+
+        bool steal(int worker, int& task) {
+            auto n = size();
+            for (int k = 1; k < n; k++) {
+                auto& q = queues[(worker + k) % n];
+                std::lock_guard<std::mutex> guard(q.lock);
+                if (!q.tasks.empty()) {
+                    task = q.tasks.back();
+                    q.tasks.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void worker_loop(int worker) {
+            unsigned seen = 0;
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    wake.wait(guard, [&] { return stopping || generation != seen; });
+                    if (stopping)
+                        return;
+                    seen = generation;
+                }
+
+                int task;
+                while (pop(worker, task) || steal(worker, task)) {
+                    job(task, worker);
+                    if (--remaining == 0) {
+                        std::lock_guard<std::mutex> guard(lock);
+                        done.notify_all();
+                    }
+                }
+            }
+        }
+
+        std::vector<std::thread> workers;
+        std::vector<task_queue> queues;
+        std::function<void(int, int)> job;
+
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+        bool stopping;
+        unsigned generation;
+        std::atomic<int> remaining;
+};
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef TILE_RENDERER_H
+#define TILE_RENDERER_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "common/rtweekend.h"
+#include "common/checkpoint.h"
+#include "common/framebuffer.h"
+#include "common/render_options.h"
+#include "common/thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+const int tile_size = 16;
+
+// Splits the image into square tiles and calls render_pixel(i, j) for every pixel, one tile per
+// task on the pool. Progress goes to std::cerr after the given status text.
+template <typename pixel_function>
+void render_tiles(
+    framebuffer& image, thread_pool& pool, const pixel_function& render_pixel,
+    const std::string& status = ""
+) {
+    auto tiles_x = (image.width  + tile_size-1) / tile_size;
+    auto tiles_y = (image.height + tile_size-1) / tile_size;
+    auto num_tiles = tiles_x * tiles_y;
+
+    auto tiles_remaining = num_tiles;
+    std::mutex progress;
+
+    std::cerr << '\r' << status << "Tiles remaining: " << num_tiles << ' ' << std::flush;
+
+    pool.parallel_for(num_tiles, [&](int tile, int) {
+        auto x0 = (tile % tiles_x) * tile_size;
+        auto y0 = (tile / tiles_x) * tile_size;
+        auto x1 = std::min(x0 + tile_size, image.width);
+        auto y1 = std::min(y0 + tile_size, image.height);
+
+        // Tiles are numbered top row first, matching the framebuffer's memory order.
+        for (int y = y0; y < y1; ++y)
+            for (int i = x0; i < x1; ++i)
+                render_pixel(i, image.height-1 - y);
+
+        std::lock_guard<std::mutex> guard(progress);
+        std::cerr << '\r' << status << "Tiles remaining: " << --tiles_remaining << ' '
+                  << std::flush;
+    });
+}
+
+// Brings every pixel up to its entry in `targets` (indexed like the framebuffer) samples.
+// sample_color(i, j, s) must return the color of sample s of pixel (i, j). The new samples of a
+// pixel are summed in order by a single thread, so the framebuffer holds the same bits no
+// matter how many threads run. The luminance variance is carried along with Welford's update.
+template <typename sample_function>
+void render_pass(
+    framebuffer& image, thread_pool& pool, const std::vector<uint32_t>& targets,
+    const sample_function& sample_color, const std::string& status = ""
+) {
+    render_tiles(image, pool, [&](int i, int j) {
+        auto k = image.index(i, j);
+        auto first = image.samples[k];
+        auto target = targets[k];
+        if (first >= target)
+            return;
+
+        vec3 color;
+        double n = first;
+        double mean = image.mean_luminance(k);
+        double m2 = image.luminance_m2[k];
+        for (auto s = first; s < target; ++s) {
+            auto c = sample_color(i, j, s);
+            color += c;
+
+            auto y = framebuffer::luminance(c);
+            auto delta = y - mean;
+            n += 1;
+            mean += delta / n;
+            m2 += delta * (y - mean);
+        }
+        image.add_samples(i, j, color, target - first, m2);
+    }, status);
+}
+
+// The estimated error of pixel k after gamma 2 and clamping to [0,1]: how far one standard error
+// of its mean luminance moves the displayed value.
+inline double display_error(const framebuffer& image, size_t k) {
+    auto n = image.samples[k];
+    auto mean = std::min(image.mean_luminance(k), 1.0);
+    auto error = std::sqrt(image.luminance_variance(k) / n);
+    if (error != error || mean != mean)
+        return 0;  // a NaN sample has already spoiled the pixel, more will not help
+    if (error == infinity)
+        return infinity;
+    return std::sqrt(std::min(mean + error, 1.0)) - std::sqrt(mean);
+}
+
+// Plans the next adaptive pass. Every pixel first gets one pass worth of samples (at least two,
+// so it has a variance). After that the pass budget, pass samples times the pixel count, is
+// shared among the pixels whose error is still above the threshold in proportion to that error,
+// with no pixel taking more than four passes worth at once. Returns false when every pixel has
+// converged or the whole budget of samples_per_pixel times the pixel count is spent.
+inline bool plan_adaptive_pass(
+    const framebuffer& image, const render_options& options, std::vector<uint32_t>& targets
+) {
+    const uint64_t num_pixels = image.samples.size();
+    const uint64_t budget = static_cast<uint64_t>(options.samples_per_pixel) * num_pixels;
+    const uint32_t pass = options.samples_per_pass;
+    const uint32_t first_pass = std::max(pass, 2u);
+
+    uint64_t spent = 0;
+    bool warming_up = false;
+    for (size_t k = 0; k < num_pixels; ++k) {
+        spent += image.samples[k];
+        targets[k] = std::max(image.samples[k], first_pass);
+        warming_up = warming_up || image.samples[k] < first_pass;
+    }
+    if (warming_up)
+        return true;
+    if (spent >= budget)
+        return false;
+
+    // A pixel whose every sample so far missed the light looks perfectly converged, so each
+    // pixel takes the worst error in its 3x3 neighbourhood (a row pass, then a column pass).
+    const int w = image.width, h = image.height;
+    std::vector<double> errors(num_pixels), row_max(num_pixels);
+    for (size_t k = 0; k < num_pixels; ++k)
+        errors[k] = display_error(image, k);
+    for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x) {
+            auto row = &errors[static_cast<size_t>(y) * w];
+            row_max[static_cast<size_t>(y) * w + x] =
+                std::max(std::max(row[std::max(x-1, 0)], row[x]), row[std::min(x+1, w-1)]);
+        }
+    double total_error = 0;
+    bool any_infinite = false;
+    for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x) {
+            auto above = row_max[static_cast<size_t>(std::max(y-1, 0)) * w + x];
+            auto below = row_max[static_cast<size_t>(std::min(y+1, h-1)) * w + x];
+            auto error = std::max(std::max(above, row_max[static_cast<size_t>(y) * w + x]), below);
+            auto k = static_cast<size_t>(y) * w + x;
+            errors[k] = error < options.noise_threshold ? 0 : error;
+            if (errors[k] == infinity)
+                any_infinite = true;
+            else
+                total_error += errors[k];
+        }
+    if (total_error == 0 && !any_infinite)
+        return false;
+
+    // Pixels whose variance overflowed take the largest share outright; they would otherwise
+    // make the total infinite and leave every other pixel with nothing.
+    auto pass_budget = static_cast<double>(std::min<uint64_t>(budget - spent, pass*num_pixels));
+    for (size_t k = 0; k < num_pixels; ++k) {
+        if (errors[k] == 0)
+            continue;
+        auto share = errors[k] == infinity
+                   ? 4.0 * pass
+                   : std::min(pass_budget * errors[k] / total_error, 4.0 * pass);
+        targets[k] = image.samples[k] + std::max(static_cast<uint32_t>(share + 0.5), 1u);
+    }
+    return true;
+}
+
+// Renders in passes of options.samples_per_pass until every pixel has
+// options.samples_per_pixel samples, or, with options.noise_threshold set, until the adaptive
+// plan above runs out of pixels or budget. With a checkpoint file, picks up from the file if it
+// exists and saves back to it at most every options.checkpoint_interval seconds and after the
+// last pass. Each pass is planned from the framebuffer alone (uniform pass boundaries fall on
+// multiples of the pass size), so a resumed render ends up with the same image as one that was
+// never interrupted, and raising --spp on a finished checkpoint refines it instead of starting
+// over.
+template <typename sample_function>
+void render_progressive(
+    framebuffer& image, thread_pool& pool, const render_options& options,
+    const sample_function& sample_color
+) {
+    auto checkpoint = options.checkpoint_file;
+    if (checkpoint && load_checkpoint(image, checkpoint))
+        std::cerr << "Resuming from " << checkpoint << '\n';
+
+    const uint32_t target = options.samples_per_pixel;
+    const uint32_t pass = options.samples_per_pass;
+    const bool adaptive = options.noise_threshold > 0;
+    std::vector<uint32_t> targets(image.samples.size());
+    auto last_save = std::chrono::steady_clock::now();
+
+    for (;;) {
+        std::string status;
+        if (adaptive) {
+            if (!plan_adaptive_pass(image, options, targets))
+                break;
+            uint64_t planned = 0;
+            for (auto t : targets)
+                planned += t;
+            status = "Samples " + std::to_string(planned / targets.size()) + '/'
+                   + std::to_string(target) + " average, ";
+        } else {
+            auto done = *std::min_element(image.samples.begin(), image.samples.end());
+            if (done >= target)
+                break;
+            auto next = std::min((done / pass + 1) * pass, target);
+            std::fill(targets.begin(), targets.end(), next);
+            status = "Samples " + std::to_string(next) + '/' + std::to_string(target) + ", ";
+        }
+
+        render_pass(image, pool, targets, sample_color, status);
+
+        if (!checkpoint)
+            continue;
+
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> since_save = now - last_save;
+        if (since_save.count() >= options.checkpoint_interval) {
+            if (!save_checkpoint(image, checkpoint))
+                std::cerr << "\nCould not save checkpoint " << checkpoint << '\n';
+            last_save = now;
+        }
+    }
+
+    if (checkpoint && !save_checkpoint(image, checkpoint))
+        std::cerr << "\nCould not save checkpoint " << checkpoint << '\n';
+}
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef TRAVERSAL_STATS_H
+#define TRAVERSAL_STATS_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include <cstdint>
+#include <iostream>
+
+#if defined(RTW_TRAVERSAL_STATS)
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#endif
+
+
+// How many BVH nodes and primitives each ray visits, for comparing traversal strategies. The
+// renderers call count_ray() as they trace each ray into the scene, saying what kind of ray it
+// is, and the BVHs and lists call count_node_visit() for every node whose box they test and
+// count_primitive_test() for every primitive they test. The counting is compiled in only when
+// RTW_TRAVERSAL_STATS is defined (the CMake option of the same name); otherwise these are empty
+// functions.
+
+enum ray_kind { camera_ray, scattered_ray, ray_kinds };
+
+inline const char *ray_kind_name(int kind) {
+    return kind == camera_ray ? "camera" : "scattered";
+}
+
+struct traversal_counts {
+    static const int buckets = 20;
+
+    traversal_counts() : rays(0), node_visits(0), max_node_visits(0), primitive_tests(0) {
+        for (int b = 0; b < buckets; b++)
+            histogram[b] = 0;
+    }
+
+    void add(const traversal_counts& other) {
+        rays += other.rays;
+        node_visits += other.node_visits;
+        max_node_visits = max_node_visits > other.max_node_visits ? max_node_visits
+                                                                  : other.max_node_visits;
+        primitive_tests += other.primitive_tests;
+        for (int b = 0; b < buckets; b++)
+            histogram[b] += other.histogram[b];
+    }
+
+    uint64_t rays;
+    uint64_t node_visits;
+    uint64_t max_node_visits;   // on any one ray
+    uint64_t primitive_tests;
+    uint64_t histogram[buckets];    // rays by visits: 0, 1, 2-3, 4-7, ..., the last open-ended
+};
+
+#if defined(RTW_TRAVERSAL_STATS)
+
+// Every thread counts into its own counter. A ray's visits are added up when the next ray on the
+// same thread starts, or when the totals are taken.
+class traversal_counter {
+    public:
+        traversal_counter() : kind(camera_ray), open(false), visits(0), tests(0) {
+            std::lock_guard<std::mutex> guard(lock());
+            live().push_back(this);
+        }
+
+        ~traversal_counter() {
+            std::lock_guard<std::mutex> guard(lock());
+            finish_ray();
+            for (int k = 0; k < ray_kinds; k++)
+                retired()[k].add(counts[k]);
+            live().erase(std::find(live().begin(), live().end(), this));
+        }
+
+        void start_ray(ray_kind k) {
+            finish_ray();
+            kind = k;
+            open = true;
+        }
+
+        void finish_ray() {
+            if (!open)
+                return;
+            traversal_counts& c = counts[kind];
+            c.rays++;
+            c.node_visits += visits;
+            if (visits > c.max_node_visits)
+                c.max_node_visits = visits;
+            c.primitive_tests += tests;
+            int b = 0;
+            for (auto v = visits; v > 0 && b < traversal_counts::buckets - 1; v >>= 1)
+                b++;
+            c.histogram[b]++;
+            open = false;
+            visits = tests = 0;
+        }
+
+        // Sums every thread's counts of one kind of ray. Call once tracing has finished.
+        static traversal_counts totals(ray_kind k) {
+            std::lock_guard<std::mutex> guard(lock());
+            traversal_counts sum = retired()[k];
+            for (auto counter : live()) {
+                counter->finish_ray();
+                sum.add(counter->counts[k]);
+            }
+            return sum;
+        }
+
+        // And of every kind.
+        static traversal_counts totals() {
+            traversal_counts sum;
+            for (int k = 0; k < ray_kinds; k++)
+                sum.add(totals(ray_kind(k)));
+            return sum;
+        }
+
+        traversal_counts counts[ray_kinds];
+        ray_kind kind;
+        bool open;
+        uint64_t visits;
+        uint64_t tests;
+
+    private:
+        static std::mutex& lock() { static std::mutex m; return m; }
+        static std::vector<traversal_counter*>& live() {
+            static std::vector<traversal_counter*> v;
+            return v;
+        }
+        static traversal_counts *retired() { static traversal_counts c[ray_kinds]; return c; }
+};
+
+inline traversal_counter& this_thread_traversal_counter() {
+    thread_local traversal_counter counter;
+    return counter;
+}
+
+inline void count_ray(ray_kind kind) { this_thread_traversal_counter().start_ray(kind); }
+inline void count_node_visit() { this_thread_traversal_counter().visits++; }
+inline void count_primitive_test() { this_thread_traversal_counter().tests++; }
+
+// Prints the visits per ray and their distribution, and the averages for each kind of ray.
+inline void print_traversal_stats(std::ostream& out) {
+    auto c = traversal_counter::totals();
+    out << "\nRays traced: " << c.rays << "\nBVH nodes visited per ray: "
+        << (c.rays ? double(c.node_visits) / c.rays : 0) << " average, "
+        << c.max_node_visits << " most\n";
+    for (int b = 0; b < traversal_counts::buckets; b++) {
+        if (!c.histogram[b])
+            continue;
+        uint64_t low = b ? 1ULL << (b-1) : 0;
+        out << "    " << low;
+        if (b == traversal_counts::buckets - 1)
+            out << "+";
+        else if (b > 1)
+            out << "-" << (1ULL << b) - 1;
+        out << ": " << c.histogram[b] << " rays\n";
+    }
+    for (int k = 0; k < ray_kinds; k++) {
+        auto kc = traversal_counter::totals(ray_kind(k));
+        if (!kc.rays)
+            continue;
+        out << ray_kind_name(k) << " rays: " << kc.rays << ", "
+            << double(kc.node_visits) / kc.rays << " nodes and "
+            << double(kc.primitive_tests) / kc.rays << " primitives per ray\n";
+    }
+}
+
+// Writes the counts of each kind of ray as a JSON object keyed by the kind's name.
+inline void write_traversal_stats_json(std::ostream& out, const char *indent) {
+    out << "{";
+    for (int k = 0; k < ray_kinds; k++) {
+        auto c = traversal_counter::totals(ray_kind(k));
+        auto per_ray = [&](uint64_t count) { return c.rays ? double(count) / c.rays : 0; };
+        out << (k ? ",\n" : "\n") << indent << "    \"" << ray_kind_name(k) << "\": {"
+            << "\"rays\": " << c.rays
+            << ", \"node_visits_per_ray\": " << per_ray(c.node_visits)
+            << ", \"max_node_visits\": " << c.max_node_visits
+            << ", \"primitive_tests_per_ray\": " << per_ray(c.primitive_tests) << "}";
+    }
+    out << "\n" << indent << "}";
+}
+
+#else
+
+inline void count_ray(ray_kind) {}
+inline void count_node_visit() {}
+inline void count_primitive_test() {}
+inline void print_traversal_stats(std::ostream&) {}
+inline void write_traversal_stats_json(std::ostream& out, const char *) { out << "null"; }
+
+#endif
+
+#endif